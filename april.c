@@ -1,6 +1,17 @@
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QD_X86 1
+#endif
 
 #include "april.h"
 
@@ -14,43 +25,458 @@ static inline int imax(int a, int b)
     return (a > b) ? a : b;
 }
 
-/** if the bits in w were arranged in a d*d grid and that grid was
- * rotated, what would the new bits in w be?
- * The bits are organized like this (for d = 3):
+/**
+ * The scan backend. Every query is compared with all ncodes codes under all
+ * four rotations; a candidate is ranked by the key
+ *
+ *   distance << 32 | rotation << 16 | id
  *
- *  8 7 6       2 5 8      0 1 2
- *  5 4 3  ==>  1 4 7 ==>  3 4 5    (rotate90 applied twice)
- *  2 1 0       0 3 6      6 7 8
- **/
-static uint64_t rotate90(uint64_t w, uint32_t d)
+ * so the smallest key is the nearest code, ties going to the lowest rotation
+ * and then the lowest id. The kernels keep the best and second-best key per
+ * vector lane; the lanes are merged at the end.
+ */
+#define QD_SCAN_NONE INT64_MAX
+
+typedef void (*qd_scan_t)(const uint64_t* codes, uint32_t ncodes, const uint64_t* q, uint64_t* best);
+
+// branch-free, since whether a key improves on the best is unpredictable.
+static inline void qd_scan_keep(uint64_t* best, uint64_t key)
+{
+    uint64_t lo = key < best[0] ? key : best[0];
+    uint64_t hi = key < best[0] ? best[0] : key;
+
+    best[1] = hi < best[1] ? hi : best[1];
+    best[0] = lo;
+}
+
+static inline __attribute__((always_inline)) void qd_scan_loop(const uint64_t* codes, uint32_t ncodes, const uint64_t* q, uint64_t* best)
+{
+    uint64_t b[2] = { best[0], best[1] };
+
+    for (uint32_t i = 0; i < ncodes; i++)
+        for (int r = 0; r < 4; r++)
+            qd_scan_keep(b, ((uint64_t)__builtin_popcountll(codes[i] ^ q[r]) << 32) | (r << 16) | i);
+
+    best[0] = b[0];
+    best[1] = b[1];
+}
+
+static void qd_scan_scalar(const uint64_t* codes, uint32_t ncodes, const uint64_t* q, uint64_t* best)
+{
+    qd_scan_loop(codes, ncodes, q, best);
+}
+
+#ifdef QD_X86
+
+// the same loop, with __builtin_popcountll() compiled to popcnt.
+__attribute__((target("popcnt"))) static void qd_scan_popcnt(const uint64_t* codes, uint32_t ncodes, const uint64_t* q, uint64_t* best)
+{
+    qd_scan_loop(codes, ncodes, q, best);
+}
+
+// 64-bit popcounts as nibble lookups summed with psadbw. Keys stay below
+// 2^63, so the signed 64-bit compare orders them correctly.
+__attribute__((target("avx2,popcnt"))) static void qd_scan_avx2(const uint64_t* codes, uint32_t ncodes, const uint64_t* q, uint64_t* best)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+
+    // one best/second-best pair per rotation, so the four chains of compares
+    // run in parallel.
+    __m256i b0[4], b1[4];
+#pragma GCC unroll 4
+    for (int r = 0; r < 4; r++)
+        b0[r] = b1[r] = _mm256_set1_epi64x(QD_SCAN_NONE);
+
+    __m256i id = _mm256_setr_epi64x(0, 1, 2, 3);
+
+    uint32_t i = 0;
+    for (; i + 4 <= ncodes; i += 4) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)&codes[i]);
+
+#pragma GCC unroll 4
+        for (int r = 0; r < 4; r++) {
+            __m256i x = _mm256_xor_si256(c, _mm256_set1_epi64x(q[r]));
+            __m256i n = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, low)),
+                _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi64(x, 4), low)));
+            n = _mm256_sad_epu8(n, _mm256_setzero_si256());
+
+            __m256i key = _mm256_or_si256(_mm256_slli_epi64(n, 32), _mm256_or_si256(id, _mm256_set1_epi64x(r << 16)));
+
+            // b1 = min(b1, max(b0, key)), b0 = min(b0, key)
+            __m256i lt = _mm256_cmpgt_epi64(b0[r], key);
+            __m256i hi = _mm256_blendv_epi8(key, b0[r], lt);
+            b0[r] = _mm256_blendv_epi8(b0[r], key, lt);
+            b1[r] = _mm256_blendv_epi8(b1[r], hi, _mm256_cmpgt_epi64(b1[r], hi));
+        }
+
+        id = _mm256_add_epi64(id, _mm256_set1_epi64x(4));
+    }
+
+    // merge the pairs, then the lanes.
+#pragma GCC unroll 4
+    for (int r = 1; r < 4; r++) {
+        __m256i lt = _mm256_cmpgt_epi64(b0[0], b0[r]);
+        __m256i hi = _mm256_blendv_epi8(b0[r], b0[0], lt);
+        __m256i lo1 = _mm256_blendv_epi8(b1[0], b1[r], _mm256_cmpgt_epi64(b1[0], b1[r]));
+        b0[0] = _mm256_blendv_epi8(b0[0], b0[r], lt);
+        b1[0] = _mm256_blendv_epi8(hi, lo1, _mm256_cmpgt_epi64(hi, lo1));
+    }
+
+    uint64_t lanes[8];
+    _mm256_storeu_si256((__m256i*)&lanes[0], b0[0]);
+    _mm256_storeu_si256((__m256i*)&lanes[4], b1[0]);
+    for (int j = 0; j < 8; j++)
+        qd_scan_keep(best, lanes[j]);
+
+    for (; i < ncodes; i++)
+        for (int r = 0; r < 4; r++)
+            qd_scan_keep(best, ((uint64_t)_mm_popcnt_u64(codes[i] ^ q[r]) << 32) | (r << 16) | i);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) static void qd_scan_avx512(const uint64_t* codes, uint32_t ncodes, const uint64_t* q, uint64_t* best)
+{
+    // one best/second-best pair per rotation, so the four chains of min/max
+    // run in parallel.
+    __m512i b0[4], b1[4];
+#pragma GCC unroll 4
+    for (int r = 0; r < 4; r++)
+        b0[r] = b1[r] = _mm512_set1_epi64(QD_SCAN_NONE);
+
+    __m512i id = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+
+    for (uint32_t i = 0; i < ncodes; i += 8) {
+        __mmask8 valid = ncodes - i >= 8 ? 0xff : (__mmask8)((1u << (ncodes - i)) - 1);
+        __m512i c = _mm512_maskz_loadu_epi64(valid, &codes[i]);
+
+#pragma GCC unroll 4
+        for (int r = 0; r < 4; r++) {
+            __m512i n = _mm512_popcnt_epi64(_mm512_xor_si512(c, _mm512_set1_epi64(q[r])));
+            __m512i key = _mm512_or_si512(_mm512_slli_epi64(n, 32), _mm512_or_si512(id, _mm512_set1_epi64(r << 16)));
+            key = _mm512_mask_mov_epi64(_mm512_set1_epi64(QD_SCAN_NONE), valid, key);
+
+            b1[r] = _mm512_min_epu64(b1[r], _mm512_max_epu64(b0[r], key));
+            b0[r] = _mm512_min_epu64(b0[r], key);
+        }
+
+        id = _mm512_add_epi64(id, _mm512_set1_epi64(8));
+    }
+
+    // merge the pairs, then the lanes: the second best is either another
+    // lane's best or the best lane's runner-up.
+#pragma GCC unroll 4
+    for (int r = 1; r < 4; r++) {
+        b1[0] = _mm512_min_epu64(_mm512_max_epu64(b0[0], b0[r]), _mm512_min_epu64(b1[0], b1[r]));
+        b0[0] = _mm512_min_epu64(b0[0], b0[r]);
+    }
+
+    uint64_t first = _mm512_reduce_min_epu64(b0[0]);
+    __mmask8 lane = _mm512_cmpeq_epu64_mask(b0[0], _mm512_set1_epi64(first));
+    uint64_t second = _mm512_reduce_min_epu64(b1[0]);
+    uint64_t others = _mm512_reduce_min_epu64(_mm512_mask_mov_epi64(b0[0], lane, _mm512_set1_epi64(QD_SCAN_NONE)));
+
+    qd_scan_keep(best, first);
+    qd_scan_keep(best, second < others ? second : others);
+}
+
+#endif
+
+static const char* qd_scan_isa = NULL;
+static qd_scan_t qd_scan_fn = NULL;
+
+static qd_scan_t qd_scan_select(void)
 {
-    uint64_t wr = 0;
+    if (__atomic_load_n(&qd_scan_isa, __ATOMIC_ACQUIRE))
+        return __atomic_load_n(&qd_scan_fn, __ATOMIC_RELAXED);
+
+    const char* isa = "scalar";
+    qd_scan_t fn = qd_scan_scalar;
+
+    // QD_SCAN_ISA=avx2|popcnt|scalar caps the kernel choice, like
+    // MATD_COUNT_ISA.
+    const char* cap = getenv("QD_SCAN_ISA");
+    int level = 3;
+    if (cap && !strcmp(cap, "avx2"))
+        level = 2;
+    else if (cap && !strcmp(cap, "popcnt"))
+        level = 1;
+    else if (cap && !strcmp(cap, "scalar"))
+        level = 0;
+
+#ifdef QD_X86
+    __builtin_cpu_init();
+    if (level >= 3 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) {
+        isa = "avx512";
+        fn = qd_scan_avx512;
+    } else if (level >= 2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        isa = "avx2";
+        fn = qd_scan_avx2;
+    } else if (level >= 1 && __builtin_cpu_supports("popcnt")) {
+        isa = "popcnt";
+        fn = qd_scan_popcnt;
+    }
+#endif
+
+    // a racing first call from another thread picks the same kernel; the
+    // name is stored last, as it marks the kernel as picked.
+    __atomic_store_n(&qd_scan_fn, fn, __ATOMIC_RELAXED);
+    __atomic_store_n(&qd_scan_isa, isa, __ATOMIC_RELEASE);
+    return fn;
+}
+
+const char* quick_decode_scan_isa(void)
+{
+    qd_scan_select();
+    return qd_scan_isa;
+}
+
+// best[0] and best[1] receive the nearest and second-nearest keys.
+static inline void qd_scan(const struct rotate90_lut* rot, const uint64_t* codes, uint32_t ncodes, uint64_t rcode, uint64_t* q, uint64_t* best)
+{
+    q[0] = rcode;
+    for (int r = 1; r < 4; r++)
+        q[r] = rotate90_lut(rot, q[r - 1]);
+
+    best[0] = best[1] = QD_SCAN_NONE;
+    qd_scan_select()(codes, ncodes, q, best);
+}
+
+int quick_decode_nearest(const apriltag_family_t* tf, uint64_t rcode, struct quick_decode_entry* entry)
+{
+    const struct quick_decode* qd = (const struct quick_decode*)tf->impl;
+    uint64_t q[4], best[2];
+
+    qd_scan(&qd->rot, tf->codes, tf->ncodes, qd_code_bits(&qd->rot, rcode), q, best);
+
+    if (best[0] == QD_SCAN_NONE) {
+        entry->rcode = 0;
+        entry->id = 65535;
+        entry->hamming = 255;
+        entry->rotation = 0;
+        return 255;
+    }
+
+    entry->rotation = (best[0] >> 16) & 3;
+    entry->rcode = q[entry->rotation];
+    entry->id = best[0] & 0xffff;
+    entry->hamming = best[0] >> 32;
+
+    return best[1] == QD_SCAN_NONE ? 255 : (int)(best[1] >> 32);
+}
+
+/**
+ * The multi-index hashing backend. The d*d code bits are cut into nmih
+ * substrings, at least maxhamming + 1 of them, so a codeword within
+ * maxhamming errors of a code matches it exactly in at least one substring.
+ * Each substring has an index from its value to the codes having that value;
+ * a lookup gathers the codes sharing a substring with the query, under each
+ * rotation, and compares only those. Candidates are ranked with the scan's
+ * keys, so both backends return the same entry.
+ */
+struct quick_decode_mih {
+    uint32_t lo, bits; // the substring is code bits [lo, lo + bits)
 
-    for (int32_t r = d - 1; r >= 0; r--) {
-        for (int32_t c = 0; c < d; c++) {
-            int32_t b = r + d * c;
+    // the codes whose substring is v are ids[start[v]] .. ids[start[v+1]-1]
+    // (16 bits suffice, as there are fewer than 65535 codes, and halve the
+    // indices' cache footprint).
+    uint16_t* start;
+    uint16_t* ids;
+};
 
-            wr = wr << 1;
+// substrings are indexed directly, so no wider than this.
+#define QD_MIH_MAX_BITS 16
 
-            if ((w & (((uint64_t)1) << b)) != 0)
-                wr |= 1;
+// with more substrings than bits some are empty, and every code is a
+// candidate through those: still correct, just a slow scan. More than
+// nbits + 1 are never needed.
+#define QD_MIH_MAX_COUNT 65
+
+static uint32_t qd_mih_count(int nbits, int maxhamming)
+{
+    return imin(imax(maxhamming + 1, (nbits + QD_MIH_MAX_BITS - 1) / QD_MIH_MAX_BITS), nbits + 1);
+}
+
+static void qd_mih_init(struct quick_decode* qd)
+{
+    int nbits = qd->rot.d * qd->rot.d;
+
+    qd->nmih = qd_mih_count(nbits, qd->maxhamming);
+    qd->mih = (struct quick_decode_mih*)calloc(qd->nmih, sizeof(struct quick_decode_mih));
+
+    for (uint32_t j = 0; j < qd->nmih; j++) {
+        struct quick_decode_mih* m = &qd->mih[j];
+        m->lo = j * nbits / qd->nmih;
+        m->bits = (j + 1) * nbits / qd->nmih - m->lo;
+
+        uint32_t nvalues = 1u << m->bits;
+        uint64_t mask = nvalues - 1;
+        m->start = (uint16_t*)calloc(nvalues + 1, sizeof(uint16_t));
+        m->ids = (uint16_t*)malloc(imax(qd->ncodes, 1) * sizeof(uint16_t));
+
+        // counting sort of the codes by substring value, so every bucket
+        // lists its codes in id order.
+        for (uint32_t i = 0; i < qd->ncodes; i++)
+            m->start[((qd->codes[i] >> m->lo) & mask) + 1]++;
+        for (uint32_t v = 0; v < nvalues; v++)
+            m->start[v + 1] += m->start[v];
+        for (uint32_t i = 0; i < qd->ncodes; i++)
+            m->ids[m->start[(qd->codes[i] >> m->lo) & mask]++] = i;
+        for (uint32_t v = nvalues; v > 0; v--)
+            m->start[v] = m->start[v - 1];
+        m->start[0] = 0;
+    }
+}
+
+static void qd_mih_destroy(struct quick_decode* qd)
+{
+    for (uint32_t j = 0; j < qd->nmih; j++) {
+        free(qd->mih[j].start);
+        free(qd->mih[j].ids);
+    }
+    free(qd->mih);
+}
+
+// best[0] receives the nearest key within maxhamming, or QD_SCAN_NONE. A
+// code met through several substrings is compared each time, which is
+// cheaper than remembering it.
+static inline __attribute__((always_inline)) void qd_mih_walk(const struct quick_decode* qd, uint64_t rcode, uint64_t* q, uint64_t* best)
+{
+    q[0] = rcode;
+    for (int r = 1; r < 4; r++)
+        q[r] = rotate90_lut(&qd->rot, q[r - 1]);
+
+    best[0] = best[1] = QD_SCAN_NONE;
+
+    for (int r = 0; r < 4; r++) {
+        // look up every substring's bucket before walking any, so the
+        // index loads overlap.
+        uint32_t k0[QD_MIH_MAX_COUNT], k1[QD_MIH_MAX_COUNT];
+        for (uint32_t j = 0; j < qd->nmih; j++) {
+            const struct quick_decode_mih* m = &qd->mih[j];
+            uint32_t v = (q[r] >> m->lo) & ((1u << m->bits) - 1);
+            k0[j] = m->start[v];
+            k1[j] = m->start[v + 1];
+        }
+
+        for (uint32_t j = 0; j < qd->nmih; j++) {
+            for (uint32_t k = k0[j]; k < k1[j]; k++) {
+                uint32_t i = qd->mih[j].ids[k];
+                int dist = __builtin_popcountll(q[r] ^ qd->codes[i]);
+                if (dist <= qd->maxhamming)
+                    qd_scan_keep(best, ((uint64_t)dist << 32) | (r << 16) | i);
+            }
         }
     }
+}
+
+typedef void (*qd_mih_lookup_t)(const struct quick_decode* qd, uint64_t rcode, uint64_t* q, uint64_t* best);
+
+static void qd_mih_lookup_scalar(const struct quick_decode* qd, uint64_t rcode, uint64_t* q, uint64_t* best)
+{
+    qd_mih_walk(qd, rcode, q, best);
+}
+
+#ifdef QD_X86
+// the same walk, with __builtin_popcountll() compiled to popcnt.
+__attribute__((target("popcnt"))) static void qd_mih_lookup_popcnt(const struct quick_decode* qd, uint64_t rcode, uint64_t* q, uint64_t* best)
+{
+    qd_mih_walk(qd, rcode, q, best);
+}
+#endif
+
+static qd_mih_lookup_t qd_mih_lookup_fn = NULL;
+
+static void qd_mih_lookup(const struct quick_decode* qd, uint64_t rcode, uint64_t* q, uint64_t* best)
+{
+    qd_mih_lookup_t fn = __atomic_load_n(&qd_mih_lookup_fn, __ATOMIC_ACQUIRE);
+    if (!fn) {
+        fn = qd_mih_lookup_scalar;
+#ifdef QD_X86
+        // QD_SCAN_ISA=scalar keeps this off popcnt too.
+        const char* cap = getenv("QD_SCAN_ISA");
+        __builtin_cpu_init();
+        if (!(cap && !strcmp(cap, "scalar")) && __builtin_cpu_supports("popcnt"))
+            fn = qd_mih_lookup_popcnt;
+#endif
+        // a racing first call from another thread picks the same kernel.
+        __atomic_store_n(&qd_mih_lookup_fn, fn, __ATOMIC_RELEASE);
+    }
 
-    return wr;
+    fn(qd, rcode, q, best);
 }
 
-void quick_decode_add(struct quick_decode* qd, uint64_t code, int id, int hamming)
+// multi-index hashing pays off once there are enough codes for the scan to
+// be slow and the substrings are wide enough to leave few codes per bucket.
+#define QD_MIH_MIN_CODES 64
+#define QD_MIH_MIN_BITS 9
+
+int quick_decode_backend(const apriltag_family_t* family, int maxhamming, int flags)
 {
-    uint32_t bucket = code % qd->nentries;
+    if (flags & QUICK_DECODE_SCAN)
+        return QUICK_DECODE_BACKEND_SCAN;
+    if (flags & QUICK_DECODE_MIH)
+        return QUICK_DECODE_BACKEND_MIH;
+    if (flags & QUICK_DECODE_TABLE)
+        return QUICK_DECODE_BACKEND_TABLE;
 
-    while (qd->entries[bucket].rcode != UINT64_MAX) {
-        bucket = (bucket + 1) % qd->nentries;
+    int nbits = family->d * family->d;
+    if (maxhamming <= 3 && nbits <= QD_CODE_BITS) {
+        // the table grows with the family size and about as nbits^maxhamming.
+        uint32_t logsize = qd_table_logsize(family->ncodes, nbits, maxhamming, (flags & QUICK_DECODE_ROTATIONS) != 0);
+        if (logsize <= 40 && (sizeof(uint64_t) << logsize) <= QUICK_DECODE_TABLE_MAX_BYTES)
+            return QUICK_DECODE_BACKEND_TABLE;
     }
 
-    qd->entries[bucket].rcode = code;
-    qd->entries[bucket].id = id;
-    qd->entries[bucket].hamming = hamming;
+    if (family->ncodes >= QD_MIH_MIN_CODES && nbits / (int)qd_mih_count(nbits, maxhamming) >= QD_MIH_MIN_BITS)
+        return QUICK_DECODE_BACKEND_MIH;
+
+    return QUICK_DECODE_BACKEND_SCAN;
+}
+
+size_t quick_decode_size(const apriltag_family_t* family)
+{
+    const struct quick_decode* qd = (const struct quick_decode*)family->impl;
+    size_t size = (size_t)qd->nentries * sizeof(uint64_t);
+
+    for (uint32_t j = 0; j < qd->nmih; j++)
+        size += (((size_t)1 << qd->mih[j].bits) + 1 + qd->ncodes) * sizeof(uint16_t);
+
+    return size;
+}
+
+struct quick_decode* quick_decode_retain(struct quick_decode* qd)
+{
+    // built-in decoders live in read-only memory and are never freed.
+    if (!qd->builtin)
+        __atomic_add_fetch(&qd->refcount, 1, __ATOMIC_RELAXED);
+    return qd;
+}
+
+void quick_decode_release(struct quick_decode* qd)
+{
+    if (!qd || qd->builtin)
+        return;
+
+    // the last reference frees the decoder; acquire orders the frees after
+    // every other thread's last use.
+    if (__atomic_sub_fetch(&qd->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    if (qd->mapping)
+        munmap(qd->mapping, qd->mapping_size);
+    else
+        free((void*)qd->entries);
+    qd_mih_destroy(qd);
+    free((void*)qd->codes);
+    free(qd);
+}
+
+void quick_decode_attach(apriltag_family_t* family, struct quick_decode* qd)
+{
+    assert(family->impl == NULL);
+
+    family->impl = quick_decode_retain(qd);
 }
 
 void quick_decode_uninit(apriltag_family_t* fam)
@@ -59,126 +485,889 @@ void quick_decode_uninit(apriltag_family_t* fam)
         return;
 
     struct quick_decode* qd = (struct quick_decode*)fam->impl;
-    free(qd->entries);
-    free(qd);
     fam->impl = NULL;
+
+    quick_decode_release(qd);
 }
 
 void quick_decode_init(apriltag_family_t* family, int maxhamming)
 {
-    assert(family->impl == NULL);
+    quick_decode_init_ex(family, maxhamming, 0);
+}
+
+struct quick_decode* quick_decode_create(const apriltag_family_t* family, int maxhamming, int flags)
+{
     assert(family->ncodes < 65535);
 
     struct quick_decode* qd = (struct quick_decode*)calloc(1, sizeof(struct quick_decode));
-    int capacity = family->ncodes;
-
     int nbits = family->d * family->d;
 
-    if (maxhamming >= 1)
-        capacity += family->ncodes * nbits;
+    qd->refcount = 1;
+
+    qd->rotations = (flags & QUICK_DECODE_ROTATIONS) != 0;
+    qd->maxhamming = maxhamming;
+    qd->backend = quick_decode_backend(family, maxhamming, flags);
+    rotate90_lut_init(&qd->rot, family->d);
 
-    if (maxhamming >= 2)
-        capacity += family->ncodes * nbits * (nbits - 1);
+    if (qd->backend != QUICK_DECODE_BACKEND_TABLE) {
+        // a copy, so the decoder does not depend on the family.
+        uint64_t* codes = (uint64_t*)malloc(imax(family->ncodes, 1) * sizeof(uint64_t));
+        memcpy(codes, family->codes, family->ncodes * sizeof(uint64_t));
+        qd->codes = codes;
+        qd->ncodes = family->ncodes;
+        if (qd->backend == QUICK_DECODE_BACKEND_MIH)
+            qd_mih_init(qd);
+        return qd;
+    }
 
-    if (maxhamming >= 3)
-        capacity += family->ncodes * nbits * (nbits - 1) * (nbits - 2);
+    assert(nbits <= QD_CODE_BITS);
 
-    qd->nentries = capacity * 3;
+    uint32_t logsize = qd_table_logsize(family->ncodes, nbits, maxhamming, qd->rotations);
+    qd->nentries = 1u << logsize;
+    qd->shift = 64 - logsize;
 
-    //    printf("capacity %d, size: %.0f kB\n",
-    //           capacity, qd->nentries * sizeof(struct quick_decode_entry) / 1024.0);
+    //    printf("size: %.0f kB\n", qd->nentries * sizeof(uint64_t) / 1024.0);
 
-    qd->entries = (struct quick_decode_entry*)calloc(qd->nentries, sizeof(struct quick_decode_entry));
-    if (qd->entries == NULL) {
+    uint64_t* entries = (uint64_t*)malloc(qd->nentries * sizeof(uint64_t));
+    if (entries == NULL) {
         printf("apriltag.c: failed to allocate hamming decode table. Reduce max hamming size.\n");
         exit(-1);
     }
 
     for (int i = 0; i < qd->nentries; i++)
-        qd->entries[i].rcode = UINT64_MAX;
+        entries[i] = QD_EMPTY;
+
+    if (maxhamming > 3) {
+        printf("apriltag.c: maxhamming beyond 3 not supported\n");
+    }
+
+    qd_table_fill(qd, entries, family->codes, 0, family->ncodes);
+    qd->entries = entries;
+
+    return qd;
+}
+
+void quick_decode_init_ex(apriltag_family_t* family, int maxhamming, int flags)
+{
+    assert(family->impl == NULL);
+
+    family->impl = quick_decode_create(family, maxhamming, flags);
+}
+
+/**
+ * Parallel table construction. The result answers every lookup exactly like
+ * the serial quick_decode_init_ex() table:
+ *
+ * 1. each thread generates the entries of a contiguous range of codes, in
+ *    serial insertion order, and counts them per shard of home buckets;
+ * 2. each thread generates its entries again and scatters them into the
+ *    shards, shard-major and thread-minor, so every shard is still in serial
+ *    insertion order;
+ * 3. each shard is counting-sorted by home bucket, which is stable, and of
+ *    any equal codes only the one qd_table_add() keeps survives;
+ * 4. each thread lays out a contiguous range of shards in one linear pass:
+ *    in a Robin Hood table every entry sits at max(home, previous slot + 1).
+ *    Entries that run past the end of a range are inserted normally
+ *    afterwards.
+ */
+struct qd_build_item {
+    uint64_t e;
+    uint64_t home;
+};
+
+struct qd_build_thread {
+    struct qd_build* build;
+    int id;
+
+    // codes [i0, i1) are generated by this thread
+    int i0, i1;
+
+    // number of items per shard, then their write offsets
+    uint32_t* shard_count;
+
+    // entries that did not fit in this thread's range of the table
+    struct qd_build_item* spill;
+    uint32_t nspill;
+    uint32_t maxprobe;
+
+    pthread_t thread;
+    int started; // runs on its own thread, not the caller's
+    int failed; // ran out of memory
+};
+
+struct qd_build {
+    const apriltag_family_t* family;
+    const struct quick_decode* qd; // the final table's geometry
+    uint64_t* entries;
+    int nthreads;
+    int logshards;
+
+    struct qd_build_thread* threads;
+    struct qd_build_item* items;
+    uint32_t* shard_start; // nshards + 1 offsets into items
+    uint32_t* shard_kept; // items left in each shard after dropping duplicates
+};
 
-    for (int i = 0; i < family->ncodes; i++) {
+static inline void qd_build_emit(struct qd_build_thread* t, int scatter, uint64_t code, int id, int hamming)
+{
+    const struct qd_build* b = t->build;
+    uint32_t shard_shift = 64 - b->qd->shift - b->logshards;
+
+    // same order as qd_table_add_rotations()
+    uint64_t w = code;
+    for (int k = 0; k < (b->qd->rotations ? 4 : 1); k++) {
+        uint32_t home = qd_hash(b->qd, w);
+        uint32_t shard = home >> shard_shift;
+
+        if (scatter) {
+            struct qd_build_item* item = &b->items[t->shard_count[shard]++];
+            item->e = qd_entry_pack(w, id, hamming, (4 - k) % 4);
+            item->home = home;
+        } else {
+            t->shard_count[shard]++;
+        }
+
+        w = rotate90_lut(&b->qd->rot, w);
+    }
+}
+
+// generates codes [t->i0, t->i1) in the same order as qd_table_fill().
+static void qd_build_generate(struct qd_build_thread* t, int scatter)
+{
+    const apriltag_family_t* family = t->build->family;
+    int nbits = family->d * family->d;
+    int maxhamming = t->build->qd->maxhamming;
+
+    for (int i = t->i0; i < t->i1; i++) {
         uint64_t code = family->codes[i];
 
-        // add exact code (hamming = 0)
-        quick_decode_add(qd, code, i, 0);
+        qd_build_emit(t, scatter, code, i, 0);
 
         if (maxhamming >= 1) {
-            // add hamming 1
             for (int j = 0; j < nbits; j++)
-                quick_decode_add(qd, code ^ (1L << j), i, 1);
+                qd_build_emit(t, scatter, code ^ (1ULL << j), i, 1);
         }
 
         if (maxhamming >= 2) {
-            // add hamming 2
             for (int j = 0; j < nbits; j++)
                 for (int k = 0; k < j; k++)
-                    quick_decode_add(qd, code ^ (1L << j) ^ (1L << k), i, 2);
+                    qd_build_emit(t, scatter, code ^ (1ULL << j) ^ (1ULL << k), i, 2);
         }
 
         if (maxhamming >= 3) {
-            // add hamming 3
             for (int j = 0; j < nbits; j++)
                 for (int k = 0; k < j; k++)
                     for (int m = 0; m < k; m++)
-                        quick_decode_add(qd, code ^ (1L << j) ^ (1L << k) ^ (1L << m), i, 3);
+                        qd_build_emit(t, scatter, code ^ (1ULL << j) ^ (1ULL << k) ^ (1ULL << m), i, 3);
+        }
+    }
+}
+
+static void* qd_build_count(void* arg)
+{
+    struct qd_build_thread* t = (struct qd_build_thread*)arg;
+
+    t->shard_count = (uint32_t*)calloc(1u << t->build->logshards, sizeof(uint32_t));
+    if (!t->shard_count) {
+        t->failed = 1;
+        return NULL;
+    }
+    qd_build_generate(t, 0);
+
+    return NULL;
+}
+
+static void* qd_build_scatter(void* arg)
+{
+    qd_build_generate((struct qd_build_thread*)arg, 1);
+
+    return NULL;
+}
+
+static void* qd_build_sort(void* arg)
+{
+    struct qd_build_thread* t = (struct qd_build_thread*)arg;
+    struct qd_build* b = t->build;
+    int nshards = 1 << b->logshards;
+
+    uint32_t shard_buckets = b->qd->nentries >> b->logshards;
+    uint32_t* count = (uint32_t*)malloc((shard_buckets + 1) * sizeof(uint32_t));
+    struct qd_build_item* sorted = NULL;
+    uint32_t sorted_size = 0;
+    t->failed = count == NULL;
+
+    for (int s = t->id; s < nshards && !t->failed; s += b->nthreads) {
+        struct qd_build_item* items = &b->items[b->shard_start[s]];
+        uint32_t n = b->shard_start[s + 1] - b->shard_start[s];
+        uint32_t base = s * shard_buckets;
+
+        if (n > sorted_size) {
+            struct qd_build_item* grown = (struct qd_build_item*)realloc(sorted, n * sizeof(struct qd_build_item));
+            if (!grown) {
+                t->failed = 1;
+                break;
+            }
+            sorted = grown;
+            sorted_size = n;
         }
 
-        if (maxhamming > 3) {
-            printf("apriltag.c: maxhamming beyond 3 not supported\n");
+        // counting sort by home bucket. It is stable, so items with the same
+        // home stay in serial insertion order.
+        memset(count, 0, (shard_buckets + 1) * sizeof(uint32_t));
+        for (uint32_t i = 0; i < n; i++)
+            count[items[i].home - base + 1]++;
+        for (uint32_t i = 1; i <= shard_buckets; i++)
+            count[i] += count[i - 1];
+        for (uint32_t i = 0; i < n; i++)
+            sorted[count[items[i].home - base]++] = items[i];
+
+        // equal codes share a home bucket; keep the entry qd_table_add()
+        // keeps: the nearest, then the lowest rotation, then the lowest id.
+        uint32_t kept = 0;
+        for (uint32_t i = 0, group = 0; i < n; i++) {
+            if (kept == 0 || items[kept - 1].home != sorted[i].home)
+                group = kept;
+
+            uint32_t j = group;
+            while (j < kept && qd_entry_code(items[j].e) != qd_entry_code(sorted[i].e))
+                j++;
+
+            if (j == kept)
+                items[kept++] = sorted[i];
+            else if (qd_entry_rank(sorted[i].e) < qd_entry_rank(items[j].e))
+                items[j] = sorted[i];
         }
+        b->shard_kept[s] = kept;
     }
 
-    family->impl = qd;
+    free(sorted);
+    free(count);
 
-    if (0) {
-        int longest_run = 0;
-        int run = 0;
-        int run_sum = 0;
-        int run_count = 0;
-
-        // This accounting code doesn't check the last possible run that
-        // occurs at the wrap-around. That's pretty insignificant.
-        for (int i = 0; i < qd->nentries; i++) {
-            if (qd->entries[i].rcode == UINT64_MAX) {
-                if (run > 0) {
-                    run_sum += run;
-                    run_count++;
-                }
-                run = 0;
-            } else {
-                run++;
-                longest_run = imax(longest_run, run);
+    return NULL;
+}
+
+static void* qd_build_place(void* arg)
+{
+    struct qd_build_thread* t = (struct qd_build_thread*)arg;
+    struct qd_build* b = t->build;
+    int nshards = 1 << b->logshards;
+
+    int s0 = (int64_t)nshards * t->id / b->nthreads;
+    int s1 = (int64_t)nshards * (t->id + 1) / b->nthreads;
+    uint64_t end = (uint64_t)(b->qd->nentries >> b->logshards) * s1;
+
+    for (uint64_t i = (uint64_t)(b->qd->nentries >> b->logshards) * s0; i < end; i++)
+        b->entries[i] = QD_EMPTY;
+
+    uint32_t nspill = 0;
+    for (int s = s0; s < s1; s++)
+        nspill += b->shard_kept[s];
+    t->spill = (struct qd_build_item*)malloc((nspill + 1) * sizeof(struct qd_build_item));
+    t->nspill = 0;
+    if (!t->spill) {
+        t->failed = 1;
+        return NULL;
+    }
+
+    uint64_t next = 0;
+    for (int s = s0; s < s1; s++) {
+        const struct qd_build_item* items = &b->items[b->shard_start[s]];
+        for (uint32_t i = 0; i < b->shard_kept[s]; i++) {
+            uint64_t pos = next > items[i].home ? next : items[i].home;
+            if (pos >= end) {
+                t->spill[t->nspill++] = items[i];
+                continue;
             }
+            b->entries[pos] = items[i].e;
+            t->maxprobe = imax(t->maxprobe, pos - items[i].home);
+            next = pos + 1;
+        }
+    }
+
+    return NULL;
+}
+
+// runs fn for every thread's share. A share whose thread cannot be created
+// runs on the caller instead, so the build only gets slower. Returns -1 if
+// any share ran out of memory.
+static int qd_build_run(struct qd_build* b, void* (*fn)(void*))
+{
+    for (int i = 1; i < b->nthreads; i++)
+        b->threads[i].started = pthread_create(&b->threads[i].thread, NULL, fn, &b->threads[i]) == 0;
+    fn(&b->threads[0]);
+
+    int failed = b->threads[0].failed;
+    for (int i = 1; i < b->nthreads; i++) {
+        if (b->threads[i].started)
+            pthread_join(b->threads[i].thread, NULL);
+        else
+            fn(&b->threads[i]);
+        failed |= b->threads[i].failed;
+    }
+
+    return failed ? -1 : 0;
+}
+
+static void qd_build_free(struct qd_build* b)
+{
+    for (int i = 0; b->threads && i < b->nthreads; i++) {
+        free(b->threads[i].spill);
+        free(b->threads[i].shard_count);
+    }
+    free(b->threads);
+    free(b->items);
+    free(b->shard_start);
+    free(b->shard_kept);
+}
+
+// gives up on a parallel build and builds the table serially instead.
+static void qd_build_fail(struct qd_build* b, apriltag_family_t* family, int maxhamming, int flags)
+{
+    qd_build_free(b);
+    free(b->entries);
+    free((struct quick_decode*)b->qd);
+    quick_decode_init_ex(family, maxhamming, flags);
+}
+
+void quick_decode_init_parallel(apriltag_family_t* family, int maxhamming, int flags, int nthreads)
+{
+    // the scan backend has nothing to build.
+    if (nthreads <= 1 || family->ncodes < 2 || quick_decode_backend(family, maxhamming, flags) != QUICK_DECODE_BACKEND_TABLE) {
+        quick_decode_init_ex(family, maxhamming, flags);
+        return;
+    }
+
+    assert(family->impl == NULL);
+    assert(family->ncodes < 65535);
+    assert(family->d * family->d <= QD_CODE_BITS);
+
+    if (nthreads > (int)family->ncodes)
+        nthreads = family->ncodes;
+
+    struct quick_decode* qd = (struct quick_decode*)calloc(1, sizeof(struct quick_decode));
+    if (!qd) {
+        quick_decode_init_ex(family, maxhamming, flags);
+        return;
+    }
+    qd->refcount = 1;
+    int nbits = family->d * family->d;
+
+    qd->rotations = (flags & QUICK_DECODE_ROTATIONS) != 0;
+    qd->maxhamming = maxhamming;
+    rotate90_lut_init(&qd->rot, family->d);
+
+    uint32_t logsize = qd_table_logsize(family->ncodes, nbits, maxhamming, qd->rotations);
+    qd->nentries = 1u << logsize;
+    qd->shift = 64 - logsize;
+
+    if (maxhamming > 3) {
+        printf("apriltag.c: maxhamming beyond 3 not supported\n");
+    }
+
+    struct qd_build b;
+    memset(&b, 0, sizeof(b));
+    b.family = family;
+    b.qd = qd;
+    b.nthreads = nthreads;
+
+    // shards of at most 2^16 buckets keep the sort's working set in cache,
+    // and there are a few per thread for load balance.
+    b.logshards = logsize > 16 ? logsize - 16 : 0;
+    while ((1 << b.logshards) < 8 * nthreads && b.logshards < (int)logsize)
+        b.logshards++;
+    int nshards = 1 << b.logshards;
+
+    // running out of memory anywhere in the build falls back to the serial
+    // one, which needs only the table itself.
+    b.threads = (struct qd_build_thread*)calloc(nthreads, sizeof(struct qd_build_thread));
+    if (!b.threads || (b.shard_start = (uint32_t*)calloc(nshards + 1, sizeof(uint32_t))) == NULL) {
+        qd_build_fail(&b, family, maxhamming, flags);
+        return;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        b.threads[i].build = &b;
+        b.threads[i].id = i;
+        b.threads[i].i0 = (int64_t)family->ncodes * i / nthreads;
+        b.threads[i].i1 = (int64_t)family->ncodes * (i + 1) / nthreads;
+    }
+
+    if (qd_build_run(&b, qd_build_count) != 0) {
+        qd_build_fail(&b, family, maxhamming, flags);
+        return;
+    }
+
+    // turn the per-thread shard counts into write offsets, shard-major and
+    // thread-minor.
+    uint32_t nitems = 0;
+    for (int s = 0; s < nshards; s++) {
+        b.shard_start[s] = nitems;
+        for (int i = 0; i < nthreads; i++) {
+            uint32_t n = b.threads[i].shard_count[s];
+            b.threads[i].shard_count[s] = nitems;
+            nitems += n;
         }
+    }
+    b.shard_start[nshards] = nitems;
 
-        printf("quick decode: longest run: %d, average run %.3f\n", longest_run, 1.0 * run_sum / run_count);
+    b.items = (struct qd_build_item*)malloc(((size_t)nitems + 1) * sizeof(struct qd_build_item));
+    if (!b.items || qd_build_run(&b, qd_build_scatter) != 0) {
+        qd_build_fail(&b, family, maxhamming, flags);
+        return;
     }
+
+    b.shard_kept = (uint32_t*)calloc(nshards, sizeof(uint32_t));
+    if (!b.shard_kept || qd_build_run(&b, qd_build_sort) != 0) {
+        qd_build_fail(&b, family, maxhamming, flags);
+        return;
+    }
+
+    b.entries = (uint64_t*)malloc(qd->nentries * sizeof(uint64_t));
+    if (b.entries == NULL) {
+        printf("apriltag.c: failed to allocate hamming decode table. Reduce max hamming size.\n");
+        exit(-1);
+    }
+
+    if (qd_build_run(&b, qd_build_place) != 0) {
+        qd_build_fail(&b, family, maxhamming, flags);
+        return;
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        struct qd_build_thread* t = &b.threads[i];
+
+        qd->maxprobe = imax(qd->maxprobe, t->maxprobe);
+        for (uint32_t j = 0; j < t->nspill; j++)
+            qd_table_add(qd, b.entries, qd_entry_code(t->spill[j].e), qd_entry_id(t->spill[j].e),
+                qd_entry_hamming(t->spill[j].e), qd_entry_rotation(t->spill[j].e));
+    }
+    qd_build_free(&b);
+
+    qd->entries = b.entries;
+    family->impl = qd;
+}
+
+int quick_decode_probe_histogram(const apriltag_family_t* family, uint32_t* hist, int nhist)
+{
+    const struct quick_decode* qd = (const struct quick_decode*)family->impl;
+    uint32_t mask = qd->nentries - 1;
+
+    for (int i = 0; i < nhist; i++)
+        hist[i] = 0;
+
+    int longest = 0;
+    for (uint32_t bucket = 0; bucket < qd->nentries; bucket++) {
+        uint64_t cur = qd->entries[bucket];
+        if (cur == QD_EMPTY)
+            continue;
+
+        int dist = (bucket - qd_hash(qd, qd_entry_code(cur))) & mask;
+        longest = imax(longest, dist);
+        if (nhist > 0)
+            hist[imin(dist, nhist - 1)]++;
+    }
+
+    return longest;
+}
+
+// probes the table for 'rcode' alone; returns the packed entry or QD_EMPTY.
+static inline uint64_t qd_table_lookup(const struct quick_decode* qd, uint64_t rcode)
+{
+    uint32_t mask = qd->nentries - 1;
+    uint32_t bucket = qd_hash(qd, rcode);
+
+    for (uint32_t dist = 0; dist <= qd->maxprobe; dist++, bucket = (bucket + 1) & mask) {
+        uint64_t cur = qd->entries[bucket];
+        if (cur == QD_EMPTY)
+            break;
+        if (qd_entry_code(cur) == rcode)
+            return cur;
+        // Robin Hood invariant: our code would have displaced this entry.
+        if (((bucket - qd_hash(qd, qd_entry_code(cur))) & mask) < dist)
+            break;
+    }
+
+    return QD_EMPTY;
 }
 
 // returns an entry with hamming set to 255 if no decode was found.
-void quick_decode_codeword(apriltag_family_t* tf, uint64_t rcode, struct quick_decode_entry* entry)
+static inline void quick_decode_resolve(const struct quick_decode* qd, uint64_t rcode, struct quick_decode_entry* entry)
 {
-    struct quick_decode* qd = (struct quick_decode*)tf->impl;
+    rcode = qd_code_bits(&qd->rot, rcode);
+
+    if (qd->backend != QUICK_DECODE_BACKEND_TABLE) {
+        uint64_t q[4], best[2];
+        if (qd->backend == QUICK_DECODE_BACKEND_MIH)
+            qd_mih_lookup(qd, rcode, q, best);
+        else
+            qd_scan(&qd->rot, qd->codes, qd->ncodes, rcode, q, best);
+
+        if (best[0] != QD_SCAN_NONE && (int)(best[0] >> 32) <= qd->maxhamming) {
+            entry->rotation = (best[0] >> 16) & 3;
+            entry->rcode = q[entry->rotation];
+            entry->id = best[0] & 0xffff;
+            entry->hamming = best[0] >> 32;
+            return;
+        }
+    } else if (qd->rotations) {
+        uint64_t e = qd_table_lookup(qd, rcode);
 
-    for (int ridx = 0; ridx < 4; ridx++) {
+        if (e != QD_EMPTY) {
+            entry->rcode = qd_entry_code(e);
+            entry->id = qd_entry_id(e);
+            entry->hamming = qd_entry_hamming(e);
+            entry->rotation = qd_entry_rotation(e);
 
-        for (int bucket = rcode % qd->nentries;
-             qd->entries[bucket].rcode != UINT64_MAX;
-             bucket = (bucket + 1) % qd->nentries) {
+            // report the rotated codeword, as the four-probe lookup does.
+            for (int k = 0; k < entry->rotation; k++)
+                entry->rcode = rotate90_lut(&qd->rot, entry->rcode);
+            return;
+        }
+    } else {
+        // the nearest of the four rotations' matches, as the scan ranks
+        // them; nothing after an exact match can beat it.
+        uint64_t best = QD_EMPTY;
+        int best_ridx = 0;
+        for (int ridx = 0; ridx < 4; ridx++) {
+            uint64_t e = qd_table_lookup(qd, rcode);
 
-            if (qd->entries[bucket].rcode == rcode) {
-                *entry = qd->entries[bucket];
-                entry->rotation = ridx;
-                return;
+            if (e != QD_EMPTY && (best == QD_EMPTY || qd_entry_hamming(e) < qd_entry_hamming(best))) {
+                best = e;
+                best_ridx = ridx;
+                if (qd_entry_hamming(e) == 0)
+                    break;
             }
+
+            rcode = rotate90_lut(&qd->rot, rcode);
         }
 
-        rcode = rotate90(rcode, tf->d);
+        if (best != QD_EMPTY) {
+            entry->rcode = qd_entry_code(best);
+            entry->id = qd_entry_id(best);
+            entry->hamming = qd_entry_hamming(best);
+            entry->rotation = best_ridx;
+            return;
+        }
     }
 
     entry->rcode = 0;
     entry->id = 65535;
     entry->hamming = 255;
     entry->rotation = 0;
-}
\ No newline at end of file
+}
+
+void quick_decode_lookup(const struct quick_decode* qd, uint64_t rcode, struct quick_decode_entry* entry)
+{
+    quick_decode_resolve(qd, rcode, entry);
+}
+
+void quick_decode_codeword(apriltag_family_t* tf, uint64_t rcode, struct quick_decode_entry* entry)
+{
+    quick_decode_resolve((const struct quick_decode*)tf->impl, rcode, entry);
+}
+
+// codewords hashed and prefetched ahead of being resolved
+#define QD_BATCH 16
+
+void quick_decode_lookups(const struct quick_decode* qd, const uint64_t* rcodes, size_t n, struct quick_decode_entry* entries)
+{
+    if (qd->backend != QUICK_DECODE_BACKEND_TABLE) {
+        for (size_t i = 0; i < n; i++)
+            quick_decode_resolve(qd, rcodes[i], &entries[i]);
+        return;
+    }
+
+    for (size_t i0 = 0; i0 < n; i0 += QD_BATCH) {
+        size_t i1 = i0 + QD_BATCH < n ? i0 + QD_BATCH : n;
+
+        // touch the home bucket of every probe the lookups below will make,
+        // so that the cache misses overlap instead of being taken one by one.
+        for (size_t i = i0; i < i1; i++) {
+            uint64_t rcode = qd_code_bits(&qd->rot, rcodes[i]);
+
+            if (qd->rotations) {
+                __builtin_prefetch(&qd->entries[qd_hash(qd, rcode)]);
+            } else {
+                for (int ridx = 0; ridx < 4; ridx++) {
+                    __builtin_prefetch(&qd->entries[qd_hash(qd, rcode)]);
+                    rcode = rotate90_lut(&qd->rot, rcode);
+                }
+            }
+        }
+
+        for (size_t i = i0; i < i1; i++)
+            quick_decode_resolve(qd, rcodes[i], &entries[i]);
+    }
+}
+
+void quick_decode_codewords(apriltag_family_t* tf, const uint64_t* rcodes, size_t n, struct quick_decode_entry* entries)
+{
+    quick_decode_lookups((const struct quick_decode*)tf->impl, rcodes, n, entries);
+}
+
+struct quick_decode_multi* quick_decode_multi_create(apriltag_family_t** families, int nfamilies, int maxhamming)
+{
+    assert(nfamilies > 0);
+
+    struct quick_decode_multi* qdm = (struct quick_decode_multi*)calloc(1, sizeof(struct quick_decode_multi));
+    qdm->nfamilies = nfamilies;
+    qdm->families = (apriltag_family_t**)malloc(nfamilies * sizeof(apriltag_family_t*));
+    qdm->offset = (uint32_t*)malloc((nfamilies + 1) * sizeof(uint32_t));
+
+    qdm->offset[0] = 0;
+    for (int f = 0; f < nfamilies; f++) {
+        assert(families[f]->d == families[0]->d);
+        qdm->families[f] = families[f];
+        qdm->offset[f + 1] = qdm->offset[f] + families[f]->ncodes;
+    }
+
+    qdm->codes = (uint64_t*)malloc(imax(qdm->offset[nfamilies], 1) * sizeof(uint64_t));
+    for (int f = 0; f < nfamilies; f++)
+        memcpy(&qdm->codes[qdm->offset[f]], families[f]->codes, families[f]->ncodes * sizeof(uint64_t));
+
+    // a family made of all the codes, in global id order.
+    apriltag_family_t all = *families[0];
+    all.ncodes = qdm->offset[nfamilies];
+    all.codes = qdm->codes;
+    all.impl = NULL;
+
+    qdm->qd = quick_decode_create(&all, maxhamming, QUICK_DECODE_ROTATIONS);
+
+    return qdm;
+}
+
+void quick_decode_multi_destroy(struct quick_decode_multi* qdm)
+{
+    if (!qdm)
+        return;
+
+    quick_decode_release(qdm->qd);
+    free(qdm->codes);
+    free(qdm->offset);
+    free(qdm->families);
+    free(qdm);
+}
+
+void quick_decode_multi_codeword(const struct quick_decode_multi* qdm, uint64_t rcode, struct quick_decode_multi_entry* entry)
+{
+    const struct quick_decode* qd = qdm->qd;
+    struct quick_decode_entry e;
+
+    quick_decode_resolve(qd, rcode, &e);
+
+    entry->rcode = e.rcode;
+    entry->hamming = e.hamming;
+    entry->rotation = e.rotation;
+    entry->family = NULL;
+    entry->id = 65535;
+
+    if (e.hamming == 255)
+        return;
+
+    int f = 0;
+    while (e.id >= qdm->offset[f + 1])
+        f++;
+
+    entry->family = qdm->families[f];
+    entry->id = e.id - qdm->offset[f];
+}
+
+/**
+ * On-disk layout of a prebuilt quick_decode table: this header, padded to
+ * QD_FILE_HEADER_SIZE bytes so the entries are page aligned, followed by
+ * nentries packed entries in host byte order.
+ */
+#define QD_FILE_MAGIC "QDTABLE"
+#define QD_FILE_VERSION 3
+#define QD_FILE_HEADER_SIZE 4096
+
+struct quick_decode_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+
+    // identifies the family and build parameters; a mismatch means the file
+    // is stale and gets rebuilt.
+    char family[32];
+    uint64_t family_checksum;
+    uint32_t maxhamming;
+    uint32_t rotations;
+
+    uint32_t nentries;
+    uint32_t shift;
+    uint32_t maxprobe;
+    uint32_t entry_size;
+
+    // covers the entries, so a torn or corrupted file can be rebuilt instead
+    // of decoding to wrong ids; checked with QUICK_DECODE_VERIFY.
+    uint64_t entries_checksum;
+};
+
+// FNV-1a over everything that determines the table contents.
+static uint64_t quick_decode_family_checksum(const apriltag_family_t* family)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint64_t words[3] = { family->ncodes, family->d, family->h };
+
+    const uint8_t* p = (const uint8_t*)words;
+    for (size_t i = 0; i < sizeof(words); i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+
+    p = (const uint8_t*)family->codes;
+    for (size_t i = 0; i < family->ncodes * sizeof(uint64_t); i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+
+    return h;
+}
+
+// FNV-1a over the packed entries, a word at a time.
+static uint64_t quick_decode_entries_checksum(const uint64_t* entries, uint32_t nentries)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (uint32_t i = 0; i < nentries; i++)
+        h = (h ^ entries[i]) * 0x100000001b3ULL;
+
+    return h;
+}
+
+static void quick_decode_file_header_init(struct quick_decode_file_header* hdr, const apriltag_family_t* family,
+    int maxhamming, int flags)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, QD_FILE_MAGIC, sizeof(QD_FILE_MAGIC));
+    hdr->version = QD_FILE_VERSION;
+    hdr->header_size = QD_FILE_HEADER_SIZE;
+    strncpy(hdr->family, family->name ? family->name : "", sizeof(hdr->family) - 1);
+    hdr->family_checksum = quick_decode_family_checksum(family);
+    hdr->maxhamming = maxhamming;
+    hdr->rotations = (flags & QUICK_DECODE_ROTATIONS) != 0;
+    hdr->entry_size = sizeof(uint64_t);
+}
+
+// maps 'path' if it holds a table matching 'want'; returns NULL otherwise.
+// 'verify' also checks the entries, which reads all of them.
+static struct quick_decode* quick_decode_map_file(const char* path, const struct quick_decode_file_header* want, int verify)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    struct quick_decode_file_header hdr;
+    if (fstat(fd, &st) != 0 || st.st_size < QD_FILE_HEADER_SIZE
+        || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+        || memcmp(hdr.magic, want->magic, sizeof(hdr.magic)) != 0
+        || hdr.version != want->version
+        || hdr.header_size != want->header_size
+        || strncmp(hdr.family, want->family, sizeof(hdr.family)) != 0
+        || hdr.family_checksum != want->family_checksum
+        || hdr.maxhamming != want->maxhamming
+        || hdr.rotations != want->rotations
+        || hdr.entry_size != want->entry_size
+        || hdr.nentries == 0 || (hdr.nentries & (hdr.nentries - 1)) != 0
+        || hdr.shift != 64 - __builtin_ctz(hdr.nentries)
+        || hdr.maxprobe >= hdr.nentries
+        || (uint64_t)st.st_size != QD_FILE_HEADER_SIZE + (uint64_t)hdr.nentries * sizeof(uint64_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    const uint64_t* entries = (const uint64_t*)((uint8_t*)mapping + QD_FILE_HEADER_SIZE);
+    if (verify && quick_decode_entries_checksum(entries, hdr.nentries) != hdr.entries_checksum) {
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+
+    struct quick_decode* qd = (struct quick_decode*)calloc(1, sizeof(struct quick_decode));
+    qd->refcount = 1;
+    qd->nentries = hdr.nentries;
+    qd->shift = hdr.shift;
+    qd->maxprobe = hdr.maxprobe;
+    qd->rotations = hdr.rotations;
+    qd->maxhamming = hdr.maxhamming;
+    qd->mapping = mapping;
+    qd->mapping_size = st.st_size;
+    qd->entries = (uint64_t*)entries;
+
+    return qd;
+}
+
+static int quick_decode_write_file(const char* path, struct quick_decode_file_header* hdr, const struct quick_decode* qd)
+{
+    hdr->nentries = qd->nentries;
+    hdr->shift = qd->shift;
+    hdr->maxprobe = qd->maxprobe;
+    hdr->entries_checksum = quick_decode_entries_checksum(qd->entries, qd->nentries);
+
+    // write next to the destination, flush it and rename, so that concurrent
+    // readers, or a restart after a crash, only ever see a complete file.
+    char* tmp = (char*)malloc(strlen(path) + 32);
+    sprintf(tmp, "%s.tmp.%d", path, (int)getpid());
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(tmp);
+        return -1;
+    }
+
+    uint8_t* header = (uint8_t*)calloc(1, QD_FILE_HEADER_SIZE);
+    memcpy(header, hdr, sizeof(*hdr));
+
+    size_t size = qd->nentries * sizeof(uint64_t);
+    int ok = write(fd, header, QD_FILE_HEADER_SIZE) == QD_FILE_HEADER_SIZE
+        && write(fd, qd->entries, size) == (ssize_t)size;
+    ok = ok && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok)
+        unlink(tmp);
+
+    free(header);
+    free(tmp);
+
+    return ok ? 0 : -1;
+}
+
+int quick_decode_init_file(apriltag_family_t* family, int maxhamming, int flags, const char* path)
+{
+    assert(family->impl == NULL);
+
+    // the scan backend has no table to store.
+    if (quick_decode_backend(family, maxhamming, flags) != QUICK_DECODE_BACKEND_TABLE) {
+        quick_decode_init_ex(family, maxhamming, flags);
+        return 0;
+    }
+
+    struct quick_decode_file_header hdr;
+    quick_decode_file_header_init(&hdr, family, maxhamming, flags);
+
+    struct quick_decode* qd = quick_decode_map_file(path, &hdr, (flags & QUICK_DECODE_VERIFY) != 0);
+    if (qd) {
+        rotate90_lut_init(&qd->rot, family->d);
+        family->impl = qd;
+        return 1;
+    }
+
+    quick_decode_init_ex(family, maxhamming, flags);
+
+    if (quick_decode_write_file(path, &hdr, (struct quick_decode*)family->impl) != 0) {
+        printf("apriltag.c: failed to write decode table %s\n", path);
+        return 0;
+    }
+
+    // swap the private table for the shared mapping of the file just
+    // written, once it reads back intact.
+    qd = quick_decode_map_file(path, &hdr, 1);
+    if (qd) {
+        quick_decode_uninit(family);
+        rotate90_lut_init(&qd->rot, family->d);
+        family->impl = qd;
+    }
+
+    return 0;
+}
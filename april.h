@@ -1,6 +1,7 @@
 #ifndef APRIL_H
 #define APRIL_H
 
+#include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -25,7 +26,9 @@ typedef struct apriltag_family {
 
     // some detector implementations may preprocess codes in order to
     // accelerate decoding.  They put their data here. (Do not use the
-    // same apriltag_family instance in more than one implementation)
+    // same apriltag_family instance in more than one implementation;
+    // to share a decoder, see quick_decode_create() and
+    // quick_decode_attach())
     void* impl;
 } apriltag_family_t;
 
@@ -36,12 +39,438 @@ struct quick_decode_entry {
     uint8_t rotation; // number of rotations [0, 3]
 };
 
+// Functions below that build decode tables are marked QD_CONSTEXPR so that
+// C++ code can also run them at compile time (see quick_decode_static.h).
+#ifdef __cplusplus
+#define QD_CONSTEXPR constexpr
+#else
+#define QD_CONSTEXPR
+#endif
+
+/** if the bits in w were arranged in a d*d grid and that grid was
+ * rotated, what would the new bits in w be?
+ * The bits are organized like this (for d = 3):
+ *
+ *  8 7 6       2 5 8      0 1 2
+ *  5 4 3  ==>  1 4 7 ==>  3 4 5    (rotate90 applied twice)
+ *  2 1 0       0 3 6      6 7 8
+ **/
+static inline QD_CONSTEXPR uint64_t rotate90(uint64_t w, uint32_t d)
+{
+    uint64_t wr = 0;
+
+    for (int32_t r = d - 1; r >= 0; r--) {
+        for (int32_t c = 0; c < (int32_t)d; c++) {
+            int32_t b = r + d * c;
+
+            wr = wr << 1;
+
+            if ((w & (((uint64_t)1) << b)) != 0)
+                wr |= 1;
+        }
+    }
+
+    return wr;
+}
+
+// Table-driven rotate90(): the d*d code bits are split into bytes, and
+// lut[i][b] holds the rotated image of byte value b at byte position i.
+struct rotate90_lut {
+    uint32_t d;
+    uint32_t nbytes;
+    uint64_t lut[8][256];
+};
+
+static inline QD_CONSTEXPR void rotate90_lut_init(struct rotate90_lut* rot, uint32_t d)
+{
+    assert(d * d <= 64);
+
+    rot->d = d;
+    rot->nbytes = (d * d + 7) / 8;
+
+    for (uint32_t i = 0; i < rot->nbytes; i++)
+        for (uint32_t b = 0; b < 256; b++)
+            rot->lut[i][b] = rotate90(((uint64_t)b) << (8 * i), d);
+}
+
+// rotates w by 90 degrees, exactly like rotate90().
+static inline QD_CONSTEXPR uint64_t rotate90_lut(const struct rotate90_lut* rot, uint64_t w)
+{
+    uint64_t wr = 0;
+    for (uint32_t i = 0; i < rot->nbytes; i++)
+        wr |= rot->lut[i][(w >> (8 * i)) & 0xff];
+    return wr;
+}
+
+// the d*d code bits of a codeword; every backend ignores the bits above.
+static inline QD_CONSTEXPR uint64_t qd_code_bits(const struct rotate90_lut* rot, uint64_t w)
+{
+    uint32_t nbits = rot->d * rot->d;
+    return nbits < 64 ? w & ((((uint64_t)1) << nbits) - 1) : w;
+}
+
+// Packed table entries: the code in the low QD_CODE_BITS bits, then the tag
+// id, hamming distance and rotation. QD_EMPTY marks an unused slot; it can
+// never be a real entry because ids are limited to less than 65535.
+#define QD_CODE_BITS 44
+#define QD_CODE_MASK ((((uint64_t)1) << QD_CODE_BITS) - 1)
+#define QD_EMPTY UINT64_MAX
+
+static inline QD_CONSTEXPR uint64_t qd_entry_pack(uint64_t code, int id, int hamming, int rotation)
+{
+    return code | ((uint64_t)id << QD_CODE_BITS) | ((uint64_t)hamming << 60) | ((uint64_t)rotation << 62);
+}
+
+static inline QD_CONSTEXPR uint64_t qd_entry_code(uint64_t e) { return e & QD_CODE_MASK; }
+static inline QD_CONSTEXPR int qd_entry_id(uint64_t e) { return (e >> QD_CODE_BITS) & 0xffff; }
+static inline QD_CONSTEXPR int qd_entry_hamming(uint64_t e) { return (e >> 60) & 3; }
+static inline QD_CONSTEXPR int qd_entry_rotation(uint64_t e) { return (e >> 62) & 3; }
+
+// orders entries by hamming distance, then rotation, then id.
+static inline QD_CONSTEXPR uint32_t qd_entry_rank(uint64_t e)
+{
+    return ((uint32_t)qd_entry_hamming(e) << 18) | ((uint32_t)qd_entry_rotation(e) << 16) | qd_entry_id(e);
+}
+
+// An open-addressing Robin Hood hash table of packed entries. The size is a
+// power of two and codes are placed with a multiplicative hash; no entry is
+// ever displaced more than maxprobe slots from its home bucket.
 struct quick_decode {
-    int nentries;
-    struct quick_decode_entry* entries;
+    uint32_t nentries;
+    uint32_t shift; // 64 - log2(nentries)
+    uint32_t maxprobe;
+    const uint64_t* entries;
+
+    // non-zero if all four rotations of every code were inserted, with the
+    // rotation index precomputed, so a lookup is a single probe.
+    int rotations;
+    int maxhamming;
+
+    // when the table was loaded with quick_decode_init_file(), entries
+    // points into this read-only mapping of the table file.
+    void* mapping;
+    size_t mapping_size;
+
+    // non-zero if the table was generated at compile time and lives in
+    // read-only static storage.
+    int builtin;
+
+    // references held, see quick_decode_retain(); unused when builtin.
+    int refcount;
+
+    // QUICK_DECODE_BACKEND_TABLE, or QUICK_DECODE_BACKEND_SCAN, in which
+    // case there is no table and lookups compare against the family's codes
+    // (codes and ncodes, not owned) directly, or QUICK_DECODE_BACKEND_MIH,
+    // which finds the codes worth comparing through nmih substring indices.
+    int backend;
+    const uint64_t* codes;
+    uint32_t ncodes;
+    uint32_t nmih;
+    struct quick_decode_mih* mih;
+
+    struct rotate90_lut rot;
 };
 
+#define QUICK_DECODE_BACKEND_TABLE 0
+#define QUICK_DECODE_BACKEND_SCAN 1
+#define QUICK_DECODE_BACKEND_MIH 2
+
+static inline QD_CONSTEXPR uint32_t qd_hash(const struct quick_decode* qd, uint64_t code)
+{
+    return (uint32_t)((code * 0x9e3779b97f4a7c15ULL) >> qd->shift);
+}
+
+// log2 of the table size for the given family parameters: the number of
+// generated codes, rounded up so the load factor stays at or below 1/2,
+// which keeps probe chains short.
+static inline QD_CONSTEXPR uint32_t qd_table_logsize(uint32_t ncodes, uint32_t nbits, int maxhamming, int rotations)
+{
+    uint64_t capacity = ncodes;
+
+    if (maxhamming >= 1)
+        capacity += (uint64_t)ncodes * nbits;
+
+    if (maxhamming >= 2)
+        capacity += (uint64_t)ncodes * nbits * (nbits - 1) / 2;
+
+    if (maxhamming >= 3)
+        capacity += (uint64_t)ncodes * nbits * (nbits - 1) * (nbits - 2) / 6;
+
+    if (rotations)
+        capacity *= 4;
+
+    uint32_t logsize = 1;
+    while ((((uint64_t)1) << logsize) < capacity * 2)
+        logsize++;
+
+    return logsize;
+}
+
+// inserts a packed entry into the table whose slots are 'entries' (the
+// writable view of qd->entries).
+static inline QD_CONSTEXPR void qd_table_add(struct quick_decode* qd, uint64_t* entries, uint64_t code, int id, int hamming, int rotation)
+{
+    uint32_t mask = qd->nentries - 1;
+    uint32_t bucket = qd_hash(qd, code);
+    uint32_t dist = 0;
+
+    // the same codeword can be reached from several codes, or from one code
+    // under several rotations. Keep the one the scan would pick: the
+    // nearest, then the lowest rotation, then the lowest id.
+    for (;; bucket = (bucket + 1) & mask, dist++) {
+        uint64_t cur = entries[bucket];
+        if (cur == QD_EMPTY || ((bucket - qd_hash(qd, qd_entry_code(cur))) & mask) < dist)
+            break;
+
+        if (qd_entry_code(cur) == code) {
+            uint64_t e = qd_entry_pack(code, id, hamming, rotation);
+            if (qd_entry_rank(e) < qd_entry_rank(cur))
+                entries[bucket] = e;
+            return;
+        }
+    }
+
+    // Robin Hood insertion: take the slot of any entry that is closer to its
+    // home bucket than we are to ours, and carry on inserting that one.
+    uint64_t e = qd_entry_pack(code, id, hamming, rotation);
+
+    for (;; bucket = (bucket + 1) & mask, dist++) {
+        uint64_t cur = entries[bucket];
+        if (cur == QD_EMPTY) {
+            entries[bucket] = e;
+            if (dist > qd->maxprobe)
+                qd->maxprobe = dist;
+            return;
+        }
+
+        uint32_t cur_dist = (bucket - qd_hash(qd, qd_entry_code(cur))) & mask;
+        if (cur_dist < dist) {
+            entries[bucket] = e;
+            if (dist > qd->maxprobe)
+                qd->maxprobe = dist;
+            e = cur;
+            dist = cur_dist;
+        }
+    }
+}
+
+// adds 'code', or all four of its rotations when the table holds rotations.
+// A codeword that has to be rotated r times to match 'code' is code rotated
+// (4 - r) times.
+static inline QD_CONSTEXPR void qd_table_add_rotations(struct quick_decode* qd, uint64_t* entries, uint64_t code, int id, int hamming)
+{
+    if (!qd->rotations) {
+        qd_table_add(qd, entries, code, id, hamming, 0);
+        return;
+    }
+
+    uint64_t w = code;
+    for (int k = 0; k < 4; k++) {
+        qd_table_add(qd, entries, w, id, hamming, (4 - k) % 4);
+        w = rotate90_lut(&qd->rot, w);
+    }
+}
+
+// inserts codes [i0, i1) of 'codes' and their variants with up to
+// qd->maxhamming (at most 3) bit errors into an empty table.
+static inline QD_CONSTEXPR void qd_table_fill(struct quick_decode* qd, uint64_t* entries, const uint64_t* codes, int i0, int i1)
+{
+    int nbits = qd->rot.d * qd->rot.d;
+    int maxhamming = qd->maxhamming;
+
+    for (int i = i0; i < i1; i++) {
+        uint64_t code = codes[i];
+
+        // add exact code (hamming = 0)
+        qd_table_add_rotations(qd, entries, code, i, 0);
+
+        if (maxhamming >= 1) {
+            // add hamming 1
+            for (int j = 0; j < nbits; j++)
+                qd_table_add_rotations(qd, entries, code ^ (1ULL << j), i, 1);
+        }
+
+        if (maxhamming >= 2) {
+            // add hamming 2
+            for (int j = 0; j < nbits; j++)
+                for (int k = 0; k < j; k++)
+                    qd_table_add_rotations(qd, entries, code ^ (1ULL << j) ^ (1ULL << k), i, 2);
+        }
+
+        if (maxhamming >= 3) {
+            // add hamming 3
+            for (int j = 0; j < nbits; j++)
+                for (int k = 0; k < j; k++)
+                    for (int m = 0; m < k; m++)
+                        qd_table_add_rotations(qd, entries, code ^ (1ULL << j) ^ (1ULL << k) ^ (1ULL << m), i, 3);
+        }
+    }
+}
+
+// quick_decode_init_ex() flags. Without QUICK_DECODE_TABLE,
+// QUICK_DECODE_SCAN or QUICK_DECODE_MIH the backend is picked automatically:
+// the table, unless maxhamming is beyond 3, the codes are wider than
+// QD_CODE_BITS or the table would take more than
+// QUICK_DECODE_TABLE_MAX_BYTES. Then multi-index hashing for families with
+// enough codes and wide enough substrings to pay off, else the scan.
+// Whatever the backend, a codeword within maxhamming of several codes
+// decodes to the nearest, then the lowest rotation, then the lowest id.
+#define QUICK_DECODE_ROTATIONS 1
+#define QUICK_DECODE_TABLE 2
+#define QUICK_DECODE_SCAN 4
+#define QUICK_DECODE_MIH 8
+// quick_decode_init_file() only: check the stored entries against their
+// checksum, reading the whole file, before using an existing file.
+#define QUICK_DECODE_VERIFY 16
+
+#define QUICK_DECODE_TABLE_MAX_BYTES (64u << 20)
+
 void quick_decode_init(apriltag_family_t* family, int maxhamming);
+void quick_decode_init_ex(apriltag_family_t* family, int maxhamming, int flags);
+void quick_decode_uninit(apriltag_family_t* family);
+
+/**
+ * Decoders are never modified once built, and are reference counted, so
+ * one decoder can serve any number of families, detectors and threads at
+ * once. quick_decode_create() builds a decoder like quick_decode_init_ex()
+ * does, but returns it, holding one reference, instead of attaching it. The
+ * decoder keeps no pointer into 'family'.
+ */
+struct quick_decode* quick_decode_create(const apriltag_family_t* family, int maxhamming, int flags);
+struct quick_decode* quick_decode_retain(struct quick_decode* qd);
+
+/**
+ * Drops a reference; the last one frees the decoder. Any thread may drop
+ * the last reference.
+ */
+void quick_decode_release(struct quick_decode* qd);
+
+/**
+ * Makes 'qd' the family's decoder, taking a reference that
+ * quick_decode_uninit() drops.
+ */
+void quick_decode_attach(apriltag_family_t* family, struct quick_decode* qd);
+
+/**
+ * quick_decode_codeword() and quick_decode_codewords() straight on a
+ * decoder. Any number of threads may call these concurrently.
+ */
+void quick_decode_lookup(const struct quick_decode* qd, uint64_t rcode, struct quick_decode_entry* entry);
+void quick_decode_lookups(const struct quick_decode* qd, const uint64_t* rcodes, size_t n, struct quick_decode_entry* entries);
+
+/**
+ * Same as quick_decode_init_ex(), but builds the table with 'nthreads'
+ * threads. The resulting table answers every lookup exactly like the serial
+ * one. A thread that cannot be created leaves its share to the calling
+ * thread, and if the build's own buffers cannot be allocated the table is
+ * built serially.
+ */
+void quick_decode_init_parallel(apriltag_family_t* family, int maxhamming, int flags, int nthreads);
+
+/**
+ * Like quick_decode_init_ex(), but backed by the prebuilt table file at
+ * 'path'. If the file exists and was built for the same family codes,
+ * maxhamming and flags, it is mapped read-only, so startup costs next to
+ * nothing and every process using the file shares one page-cache copy.
+ * Otherwise the table is built, written to 'path' (atomically, via a
+ * temporary file and rename) and then mapped. If the file cannot be written
+ * the freshly built private table is used.
+ *
+ * Mapping an existing file checks only its header, so the entries are read
+ * from disk as lookups need them. With QUICK_DECODE_VERIFY the entries are
+ * checked against the checksum stored in the header first, and a damaged
+ * file is rebuilt; a file just written is always checked that way.
+ *
+ * Returns 1 if an existing file was used, 0 if the table was built.
+ */
+int quick_decode_init_file(apriltag_family_t* family, int maxhamming, int flags, const char* path);
+
+/**
+ * Decodes rcode, a codeword of d*d bits; any bits above those are ignored,
+ * whatever the backend.
+ */
 void quick_decode_codeword(apriltag_family_t* tf, uint64_t rcode, struct quick_decode_entry* entry);
 
+/**
+ * Decodes n codewords at once; entries[i] receives exactly what
+ * quick_decode_codeword(tf, rcodes[i], &entries[i]) would. The codewords are
+ * hashed and their buckets prefetched in small groups, so the table's cache
+ * misses overlap.
+ */
+void quick_decode_codewords(apriltag_family_t* tf, const uint64_t* rcodes, size_t n, struct quick_decode_entry* entries);
+
+/**
+ * Finds the code nearest to rcode, under any of the four rotations, by a
+ * brute-force scan of the family's codes, whatever maxhamming and backend
+ * the decoder was initialized with. entry receives the best match exactly as
+ * quick_decode_codeword() reports it (ties go to the lowest rotation, then
+ * the lowest id), except that it is returned at any distance. Returns the
+ * distance to the second-nearest (code, rotation), or 255 if there is none;
+ * the gap between the two is a measure of confidence.
+ */
+int quick_decode_nearest(const apriltag_family_t* tf, uint64_t rcode, struct quick_decode_entry* entry);
+
+/**
+ * The QUICK_DECODE_BACKEND_* quick_decode_init_ex() would use for these
+ * arguments.
+ */
+int quick_decode_backend(const apriltag_family_t* family, int maxhamming, int flags);
+
+/**
+ * Bytes of memory held by the family's decoder: the table, or the
+ * multi-index hashing indices.
+ */
+size_t quick_decode_size(const apriltag_family_t* family);
+
+/**
+ * The instruction set the scan backend uses: "avx512", "avx2", "popcnt" or
+ * "scalar".
+ */
+const char* quick_decode_scan_isa(void);
+
+/**
+ * A decoder for several tag families at once, e.g. for scenes mixing
+ * families. All the families' codes go into one decoder, tag i of family f
+ * getting the global id offset[f] + i, so a codeword is resolved against
+ * every family in a single lookup. When a codeword is within maxhamming of
+ * codes of several families (or several codes), the nearest one wins, then
+ * the lowest rotation, then the family listed first.
+ *
+ * The families must have the same d, since a codeword is sampled on one
+ * grid; bits of rcode above d*d are ignored. The decoder is never modified
+ * after quick_decode_multi_create(), so any number of threads can share it.
+ * It keeps pointers to the families, which must outlive it.
+ */
+struct quick_decode_multi {
+    struct quick_decode* qd;
+    int nfamilies;
+    apriltag_family_t** families;
+    uint32_t* offset; // nfamilies + 1 global ids
+    uint64_t* codes; // all the families' codes, in global id order
+};
+
+struct quick_decode_multi_entry {
+    uint64_t rcode; // the queried code, rotated as the match requires
+    const apriltag_family_t* family; // NULL if no decode was found
+    uint16_t id; // the tag ID within its family
+    uint8_t hamming; // how many errors corrected?
+    uint8_t rotation; // number of rotations [0, 3]
+};
+
+/**
+ * Builds a combined decoder for 'nfamilies' families, picking the backend
+ * like quick_decode_init_ex(family, maxhamming, QUICK_DECODE_ROTATIONS)
+ * would for one family holding all their codes.
+ */
+struct quick_decode_multi* quick_decode_multi_create(apriltag_family_t** families, int nfamilies, int maxhamming);
+void quick_decode_multi_destroy(struct quick_decode_multi* qdm);
+void quick_decode_multi_codeword(const struct quick_decode_multi* qdm, uint64_t rcode, struct quick_decode_multi_entry* entry);
+
+/**
+ * Fills hist[i] with the number of table entries displaced i slots from their
+ * home bucket; the last bucket also counts anything displaced further.
+ * Returns the longest displacement.
+ */
+int quick_decode_probe_histogram(const apriltag_family_t* family, uint32_t* hist, int nhist);
+
 #endif
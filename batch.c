@@ -0,0 +1,422 @@
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "batch.h"
+
+// how many images per thread ordered output may run ahead of the oldest
+// unfinished one.
+#define BATCH_WINDOW 64
+
+// queue slots per consuming thread.
+#define BATCH_QUEUE_DEPTH 4
+
+struct batch_item {
+    uint64_t index; // position in the source
+    void* frame; // decoded frame, or NULL if decoding failed
+    char path[PATH_MAX];
+    char line[BATCH_LINE_MAX];
+};
+
+/**
+ * A bounded blocking queue of items between two stages. Pushing to a full
+ * queue and popping from an empty one block. Once every producer has called
+ * batch_queue_done(), pops drain the queue and then return NULL.
+ */
+struct batch_queue {
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty, not_full;
+    struct batch_item** items;
+    uint32_t capacity, head, count;
+    int nproducers;
+};
+
+// returns 0, or -1 if the slots cannot be allocated.
+static int batch_queue_init(struct batch_queue* q, uint32_t capacity, int nproducers)
+{
+    q->items = (struct batch_item**)malloc(capacity * sizeof(struct batch_item*));
+    if (!q->items)
+        return -1;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->nproducers = nproducers;
+    return 0;
+}
+
+static void batch_queue_destroy(struct batch_queue* q)
+{
+    assert(q->count == 0);
+    free(q->items);
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->mutex);
+}
+
+static void batch_queue_push(struct batch_queue* q, struct batch_item* item)
+{
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == q->capacity)
+        pthread_cond_wait(&q->not_full, &q->mutex);
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static struct batch_item* batch_queue_pop(struct batch_queue* q)
+{
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == 0 && q->nproducers > 0)
+        pthread_cond_wait(&q->not_empty, &q->mutex);
+
+    struct batch_item* item = NULL;
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->mutex);
+
+    return item;
+}
+
+static void batch_queue_done(struct batch_queue* q)
+{
+    pthread_mutex_lock(&q->mutex);
+    if (--q->nproducers == 0)
+        pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+struct batch {
+    // the source; exactly one of these is open.
+    FILE* list;
+    DIR* dir;
+    const char* dirname;
+    glob_t glob;
+    size_t glob_next;
+    int globbed;
+
+    batch_decode_t decode;
+    batch_detect_t detect;
+    void* arg;
+    FILE* out;
+    int ordered;
+
+    struct batch_queue read, decoded;
+
+    // guards the source, the output and the stats.
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint64_t nread; // paths handed out
+    uint64_t nwritten; // lines written, in order
+    uint32_t window;
+    char (*lines)[BATCH_LINE_MAX]; // ordered results, by index % window
+    uint8_t* done;
+
+    batch_stats_t stats;
+};
+
+static int64_t batch_utime_now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// reads the next path of the source into 'path'. Returns 0, or -1 at the
+// end. Paths that do not fit in 'size' are reported and skipped rather than
+// cut short. Called with the mutex held.
+static int batch_next_path(struct batch* b, char* path, size_t size)
+{
+    if (b->list) {
+        while (fgets(path, size, b->list)) {
+            size_t len = strcspn(path, "\r\n");
+            if (path[len] == 0 && len == size - 1) {
+                // the buffer filled before the end of the line, unless the
+                // line ends right here.
+                int c = fgetc(b->list);
+                if (c != EOF && c != '\n' && c != '\r') {
+                    while (c != EOF && c != '\n')
+                        c = fgetc(b->list);
+                    fprintf(stderr, "batch: %.64s...: path too long, skipped\n", path);
+                    continue;
+                }
+            }
+            path[len] = 0;
+            if (len > 0)
+                return 0;
+        }
+        return -1;
+    }
+
+    if (b->dir) {
+        struct dirent* e;
+        while ((e = readdir(b->dir)) != NULL) {
+            if (e->d_name[0] == '.' || e->d_type == DT_DIR)
+                continue;
+            if (snprintf(path, size, "%s/%s", b->dirname, e->d_name) >= (int)size) {
+                fprintf(stderr, "batch: %s/%s: path too long, skipped\n", b->dirname, e->d_name);
+                continue;
+            }
+
+            // some file systems do not fill in d_type, and a link may name a
+            // directory. A path that cannot be stat'ed is left for the
+            // decode stage to report.
+            struct stat st;
+            if ((e->d_type == DT_UNKNOWN || e->d_type == DT_LNK) && stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+                continue;
+            return 0;
+        }
+        return -1;
+    }
+
+    while (b->glob_next < b->glob.gl_pathc) {
+        const char* name = b->glob.gl_pathv[b->glob_next++];
+        if (snprintf(path, size, "%s", name) < (int)size)
+            return 0;
+        fprintf(stderr, "batch: %s: path too long, skipped\n", name);
+    }
+
+    return -1;
+}
+
+// starts reading 'path' into the page cache in the background, so the
+// decode stage finds it there.
+static void batch_prefetch(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+static void* batch_reader(void* p)
+{
+    struct batch* b = (struct batch*)p;
+
+    for (;;) {
+        struct batch_item* item = (struct batch_item*)malloc(sizeof(struct batch_item));
+        if (!item) {
+            fprintf(stderr, "batch: out of memory, stopped reading\n");
+            break;
+        }
+
+        pthread_mutex_lock(&b->mutex);
+        if (batch_next_path(b, item->path, sizeof(item->path)) != 0) {
+            pthread_mutex_unlock(&b->mutex);
+            free(item);
+            break;
+        }
+        item->index = b->nread++;
+        // the output slot for this image is free once the image a window
+        // earlier has been written.
+        while (b->ordered && item->index >= b->nwritten + b->window)
+            pthread_cond_wait(&b->cond, &b->mutex);
+        pthread_mutex_unlock(&b->mutex);
+
+        batch_prefetch(item->path);
+        batch_queue_push(&b->read, item);
+    }
+
+    batch_queue_done(&b->read);
+
+    return NULL;
+}
+
+static void* batch_decoder(void* p)
+{
+    struct batch* b = (struct batch*)p;
+    int64_t busy = 0;
+
+    struct batch_item* item;
+    while ((item = batch_queue_pop(&b->read)) != NULL) {
+        int64_t t0 = batch_utime_now();
+        item->frame = b->decode(b->arg, item->path, item->line, sizeof(item->line));
+        busy += batch_utime_now() - t0;
+
+        batch_queue_push(&b->decoded, item);
+    }
+
+    batch_queue_done(&b->decoded);
+
+    pthread_mutex_lock(&b->mutex);
+    b->stats.decode_time += busy;
+    pthread_mutex_unlock(&b->mutex);
+
+    return NULL;
+}
+
+// writes the result line of 'item', in input order if requested.
+static void batch_write(struct batch* b, struct batch_item* item, int ret)
+{
+    pthread_mutex_lock(&b->mutex);
+    b->stats.nimages++;
+    b->stats.nerrors += ret != 0;
+
+    if (!b->ordered) {
+        fprintf(b->out, "%s\n", item->line);
+    } else {
+        uint32_t slot = item->index % b->window;
+        memcpy(b->lines[slot], item->line, sizeof(item->line));
+        b->done[slot] = 1;
+        int wrote = 0;
+        for (slot = b->nwritten % b->window; b->done[slot]; slot = b->nwritten % b->window) {
+            fprintf(b->out, "%s\n", b->lines[slot]);
+            b->done[slot] = 0;
+            b->nwritten++;
+            wrote = 1;
+        }
+        if (wrote)
+            pthread_cond_broadcast(&b->cond);
+    }
+    pthread_mutex_unlock(&b->mutex);
+}
+
+static void* batch_detector(void* p)
+{
+    struct batch* b = (struct batch*)p;
+    workspace_t* ws = workspace_create(0);
+    int64_t busy = 0;
+
+    struct batch_item* item;
+    while ((item = batch_queue_pop(&b->decoded)) != NULL) {
+        int ret = -1;
+        if (item->frame) {
+            int64_t t0 = batch_utime_now();
+            ret = b->detect(b->arg, ws, item->frame, item->path, item->line, sizeof(item->line));
+            busy += batch_utime_now() - t0;
+            workspace_reset(ws);
+        }
+
+        batch_write(b, item, ret);
+        free(item);
+    }
+
+    workspace_destroy(ws);
+
+    pthread_mutex_lock(&b->mutex);
+    b->stats.detect_time += busy;
+    pthread_mutex_unlock(&b->mutex);
+
+    return NULL;
+}
+
+// frees the output window and closes the source.
+static void batch_close(struct batch* b)
+{
+    free(b->done);
+    free(b->lines);
+    if (b->dir)
+        closedir(b->dir);
+    if (b->globbed)
+        globfree(&b->glob);
+}
+
+int batch_run(const char* source, const batch_config_t* config, batch_decode_t decode, batch_detect_t detect, void* arg, FILE* out, batch_stats_t* stats)
+{
+    struct batch b;
+    memset(&b, 0, sizeof(b));
+
+    struct stat st;
+    if (!strcmp(source, "-")) {
+        b.list = stdin;
+    } else if (stat(source, &st) == 0 && S_ISDIR(st.st_mode)) {
+        b.dir = opendir(source);
+        b.dirname = source;
+        if (!b.dir)
+            return -1;
+    } else {
+        // GLOB_NOCHECK passes a pattern that matches nothing through, so a
+        // missing file is reported as a failed image rather than ignored.
+        if (glob(source, GLOB_NOCHECK, NULL, &b.glob) != 0)
+            return -1;
+        b.globbed = 1;
+    }
+
+    int nreaders = config->nreaders > 0 ? config->nreaders : 1;
+    int ndecoders = config->ndecoders > 0 ? config->ndecoders : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int ndetectors = config->ndetectors > 0 ? config->ndetectors : 1;
+    if (ndecoders <= 0)
+        ndecoders = 1;
+    int nthreads = nreaders + ndecoders + ndetectors;
+
+    b.decode = decode;
+    b.detect = detect;
+    b.arg = arg;
+    b.out = out;
+    b.ordered = config->ordered;
+    b.window = BATCH_WINDOW * nthreads;
+    if (b.ordered) {
+        b.lines = (char(*)[BATCH_LINE_MAX])malloc((size_t)b.window * BATCH_LINE_MAX);
+        b.done = (uint8_t*)calloc(b.window, 1);
+    }
+    pthread_t* threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+    if ((b.ordered && (!b.lines || !b.done)) || !threads
+        || batch_queue_init(&b.read, BATCH_QUEUE_DEPTH * ndecoders, nreaders) != 0) {
+        free(threads);
+        batch_close(&b);
+        return -1;
+    }
+    if (batch_queue_init(&b.decoded, BATCH_QUEUE_DEPTH * ndetectors, ndecoders) != 0) {
+        batch_queue_destroy(&b.read);
+        free(threads);
+        batch_close(&b);
+        return -1;
+    }
+    pthread_mutex_init(&b.mutex, NULL);
+    pthread_cond_init(&b.cond, NULL);
+
+    int64_t t0 = batch_utime_now();
+
+    // stages start from the last, so a stage that gets no threads at all
+    // can be drained by the ones after it. A thread that cannot be created
+    // leaves its stage one thread short, and is counted as a producer that
+    // has already finished.
+    int started = 0, ok = 1;
+    int nstage[3] = { ndetectors, ndecoders, nreaders };
+    void* (*stage_fn[3])(void*) = { batch_detector, batch_decoder, batch_reader };
+    struct batch_queue* stage_out[3] = { NULL, &b.decoded, &b.read };
+    for (int s = 0; s < 3; s++) {
+        int n = 0;
+        for (int i = 0; ok && i < nstage[s]; i++)
+            n += pthread_create(&threads[started + n], NULL, stage_fn[s], &b) == 0;
+        for (int i = n; stage_out[s] && i < nstage[s]; i++)
+            batch_queue_done(stage_out[s]);
+        started += n;
+        ok = n > 0;
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    b.stats.elapsed = batch_utime_now() - t0;
+    fflush(out);
+    assert(!b.ordered || b.nwritten == b.nread);
+
+    batch_queue_destroy(&b.decoded);
+    batch_queue_destroy(&b.read);
+    pthread_cond_destroy(&b.cond);
+    pthread_mutex_destroy(&b.mutex);
+    batch_close(&b);
+
+    if (stats)
+        *stats = b.stats;
+
+    return ok ? 0 : -1;
+}
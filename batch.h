@@ -0,0 +1,84 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "workspace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * batch_run() is a pipeline of three stages joined by bounded queues, each
+ * with its own threads, so that disk reads, image decoding and detection
+ * overlap:
+ *
+ *   read    takes paths from the source and asks the kernel to start
+ *           reading each file (posix_fadvise(WILLNEED)), without waiting.
+ *   decode  turns a path into a frame with the batch_decode_t callback.
+ *   detect  turns a frame into a result line with the batch_detect_t
+ *           callback, and writes the line.
+ *
+ * A full queue stalls the stage feeding it, so at most a few frames per
+ * thread are held in memory whatever the size of the batch.
+ */
+
+/**
+ * Decodes the image 'path'. Returns the frame, or NULL with an error line
+ * (without the newline) in 'line'.
+ */
+typedef void* (*batch_decode_t)(void* arg, const char* path, char* line, size_t size);
+
+/**
+ * Processes a frame returned by the batch_decode_t callback, which it then
+ * frees: writes the result line (without the newline) to 'line' and returns
+ * 0, or -1 if the image could not be processed. 'ws' belongs to the calling
+ * thread and is reset after every image.
+ */
+typedef int (*batch_detect_t)(void* arg, workspace_t* ws, void* frame, const char* path, char* line, size_t size);
+
+#define BATCH_LINE_MAX 512
+
+typedef struct {
+    int nreaders; // read stage threads, 0 for 1
+    int ndecoders; // decode stage threads, 0 for one per CPU
+    int ndetectors; // detect stage threads, 0 for 1
+    int ordered; // write lines in input order
+} batch_config_t;
+
+typedef struct {
+    uint64_t nimages; // images processed
+    uint64_t nerrors; // of which failed
+    int64_t elapsed; // wall time in microseconds
+    int64_t decode_time; // time spent in the callbacks, in microseconds
+    int64_t detect_time; // summed over each stage's threads
+} batch_stats_t;
+
+/**
+ * Runs the pipeline over every image of 'source' and writes each result
+ * line to 'out' as it finishes.
+ *
+ * 'source' is "-" for a newline-delimited list of paths on stdin, a
+ * directory for the files in it, or else a glob pattern (a plain path is a
+ * pattern that matches itself). Paths are read lazily, so lists of millions
+ * of images are never held in memory.
+ *
+ * With config->ordered set, lines are written in input order: finished
+ * results wait for the ones before them, and the read stage stalls rather
+ * than run more than a bounded window ahead of the oldest unfinished image.
+ * Otherwise lines are written in completion order.
+ *
+ * A stage runs with fewer threads than asked for if some cannot be
+ * created. Returns 0, or -1 if the source cannot be opened, memory runs out
+ * or some stage gets no thread at all.
+ */
+int batch_run(const char* source, const batch_config_t* config, batch_decode_t decode, batch_detect_t detect, void* arg, FILE* out, batch_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
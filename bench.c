@@ -0,0 +1,708 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "april.h"
+#include "integral.h"
+#include "matd.h"
+#include "matd_view.h"
+#include "quad.h"
+#include "tag25h9.h"
+#include "threshold.h"
+#include "workspace.h"
+
+static int64_t utime_now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// a noisy 9x9-cell test frame of the given size.
+static uint8_t* bench_frame(int width, int height)
+{
+    uint8_t* buf = (uint8_t*)malloc((size_t)width * height);
+    int dim = width / 9;
+
+    srand(1);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int cell = (y / dim) * 9 + x / dim;
+            int on = ((cell * 2654435761u) >> 7) & 1;
+            buf[(size_t)y * width + x] = (on ? 160 : 40) + rand() % 64;
+        }
+    }
+
+    return buf;
+}
+
+/**
+ * Checks matd_sample_code() bit for bit against the three-stage path it
+ * replaces, matd_reduce() then matd_select() then matd_value(), over random
+ * frame sizes, row strides, cell sizes, thresholds and cell selections. The
+ * padding past each row is filled with bright pixels, so a kernel that
+ * reads past the frame's width changes the code.
+ */
+static int bench_sample(int argc, char** argv)
+{
+    int ntrials = argc > 0 ? atoi(argv[0]) : 2000;
+    int ndiffer = 0;
+
+    srand(4);
+    for (int t = 0; t < ntrials; t++) {
+        int dim = 1 + rand() % 40;
+        int ncols = 1 + rand() % 12, nrows = 1 + rand() % 12;
+        // partial cells at the right and bottom edges are never counted.
+        int width = ncols * dim + rand() % dim, height = nrows * dim + rand() % dim;
+        int stride = width + rand() % 70;
+        int thresh = rand() % 256;
+        int num = rand() % (dim * dim + 1);
+
+        int r0 = rand() % nrows, c0 = rand() % ncols;
+        int r1 = r0 + rand() % (nrows - r0), c1 = c0 + rand() % (ncols - c0);
+        while ((r1 - r0 + 1) * (c1 - c0 + 1) > 64)
+            r1--;
+
+        uint8_t* buf = (uint8_t*)malloc((size_t)stride * height);
+        uint8_t* packed = (uint8_t*)malloc((size_t)width * height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < stride; x++)
+                buf[(size_t)y * stride + x] = x < width ? rand() & 0xff : 0xff;
+            memcpy(&packed[(size_t)y * width], &buf[(size_t)y * stride], width);
+        }
+
+        image_u8_t im = image_u8_view(width, height, stride, buf);
+        uint64_t fused = matd_sample_code(&im, dim, thresh, num, r0, r1, c0, c1);
+
+        matd_t* m = matd_create_data(height, width, packed);
+        matd_t* cells = matd_reduce(m, dim, thresh, num);
+        matd_t* sel = matd_select(cells, r0, r1, c0, c1);
+        uint64_t staged = matd_value(sel);
+        matd_destroy(sel);
+        matd_destroy(cells);
+        matd_destroy(m);
+
+        if (fused != staged && ndiffer++ < 10)
+            printf("%dx%d stride %d dim %d thresh %d num %d cells %d-%d,%d-%d: %llx != %llx\n", width, height,
+                stride, dim, thresh, num, r0, r1, c0, c1, (unsigned long long)fused, (unsigned long long)staged);
+
+        free(packed);
+        free(buf);
+    }
+
+    printf("%d frames, count kernel %s\n", ntrials, matd_count_isa());
+    printf("results %s\n", ndiffer == 0 ? "match" : "DIFFER");
+
+    return ndiffer == 0 ? 0 : 1;
+}
+
+/**
+ * Samples the interior 5x5 cells of a 9x9 grid under many grid hypotheses
+ * (offset and cell size), once with matd_sample_code() straight from the
+ * pixels and once from a summed-area table built once for the frame.
+ */
+static int bench_integral(int argc, char** argv)
+{
+    int width = argc > 0 ? atoi(argv[0]) : 1920;
+    int height = argc > 1 ? atoi(argv[1]) : 1080;
+    int thresh = 128;
+
+    uint8_t* buf = bench_frame(width, height);
+    image_u8_t im = image_u8_view(width, height, width, buf);
+
+    int base = (width < height ? width : height) / 9;
+    int nhyp = 0;
+    uint64_t direct_sum = 0, integral_sum = 0;
+
+    int64_t t0 = utime_now();
+    for (int dim = base - 4; dim <= base; dim++) {
+        for (int y0 = 0; y0 < 4; y0++) {
+            for (int x0 = 0; x0 < 4; x0++) {
+                image_u8_t roi = image_u8_roi(&im, x0, y0, width - x0, height - y0);
+                direct_sum += matd_sample_code(&roi, dim, thresh, dim * dim / 2, 2, 6, 2, 6);
+                nhyp++;
+            }
+        }
+    }
+    int64_t t1 = utime_now();
+    int64_t direct = t1 - t0;
+
+    // the first build also pays for faulting in the table's pages.
+    integral_t* ii = integral_create(width, height);
+    integral_build(&im, thresh, ii);
+    t1 = utime_now();
+    integral_build(&im, thresh, ii);
+    int64_t t2 = utime_now();
+    for (int dim = base - 4; dim <= base; dim++) {
+        for (int y0 = 0; y0 < 4; y0++) {
+            for (int x0 = 0; x0 < 4; x0++) {
+                integral_sum += matd_sample_code_integral(ii, x0, y0, dim, dim * dim / 2, 2, 6, 2, 6);
+            }
+        }
+    }
+    int64_t t3 = utime_now();
+
+    printf("frame %dx%d, %d grid hypotheses, count kernel %s\n", width, height, nhyp, matd_count_isa());
+    printf("direct loop       %8.3f ms\n", direct / 1000.0);
+    printf("integral build    %8.3f ms\n", (t2 - t1) / 1000.0);
+    printf("integral queries  %8.3f ms\n", (t3 - t2) / 1000.0);
+    printf("results %s\n", direct_sum == integral_sum ? "match" : "DIFFER");
+
+    integral_destroy(ii);
+    free(buf);
+
+    return direct_sum == integral_sum ? 0 : 1;
+}
+
+// tag25h9 or, given ncodes > 0, a synthetic family of that many random
+// 36-bit codes (tag36h11 has 587).
+static apriltag_family_t* bench_family(int ncodes)
+{
+    apriltag_family_t* family = tag25h9_create();
+    if (ncodes > 0) {
+        family->d = 6;
+        family->ncodes = ncodes;
+        family->codes = (uint64_t*)realloc(family->codes, ncodes * sizeof(uint64_t));
+        srand(3);
+        for (int i = 0; i < ncodes; i++)
+            family->codes[i] = (((uint64_t)rand() << 31) ^ rand()) & ((1ULL << 36) - 1);
+    }
+
+    return family;
+}
+
+// random codewords, with every 16th one a valid code with 1 bit error.
+static uint64_t* bench_codewords(const apriltag_family_t* family, int n)
+{
+    uint64_t* codes = (uint64_t*)malloc(n * sizeof(uint64_t));
+    int nbits = family->d * family->d;
+
+    srand(2);
+    for (int i = 0; i < n; i++) {
+        uint64_t r = ((uint64_t)rand() << 31) ^ rand();
+        if (i % 16 == 0)
+            codes[i] = family->codes[r % family->ncodes] ^ (1ULL << (r % nbits));
+        else
+            codes[i] = r & ((1ULL << nbits) - 1);
+    }
+
+    return codes;
+}
+
+/**
+ * Measures quick_decode_codeword() lookups/sec on tag25h9, or a synthetic
+ * family of ncodes codes: the table with and without the four rotations
+ * stored, the scan and multi-index hashing.
+ */
+static int bench_decode(int argc, char** argv)
+{
+    int maxhamming = argc > 0 ? atoi(argv[0]) : 2;
+    int ncodes = argc > 1 ? atoi(argv[1]) : 0;
+    int n = 1 << 20;
+
+    static const struct {
+        const char* name;
+        int flags;
+    } modes[] = {
+        { "plain", QUICK_DECODE_TABLE },
+        { "rotations", QUICK_DECODE_TABLE | QUICK_DECODE_ROTATIONS },
+        { "scan", QUICK_DECODE_SCAN },
+        { "mih", QUICK_DECODE_MIH },
+    };
+
+    for (int m = 0; m < 4; m++) {
+        apriltag_family_t* family = bench_family(ncodes);
+
+        // skip the tables the automatic choice considers too big.
+        if ((modes[m].flags & QUICK_DECODE_TABLE)
+            && quick_decode_backend(family, maxhamming, modes[m].flags & QUICK_DECODE_ROTATIONS) != QUICK_DECODE_BACKEND_TABLE) {
+            tag25h9_destroy(family);
+            continue;
+        }
+
+        int64_t t0 = utime_now();
+        quick_decode_init_ex(family, maxhamming, modes[m].flags);
+        int64_t t1 = utime_now();
+
+        uint64_t* codes = bench_codewords(family, n);
+        struct quick_decode_entry entry;
+        int found = 0;
+
+        int64_t t2 = utime_now();
+        for (int i = 0; i < n; i++) {
+            quick_decode_codeword(family, codes[i], &entry);
+            found += entry.hamming != 255;
+        }
+        int64_t t3 = utime_now();
+
+        printf("%-10s hamming %d: init %8.3f ms, %6.2f M lookups/s (%d found)\n",
+            modes[m].name, maxhamming, (t1 - t0) / 1000.0, n / (double)(t3 - t2), found);
+
+        struct quick_decode* qd = (struct quick_decode*)family->impl;
+        if (qd->backend == QUICK_DECODE_BACKEND_SCAN) {
+            printf("           %d rotated codes, %s kernel\n", 4 * family->ncodes, quick_decode_scan_isa());
+        } else if (qd->backend == QUICK_DECODE_BACKEND_MIH) {
+            printf("           %u substring indices, %.0f kB\n", qd->nmih, quick_decode_size(family) / 1024.0);
+        } else {
+            uint32_t hist[8];
+            int longest = quick_decode_probe_histogram(family, hist, 8);
+            printf("           %u slots, %.0f kB, longest probe %d, histogram", qd->nentries,
+                quick_decode_size(family) / 1024.0, longest);
+            for (int i = 0; i < 8; i++)
+                printf(" %u", hist[i]);
+            printf("\n");
+        }
+
+        free(codes);
+        quick_decode_uninit(family);
+        tag25h9_destroy(family);
+    }
+
+    return 0;
+}
+
+/**
+ * quick_decode_codeword() one at a time versus quick_decode_codewords() at
+ * several batch sizes, on the tag25h9 table with rotations.
+ */
+static int bench_batch(int argc, char** argv)
+{
+    int maxhamming = argc > 0 ? atoi(argv[0]) : 3;
+    int n = 1 << 20;
+
+    apriltag_family_t* family = tag25h9_create();
+    quick_decode_init_ex(family, maxhamming, QUICK_DECODE_ROTATIONS);
+
+    uint64_t* codes = bench_codewords(family, n);
+    struct quick_decode_entry* single = (struct quick_decode_entry*)malloc(n * sizeof(struct quick_decode_entry));
+    struct quick_decode_entry* batch = (struct quick_decode_entry*)malloc(n * sizeof(struct quick_decode_entry));
+
+    struct quick_decode* qd = (struct quick_decode*)family->impl;
+    printf("hamming %d, %.0f kB table\n", maxhamming, qd->nentries * sizeof(uint64_t) / 1024.0);
+
+    int64_t t0 = utime_now();
+    for (int i = 0; i < n; i++)
+        quick_decode_codeword(family, codes[i], &single[i]);
+    int64_t t1 = utime_now();
+    printf("single      %6.2f M lookups/s\n", n / (double)(t1 - t0));
+
+    int ret = 0;
+    for (int size = 1; size <= 256; size *= 4) {
+        t0 = utime_now();
+        for (int i = 0; i < n; i += size)
+            quick_decode_codewords(family, codes + i, size, batch + i);
+        t1 = utime_now();
+
+        int same = 1;
+        for (int i = 0; i < n; i++)
+            same &= single[i].rcode == batch[i].rcode && single[i].id == batch[i].id
+                && single[i].hamming == batch[i].hamming && single[i].rotation == batch[i].rotation;
+        printf("batch %3d   %6.2f M lookups/s, results %s\n", size, n / (double)(t1 - t0), same ? "match" : "DIFFER");
+        ret |= !same;
+    }
+
+    free(batch);
+    free(single);
+    free(codes);
+    quick_decode_uninit(family);
+    tag25h9_destroy(family);
+
+    return ret;
+}
+
+/**
+ * Checks every backend against quick_decode_nearest() on all codewords of a
+ * dense family of ncodes random 16-bit codes, where many codewords are
+ * within maxhamming of several codes: the table, built serially or in
+ * parallel, must keep the nearest of them just like the scan and
+ * multi-index hashing do. Every codeword is also decoded with junk in the
+ * bits above d*d, which every backend must ignore.
+ */
+static int bench_nearest(int argc, char** argv)
+{
+    int maxhamming = argc > 0 ? atoi(argv[0]) : 2;
+    int ncodes = argc > 1 ? atoi(argv[1]) : 60;
+
+    static const struct {
+        const char* name;
+        int flags;
+        int nthreads;
+    } modes[] = {
+        { "plain", QUICK_DECODE_TABLE, 1 },
+        { "rotations", QUICK_DECODE_TABLE | QUICK_DECODE_ROTATIONS, 1 },
+        { "parallel", QUICK_DECODE_TABLE | QUICK_DECODE_ROTATIONS, 4 },
+        { "scan", QUICK_DECODE_SCAN, 1 },
+        { "mih", QUICK_DECODE_MIH, 1 },
+    };
+
+    apriltag_family_t* family = tag25h9_create();
+    family->d = 4;
+    family->ncodes = ncodes;
+    family->codes = (uint64_t*)realloc(family->codes, ncodes * sizeof(uint64_t));
+    srand(4);
+    for (int i = 0; i < ncodes; i++)
+        family->codes[i] = rand() & 0xffff;
+
+    int ret = 0;
+    for (int m = 0; m < 5; m++) {
+        if (modes[m].nthreads > 1)
+            quick_decode_init_parallel(family, maxhamming, modes[m].flags, modes[m].nthreads);
+        else
+            quick_decode_init_ex(family, maxhamming, modes[m].flags);
+
+        int nshared = 0, differ = 0, high_differ = 0;
+        for (uint64_t rcode = 0; rcode < 0x10000; rcode++) {
+            struct quick_decode_entry entry, want, high;
+            quick_decode_codeword(family, rcode, &entry);
+            quick_decode_codeword(family, rcode | (rcode * 0x9e3779b97f4a7c15ULL) << 16 | 1ULL << 16, &high);
+            high_differ += high.hamming != entry.hamming || high.id != entry.id || high.rotation != entry.rotation || high.rcode != entry.rcode;
+            int second = quick_decode_nearest(family, rcode, &want);
+            if (want.hamming > maxhamming)
+                want.hamming = 255;
+            else
+                nshared += second <= maxhamming;
+
+            differ += entry.hamming != want.hamming
+                || (want.hamming != 255 && (entry.id != want.id || entry.rotation != want.rotation || entry.rcode != want.rcode));
+        }
+        printf("%-10s hamming %d: %d codewords with a second match, results %s, high bits %s\n", modes[m].name, maxhamming,
+            nshared, differ ? "DIFFER" : "match", high_differ ? "NOT IGNORED" : "ignored");
+        ret |= differ != 0 || high_differ != 0;
+
+        quick_decode_uninit(family);
+    }
+
+    tag25h9_destroy(family);
+
+    return ret;
+}
+
+/**
+ * Decoding against several families: probing each family's own decoder in
+ * turn versus one quick_decode_multi_codeword() lookup. The families are
+ * tag25h9 and copies of it with every code shifted by a few bits, so they
+ * are distinct 25-bit families.
+ */
+static int bench_multi(int argc, char** argv)
+{
+    int maxhamming = argc > 0 ? atoi(argv[0]) : 2;
+    int nfamilies = argc > 1 ? atoi(argv[1]) : 4;
+    int n = 1 << 20;
+
+    apriltag_family_t** families = (apriltag_family_t**)malloc(nfamilies * sizeof(apriltag_family_t*));
+    for (int f = 0; f < nfamilies; f++) {
+        families[f] = tag25h9_create();
+        for (uint32_t i = 0; i < families[f]->ncodes; i++)
+            families[f]->codes[i] = ((families[f]->codes[i] << (3 * f)) | (families[f]->codes[i] >> (25 - 3 * f))) & ((1 << 25) - 1);
+        quick_decode_init_ex(families[f], maxhamming, QUICK_DECODE_ROTATIONS);
+    }
+
+    uint64_t* codes = bench_codewords(families[0], n);
+    int found = 0;
+
+    int64_t t0 = utime_now();
+    for (int i = 0; i < n; i++) {
+        for (int f = 0; f < nfamilies; f++) {
+            struct quick_decode_entry entry;
+            quick_decode_codeword(families[f], codes[i], &entry);
+            if (entry.hamming != 255) {
+                found++;
+                break;
+            }
+        }
+    }
+    int64_t t1 = utime_now();
+    printf("%d families, hamming %d\n", nfamilies, maxhamming);
+    printf("each family  %6.2f M lookups/s (%d found)\n", n / (double)(t1 - t0), found);
+
+    struct quick_decode_multi* qdm = quick_decode_multi_create(families, nfamilies, maxhamming);
+    found = 0;
+
+    t0 = utime_now();
+    for (int i = 0; i < n; i++) {
+        struct quick_decode_multi_entry entry;
+        quick_decode_multi_codeword(qdm, codes[i], &entry);
+        found += entry.family != NULL;
+    }
+    t1 = utime_now();
+    printf("combined     %6.2f M lookups/s (%d found), %.0f kB\n", n / (double)(t1 - t0), found,
+        qdm->qd->nentries * sizeof(uint64_t) / 1024.0);
+
+    quick_decode_multi_destroy(qdm);
+    free(codes);
+    for (int f = 0; f < nfamilies; f++) {
+        quick_decode_uninit(families[f]);
+        tag25h9_destroy(families[f]);
+    }
+    free(families);
+
+    return 0;
+}
+
+/**
+ * Compares building the tag25h9 table in memory with loading it through
+ * quick_decode_init_file(). The first file load builds and writes the
+ * table; later loads just map it, with and without QUICK_DECODE_VERIFY.
+ * Then flips a byte of the stored entries and checks that a verified load
+ * rebuilds the damaged file rather than mapping it.
+ */
+static int bench_table_file(int argc, char** argv)
+{
+    const char* path = argc > 0 ? argv[0] : "tag25h9.qdt";
+    int maxhamming = argc > 1 ? atoi(argv[1]) : 3;
+
+    apriltag_family_t* family = tag25h9_create();
+
+    int64_t t0 = utime_now();
+    quick_decode_init_ex(family, maxhamming, QUICK_DECODE_ROTATIONS);
+    int64_t t1 = utime_now();
+    quick_decode_uninit(family);
+    printf("build in memory   %8.3f ms\n", (t1 - t0) / 1000.0);
+
+    for (int i = 0; i < 4; i++) {
+        int flags = QUICK_DECODE_ROTATIONS | (i == 3 ? QUICK_DECODE_VERIFY : 0);
+        t0 = utime_now();
+        int loaded = quick_decode_init_file(family, maxhamming, flags, path);
+        t1 = utime_now();
+        quick_decode_uninit(family);
+        printf("%-17s %8.3f ms\n", !loaded ? "build and write" : i == 3 ? "map and verify" : "map file", (t1 - t0) / 1000.0);
+    }
+
+    FILE* f = fopen(path, "r+b");
+    int rebuilt = 0;
+    if (f && fseek(f, -1, SEEK_END) == 0) {
+        int c = fgetc(f);
+        fseek(f, -1, SEEK_END);
+        fputc(c ^ 1, f);
+        fclose(f);
+
+        rebuilt = quick_decode_init_file(family, maxhamming, QUICK_DECODE_ROTATIONS | QUICK_DECODE_VERIFY, path) == 0;
+        quick_decode_uninit(family);
+        printf("corrupted file    %s\n", rebuilt ? "rebuilt" : "ACCEPTED");
+    }
+
+    tag25h9_destroy(family);
+
+    return rebuilt ? 0 : 1;
+}
+
+/**
+ * Checks that every compile-time tag25h9 table is identical to the one
+ * quick_decode_init_ex() builds at run time, slot for slot, and that
+ * tag25h9_decode_init_static() refuses the other backends.
+ */
+static int bench_static(int argc, char** argv)
+{
+    (void)argc;
+    (void)argv;
+
+    apriltag_family_t* family = tag25h9_create();
+    int ret = 0;
+
+    for (int rotations = 0; rotations <= 1; rotations++) {
+        for (int maxhamming = 0; maxhamming <= 2; maxhamming++) {
+            int flags = rotations ? QUICK_DECODE_ROTATIONS : 0;
+
+            int64_t t0 = utime_now();
+            quick_decode_init_ex(family, maxhamming, flags);
+            int64_t t1 = utime_now();
+            struct quick_decode* built = (struct quick_decode*)family->impl;
+            family->impl = NULL;
+
+            if (tag25h9_decode_init_static(family, maxhamming, flags) != 0) {
+                printf("hamming %d, %-12s no static table\n", maxhamming, rotations ? "rotations:" : "plain:");
+                quick_decode_release(built);
+                ret = 1;
+                continue;
+            }
+            const struct quick_decode* stat = (const struct quick_decode*)family->impl;
+
+            int same = built->backend == QUICK_DECODE_BACKEND_TABLE && stat->nentries == built->nentries
+                && stat->shift == built->shift && stat->maxprobe == built->maxprobe
+                && stat->rotations == built->rotations && stat->maxhamming == built->maxhamming
+                && !memcmp(stat->entries, built->entries, built->nentries * sizeof(uint64_t));
+            printf("hamming %d, %-12s %8u slots, built in %8.3f ms, static table %s\n", maxhamming,
+                rotations ? "rotations:" : "plain:", built->nentries, (t1 - t0) / 1000.0, same ? "identical" : "DIFFERS");
+            ret |= !same;
+
+            quick_decode_uninit(family);
+            quick_decode_release(built);
+        }
+    }
+
+    static const int others[] = { QUICK_DECODE_SCAN, QUICK_DECODE_MIH, QUICK_DECODE_VERIFY, QUICK_DECODE_TABLE | QUICK_DECODE_MIH };
+    for (int i = 0; i < 4; i++) {
+        if (tag25h9_decode_init_static(family, 2, others[i]) == 0) {
+            printf("flags %d wrongly given a static table\n", others[i]);
+            quick_decode_uninit(family);
+            ret = 1;
+        }
+    }
+
+    tag25h9_destroy(family);
+
+    return ret;
+}
+
+/**
+ * Table build time versus thread count for quick_decode_init_parallel(), on
+ * tag25h9 or a synthetic family of ncodes codes; one thread is the serial
+ * quick_decode_init_ex() build. The flags default to a table without
+ * rotations, which the automatic choice would replace with multi-index
+ * hashing for large families, and every run says which backend it built.
+ */
+static int bench_build(int argc, char** argv)
+{
+    int maxhamming = argc > 0 ? atoi(argv[0]) : 3;
+    int ncodes = argc > 1 ? atoi(argv[1]) : 0;
+    int flags = argc > 2 ? atoi(argv[2]) : QUICK_DECODE_TABLE;
+
+    apriltag_family_t* family = bench_family(ncodes);
+
+    printf("%d codes of %d bits, hamming %d, %s\n", family->ncodes, family->d * family->d, maxhamming,
+        flags & QUICK_DECODE_ROTATIONS ? "rotations" : "no rotations");
+
+    for (int nthreads = 1; nthreads <= 16; nthreads *= 2) {
+        int64_t t0 = utime_now();
+        quick_decode_init_parallel(family, maxhamming, flags, nthreads);
+        int64_t t1 = utime_now();
+
+        int backend = ((struct quick_decode*)family->impl)->backend;
+        printf("%2d threads  %10.3f ms  %s, %.0f kB\n", nthreads, (t1 - t0) / 1000.0,
+            backend == QUICK_DECODE_BACKEND_TABLE ? "table" : backend == QUICK_DECODE_BACKEND_MIH ? "mih" : "scan",
+            quick_decode_size(family) / 1024.0);
+        quick_decode_uninit(family);
+    }
+
+    tag25h9_destroy(family);
+
+    return 0;
+}
+
+/**
+ * Per-frame temporaries from the heap versus a workspace: reduces a frame to
+ * its cell grid with matd_reduce_image() and crops the interior with
+ * matd_select(), then checks that frames after the first allocate nothing
+ * from the heap. The last run crops with a matd_view instead of a copy.
+ * Then runs the detector's own per-frame path, threshold_image() and
+ * matd_sample_code() for a whole-frame tag and quad_detect() for a full
+ * frame, and checks that those allocate nothing after the first frame either.
+ */
+static int bench_workspace(int argc, char** argv)
+{
+    int width = argc > 0 ? atoi(argv[0]) : 1920;
+    int height = argc > 1 ? atoi(argv[1]) : 1080;
+    int nframes = 1000;
+
+    uint8_t* buf = bench_frame(width, height);
+    image_u8_t im = image_u8_view(width, height, width, buf);
+    // cells small enough that the 9x9 grid fits both ways.
+    int dim = (width < height ? width : height) / 9;
+    int count = dim * dim / 2;
+    if (dim == 0) {
+        printf("frame %dx%d is too small for a 9x9 grid\n", width, height);
+        free(buf);
+        return 1;
+    }
+    double heap_sum = 0, ws_sum = 0, view_sum = 0;
+
+    int64_t t0 = utime_now();
+    for (int i = 0; i < nframes; i++) {
+        matd_t* m = matd_reduce_image(&im, dim, 128, count);
+        matd_t* code = matd_select(m, 2, 6, 2, 6);
+        heap_sum += code->data[0];
+        matd_destroy(code);
+        matd_destroy(m);
+    }
+    int64_t t1 = utime_now();
+
+    workspace_t* ws = workspace_create(0);
+    uint64_t nallocs = 0;
+
+    int64_t t2 = utime_now();
+    for (int i = 0; i < nframes; i++) {
+        if (i == 1)
+            nallocs = workspace_heap_allocs();
+        matd_t* m = matd_reduce_image_ws(ws, &im, dim, 128, count);
+        matd_t* code = matd_select_ws(ws, m, 2, 6, 2, 6);
+        ws_sum += code->data[0];
+        workspace_reset(ws);
+    }
+    int64_t t3 = utime_now();
+    nallocs = workspace_heap_allocs() - nallocs;
+
+    for (int i = 0; i < nframes; i++) {
+        matd_t* m = matd_reduce_image_ws(ws, &im, dim, 128, count);
+        view_sum += matd_view_of(m).select(2, 6, 2, 6)(0, 0);
+        workspace_reset(ws);
+    }
+    int64_t t4 = utime_now();
+
+    quad_config_t qc;
+    quad_config_init(&qc);
+    threshold_config_t tc = { 8, qc.min_contrast, 1, NULL };
+    uint64_t detect_allocs = 0;
+    for (int i = 0; i < 10; i++) {
+        if (i == 1)
+            detect_allocs = workspace_heap_allocs();
+        uint8_t* bits = (uint8_t*)workspace_alloc(ws, (size_t)width * height);
+        threshold_image(&im, &tc, ws, bits, width);
+        image_u8_t bin = image_u8_view(width, height, width, bits);
+        matd_sample_code(&bin, dim, 128, count, 2, 6, 2, 6);
+        workspace_reset(ws);
+
+        quad_tag_t quads[16];
+        quad_detect(&im, &qc, ws, quads, 16, NULL);
+        workspace_reset(ws);
+    }
+    detect_allocs = workspace_heap_allocs() - detect_allocs;
+
+    printf("frame %dx%d, %d frames\n", width, height, nframes);
+    printf("heap       %8.3f us/frame\n", (t1 - t0) / (double)nframes);
+    printf("workspace  %8.3f us/frame, %zu bytes, %llu heap allocations after the first frame\n",
+        (t3 - t2) / (double)nframes, ws->high_water, (unsigned long long)nallocs);
+    printf("view       %8.3f us/frame\n", (t4 - t3) / (double)nframes);
+    printf("detector   %llu heap allocations after the first frame\n", (unsigned long long)detect_allocs);
+    int same = heap_sum == ws_sum && heap_sum == view_sum;
+    printf("results %s\n", same ? "match" : "DIFFER");
+
+    workspace_destroy(ws);
+    free(buf);
+
+    return same && nallocs == 0 && detect_allocs == 0 ? 0 : 1;
+}
+
+static const struct {
+    const char* name;
+    int (*fn)(int argc, char** argv);
+    const char* usage;
+} benches[] = {
+    { "sample", bench_sample, "[trials]" },
+    { "integral", bench_integral, "[width height]" },
+    { "decode", bench_decode, "[maxhamming [ncodes]]" },
+    { "batch", bench_batch, "[maxhamming]" },
+    { "nearest", bench_nearest, "[maxhamming [ncodes]]" },
+    { "multi", bench_multi, "[maxhamming [nfamilies]]" },
+    { "table-file", bench_table_file, "[path [maxhamming]]" },
+    { "build", bench_build, "[maxhamming [ncodes [flags]]]" },
+    { "static", bench_static, "" },
+    { "workspace", bench_workspace, "[width height]" },
+};
+
+int main(int argc, char** argv)
+{
+    int nbenches = sizeof(benches) / sizeof(benches[0]);
+
+    for (int i = 0; argc > 1 && i < nbenches; i++) {
+        if (!strcmp(argv[1], benches[i].name))
+            return benches[i].fn(argc - 2, argv + 2);
+    }
+
+    printf("usage: %s <bench> [args]\n", argv[0]);
+    for (int i = 0; i < nbenches; i++)
+        printf("  %s %s\n", benches[i].name, benches[i].usage);
+
+    return 1;
+}
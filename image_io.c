@@ -0,0 +1,193 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image_io.h"
+
+// SOFn markers carry the frame size; C4 (DHT), C8 (JPG) and CC (DAC) share
+// the range but are not frame headers.
+static int jpeg_is_sof(int marker)
+{
+    return marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+}
+
+int image_io_jpeg_size(const char* path, int* width, int* height)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return -1;
+
+    int ret = -1;
+    if (fgetc(f) != 0xff || fgetc(f) != 0xd8)
+        goto done;
+
+    // walk the marker segments up to the frame header. Only their lengths
+    // are read, so large EXIF or ICC segments are skipped with a seek.
+    for (;;) {
+        int c = fgetc(f);
+        if (c != 0xff)
+            goto done;
+
+        int marker;
+        do
+            marker = fgetc(f);
+        while (marker == 0xff);
+
+        if (marker == EOF || marker == 0xd9 || marker == 0xda)
+            goto done;
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7))
+            continue;
+
+        uint8_t hdr[7];
+        if (fread(hdr, 1, 2, f) != 2)
+            goto done;
+        int length = (hdr[0] << 8) | hdr[1];
+        if (length < 2)
+            goto done;
+
+        if (jpeg_is_sof(marker)) {
+            // precision, height, width.
+            if (length < 7 || fread(hdr + 2, 1, 5, f) != 5)
+                goto done;
+            *height = (hdr[3] << 8) | hdr[4];
+            *width = (hdr[5] << 8) | hdr[6];
+            ret = *width > 0 && *height > 0 ? 0 : -1;
+            goto done;
+        }
+
+        if (fseek(f, length - 2, SEEK_CUR) != 0)
+            goto done;
+    }
+
+done:
+    fclose(f);
+    return ret;
+}
+
+int image_io_jpeg_scale(int width, int ncells, int min_cell)
+{
+    for (int s = 8; s > 1; s /= 2) {
+        if ((width + s - 1) / s / ncells >= min_cell)
+            return s;
+    }
+
+    return 1;
+}
+
+static int image_io_map(const char* path, image_io_mapped_t* out)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return -1;
+
+    out->mapping = mapping;
+    out->mapping_size = st.st_size;
+
+    return 0;
+}
+
+void image_io_unmap(image_io_mapped_t* m)
+{
+    if (m->mapping)
+        munmap(m->mapping, m->mapping_size);
+    m->mapping = NULL;
+    m->mapping_size = 0;
+}
+
+static int pgm_is_space(int c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// parses the next decimal header field at p[*pos], skipping whitespace and
+// '#' comments before it. Returns -1 if there is none.
+static int pgm_field(const uint8_t* p, size_t size, size_t* pos)
+{
+    size_t i = *pos;
+    for (;;) {
+        while (i < size && pgm_is_space(p[i]))
+            i++;
+        if (i < size && p[i] == '#') {
+            while (i < size && p[i] != '\n')
+                i++;
+            continue;
+        }
+        break;
+    }
+
+    if (i >= size || p[i] < '0' || p[i] > '9')
+        return -1;
+
+    int v = 0;
+    for (; i < size && p[i] >= '0' && p[i] <= '9'; i++) {
+        if (v > 100000)
+            return -1;
+        v = v * 10 + (p[i] - '0');
+    }
+
+    *pos = i;
+    return v;
+}
+
+int image_io_map_pgm(const char* path, image_io_mapped_t* out)
+{
+    if (image_io_map(path, out) != 0)
+        return -1;
+
+    const uint8_t* p = (const uint8_t*)out->mapping;
+    size_t size = out->mapping_size;
+    size_t pos = 2;
+
+    if (size < 2 || p[0] != 'P' || p[1] != '5') {
+        image_io_unmap(out);
+        return -1;
+    }
+
+    int width = pgm_field(p, size, &pos);
+    int height = pgm_field(p, size, &pos);
+    int maxval = pgm_field(p, size, &pos);
+
+    // a single whitespace character separates the header from the pixels.
+    if (width <= 0 || height <= 0 || maxval <= 0 || maxval > 255
+        || pos >= size || !pgm_is_space(p[pos])
+        || size - pos - 1 < (size_t)width * height) {
+        image_io_unmap(out);
+        return -1;
+    }
+
+    out->im = image_u8_view(width, height, width, p + pos + 1);
+
+    return 0;
+}
+
+int image_io_map_raw(const char* path, int width, int height, int stride, image_io_mapped_t* out)
+{
+    if (width <= 0 || height <= 0 || stride < width)
+        return -1;
+
+    if (image_io_map(path, out) != 0)
+        return -1;
+
+    if (out->mapping_size < (size_t)stride * (height - 1) + width) {
+        image_io_unmap(out);
+        return -1;
+    }
+
+    out->im = image_u8_view(width, height, stride, (const uint8_t*)out->mapping);
+
+    return 0;
+}
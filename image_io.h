@@ -0,0 +1,64 @@
+#ifndef _IMAGE_IO_H
+#define _IMAGE_IO_H
+
+#include <stddef.h>
+
+#include "image_u8.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The smallest cell, in pixels, that the detector samples reliably. A
+ * reduced-resolution decode is only chosen if it keeps cells this wide.
+ */
+#define IMAGE_IO_MIN_CELL 8
+
+/**
+ * Reads the frame size from the SOF header of the JPEG file 'path' without
+ * decoding any image data. Returns 0 on success, or -1 if the file cannot be
+ * read or is not a JPEG.
+ */
+int image_io_jpeg_size(const char* path, int* width, int* height);
+
+/**
+ * Returns the DCT-domain downscale factor (1, 2, 4 or 8) to decode a JPEG of
+ * the given width with: the largest one that still leaves each of the
+ * 'ncells' cells across the frame at least 'min_cell' pixels wide. A JPEG
+ * decoder scaled by 1/s produces ceil(width / s) columns.
+ */
+int image_io_jpeg_scale(int width, int ncells, int min_cell);
+
+/**
+ * An 8-bit grayscale image mapped read-only from a file. 'im' views the
+ * pixels in place; nothing is decoded or copied, and pages are read in as
+ * the detector touches them. Release it with image_io_unmap().
+ */
+typedef struct {
+    image_u8_t im;
+    void* mapping;
+    size_t mapping_size;
+} image_io_mapped_t;
+
+/**
+ * Maps the binary PGM (P5) file 'path'. Only 8-bit files (maxval < 256) are
+ * supported. Returns 0 on success, or -1 if the file cannot be mapped or is
+ * not an 8-bit P5 PGM.
+ */
+int image_io_map_pgm(const char* path, image_io_mapped_t* out);
+
+/**
+ * Maps the headerless Y8 frame 'path' of width x height pixels with rows
+ * 'stride' bytes apart. The file must hold at least the whole frame.
+ * Returns 0 on success, or -1 otherwise.
+ */
+int image_io_map_raw(const char* path, int width, int height, int stride, image_io_mapped_t* out);
+
+void image_io_unmap(image_io_mapped_t* m);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
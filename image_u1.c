@@ -0,0 +1,197 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IMAGE_U1_X86 1
+#endif
+
+#include "image_u1.h"
+
+image_u1_t* image_u1_create(int width, int height)
+{
+    assert(width >= 0 && height >= 0);
+
+    int stride = (width + 63) / 64;
+    image_u1_t* b = (image_u1_t*)calloc(1, sizeof(image_u1_t) + (size_t)stride * height * sizeof(uint64_t));
+    b->width = width;
+    b->height = height;
+    b->stride = stride;
+    b->buf = (uint64_t*)&b[1];
+
+    return b;
+}
+
+void image_u1_destroy(image_u1_t* b)
+{
+    free(b);
+}
+
+static void image_u1_threshold_row_scalar(const uint8_t* p, int width, int thresh, uint64_t* out)
+{
+    for (int x0 = 0; x0 < width; x0 += 64) {
+        int n = width - x0 < 64 ? width - x0 : 64;
+        uint64_t w = 0;
+        for (int x = 0; x < n; x++)
+            w |= (uint64_t)(p[x0 + x] >= thresh) << x;
+        out[x0 / 64] = w;
+    }
+}
+
+#ifdef IMAGE_U1_X86
+
+// four pmovmskb per word: v >= t is max(v, t) == v for unsigned bytes.
+__attribute__((target("sse2"))) static void image_u1_threshold_row_sse2(const uint8_t* p, int width, int thresh, uint64_t* out)
+{
+    const __m128i t = _mm_set1_epi8((char)thresh);
+
+    int x0 = 0;
+    for (; x0 + 64 <= width; x0 += 64) {
+        uint64_t w = 0;
+        for (int k = 0; k < 4; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)&p[x0 + 16 * k]);
+            w |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, t), v)) << (16 * k);
+        }
+        out[x0 / 64] = w;
+    }
+    if (x0 < width)
+        image_u1_threshold_row_scalar(&p[x0], width - x0, thresh, &out[x0 / 64]);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void image_u1_threshold_row_avx512(const uint8_t* p, int width, int thresh, uint64_t* out)
+{
+    const __m512i t = _mm512_set1_epi8((char)thresh);
+
+    int x0 = 0;
+    for (; x0 + 64 <= width; x0 += 64)
+        out[x0 / 64] = _cvtmask64_u64(_mm512_cmpge_epu8_mask(_mm512_loadu_si512(&p[x0]), t));
+    if (x0 < width) {
+        __mmask64 tail = _cvtu64_mask64(UINT64_MAX >> (64 - (width - x0)));
+        out[x0 / 64] = _cvtmask64_u64(_mm512_mask_cmpge_epu8_mask(tail, _mm512_maskz_loadu_epi8(tail, &p[x0]), t));
+    }
+}
+
+#endif
+
+static inline __attribute__((always_inline)) int image_u1_count_body(const image_u1_t* b, int x, int y, int width, int height)
+{
+    assert(x >= 0 && y >= 0 && x + width <= b->width && y + height <= b->height);
+
+    if (width <= 0 || height <= 0)
+        return 0;
+
+    int w0 = x >> 6, w1 = (x + width - 1) >> 6;
+    uint64_t m0 = UINT64_MAX << (x & 63);
+    uint64_t m1 = UINT64_MAX >> (63 - ((x + width - 1) & 63));
+
+    int n = 0;
+    for (int yy = y; yy < y + height; yy++) {
+        const uint64_t* row = &b->buf[(int64_t)yy * b->stride];
+        if (w0 == w1) {
+            n += __builtin_popcountll(row[w0] & m0 & m1);
+        } else {
+            n += __builtin_popcountll(row[w0] & m0);
+            for (int i = w0 + 1; i < w1; i++)
+                n += __builtin_popcountll(row[i]);
+            n += __builtin_popcountll(row[w1] & m1);
+        }
+    }
+
+    return n;
+}
+
+static int image_u1_count_scalar(const image_u1_t* b, int x, int y, int width, int height)
+{
+    return image_u1_count_body(b, x, y, width, height);
+}
+
+#ifdef IMAGE_U1_X86
+// the same loop, with __builtin_popcountll() compiled to popcnt.
+__attribute__((target("popcnt"))) static int image_u1_count_popcnt(const image_u1_t* b, int x, int y, int width, int height)
+{
+    return image_u1_count_body(b, x, y, width, height);
+}
+#endif
+
+typedef void (*image_u1_threshold_row_t)(const uint8_t* p, int width, int thresh, uint64_t* out);
+typedef int (*image_u1_count_t)(const image_u1_t* b, int x, int y, int width, int height);
+
+static const char* image_u1_kernel_isa = NULL;
+static image_u1_threshold_row_t image_u1_threshold_row_fn = NULL;
+static image_u1_count_t image_u1_count_fn = NULL;
+
+static void image_u1_select(void)
+{
+    if (__atomic_load_n(&image_u1_kernel_isa, __ATOMIC_ACQUIRE))
+        return;
+
+    const char* isa = "scalar";
+    image_u1_threshold_row_t threshold_row = image_u1_threshold_row_scalar;
+    image_u1_count_t count = image_u1_count_scalar;
+
+    // IMAGE_U1_ISA=sse2|scalar caps the kernel choice, like MATD_COUNT_ISA
+    // does for the cell counter.
+    const char* cap = getenv("IMAGE_U1_ISA");
+    int level = 2;
+    if (cap && !strcmp(cap, "sse2"))
+        level = 1;
+    else if (cap && !strcmp(cap, "scalar"))
+        level = 0;
+
+#ifdef IMAGE_U1_X86
+    __builtin_cpu_init();
+    if (level >= 2 && __builtin_cpu_supports("avx512bw")) {
+        isa = "avx512";
+        threshold_row = image_u1_threshold_row_avx512;
+    } else if (level >= 1 && __builtin_cpu_supports("sse2")) {
+        isa = "sse2";
+        threshold_row = image_u1_threshold_row_sse2;
+    }
+    if (level >= 1 && __builtin_cpu_supports("popcnt"))
+        count = image_u1_count_popcnt;
+#endif
+
+    // a racing first call from another thread picks the same kernels; the
+    // name is stored last, as it marks the kernels as picked.
+    __atomic_store_n(&image_u1_threshold_row_fn, threshold_row, __ATOMIC_RELAXED);
+    __atomic_store_n(&image_u1_count_fn, count, __ATOMIC_RELAXED);
+    __atomic_store_n(&image_u1_kernel_isa, isa, __ATOMIC_RELEASE);
+}
+
+const char* image_u1_isa(void)
+{
+    image_u1_select();
+    return image_u1_kernel_isa;
+}
+
+void image_u1_threshold(const image_u8_t* im, int thresh, image_u1_t* out)
+{
+    assert(im != NULL && out != NULL);
+    assert(im->width == out->width && im->height == out->height);
+
+    if (thresh <= 0 || thresh > 255) {
+        uint64_t fill = thresh <= 0 ? UINT64_MAX : 0;
+        int tail = out->width & 63;
+        for (int y = 0; y < out->height; y++) {
+            uint64_t* row = &out->buf[(int64_t)y * out->stride];
+            for (int i = 0; i < out->stride; i++)
+                row[i] = fill;
+            if (tail)
+                row[out->stride - 1] &= UINT64_MAX >> (64 - tail);
+        }
+        return;
+    }
+
+    image_u1_select();
+    image_u1_threshold_row_t threshold_row = __atomic_load_n(&image_u1_threshold_row_fn, __ATOMIC_RELAXED);
+
+    for (int y = 0; y < im->height; y++)
+        threshold_row(&im->buf[(int64_t)y * im->stride], im->width, thresh, &out->buf[(int64_t)y * out->stride]);
+}
+
+int image_u1_count(const image_u1_t* b, int x, int y, int width, int height)
+{
+    image_u1_select();
+    return __atomic_load_n(&image_u1_count_fn, __ATOMIC_RELAXED)(b, x, y, width, height);
+}
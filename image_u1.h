@@ -0,0 +1,54 @@
+#ifndef _IMAGE_U1_H
+#define _IMAGE_U1_H
+
+#include <stdint.h>
+
+#include "image_u8.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A binary image packed 64 pixels per word. Every row starts on a word
+ * boundary; pixel (x, y) is bit (x & 63) of buf[y * stride + (x >> 6)], where
+ * stride is in words. Bits past 'width' in the last word of a row are zero.
+ */
+typedef struct {
+    int32_t width, height;
+    int32_t stride;
+    uint64_t* buf;
+} image_u1_t;
+
+/**
+ * Creates a zeroed binary image of the given size. It is the caller's
+ * responsibility to call image_u1_destroy() on the returned image.
+ */
+image_u1_t* image_u1_create(int width, int height);
+
+void image_u1_destroy(image_u1_t* b);
+
+/**
+ * Sets each bit of 'out' to (pixel >= thresh) for the corresponding pixel of
+ * 'im'. 'out' must have the same width and height as 'im'.
+ */
+void image_u1_threshold(const image_u8_t* im, int thresh, image_u1_t* out);
+
+/**
+ * Returns the number of set pixels in the rectangle (x, y, width, height),
+ * which must lie inside 'b'.
+ */
+int image_u1_count(const image_u1_t* b, int x, int y, int width, int height);
+
+/**
+ * Returns the name of the kernel image_u1_threshold() uses on this CPU:
+ * "avx512", "sse2" or "scalar". IMAGE_U1_ISA=sse2|scalar caps the choice,
+ * and "scalar" also keeps image_u1_count() off popcnt.
+ */
+const char* image_u1_isa(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _IMAGE_U8_H
+#define _IMAGE_U8_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A non-owning view of an 8-bit grayscale image. Pixel (x, y) lives at
+ * buf[y * stride + x]; stride is in bytes and may be larger than width
+ * (e.g. for padded rows or a region of interest inside a bigger frame).
+ *
+ * The view never allocates or frees buf, so it can wrap an OpenCV Mat
+ * buffer, a memory-mapped file or any caller-owned memory without a copy.
+ */
+typedef struct {
+    int32_t width, height;
+    int32_t stride;
+    const uint8_t* buf;
+} image_u8_t;
+
+/**
+ * Wraps the supplied buffer as an image view. No data is copied.
+ */
+static inline image_u8_t image_u8_view(int width, int height, int stride, const uint8_t* buf)
+{
+    image_u8_t im;
+    im.width = width;
+    im.height = height;
+    im.stride = stride;
+    im.buf = buf;
+    return im;
+}
+
+/**
+ * Returns a view of the rectangle (x, y, width, height) of 'im'. The
+ * rectangle must lie inside 'im'. No data is copied.
+ */
+static inline image_u8_t image_u8_roi(const image_u8_t* im, int x, int y, int width, int height)
+{
+    return image_u8_view(width, height, im->stride, im->buf + (int64_t)y * im->stride + x);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,72 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "integral.h"
+
+integral_t* integral_create(int width, int height)
+{
+    assert(width >= 0 && height >= 0);
+
+    int stride = width + 1;
+    integral_t* ii = (integral_t*)calloc(1, sizeof(integral_t) + (size_t)stride * (height + 1) * sizeof(uint32_t));
+    ii->width = width;
+    ii->height = height;
+    ii->stride = stride;
+    ii->buf = (uint32_t*)&ii[1];
+
+    return ii;
+}
+
+void integral_destroy(integral_t* ii)
+{
+    free(ii);
+}
+
+void integral_build(const image_u8_t* im, int thresh, integral_t* ii)
+{
+    assert(im != NULL && ii != NULL);
+    assert(im->width == ii->width && im->height == ii->height);
+
+    memset(ii->buf, 0, (ii->width + 1) * sizeof(uint32_t));
+
+    for (int y = 0; y < im->height; y++) {
+        const uint8_t* p = &im->buf[(int64_t)y * im->stride];
+        const uint32_t* __restrict up = &ii->buf[(int64_t)y * ii->stride];
+        uint32_t* __restrict out = &ii->buf[(int64_t)(y + 1) * ii->stride];
+
+        // the row prefix sum is serial; adding the row above is a separate
+        // pass so that it vectorizes.
+        uint32_t acc = 0;
+        out[0] = 0;
+        for (int x = 0; x < im->width; x++) {
+            acc += (p[x] >= thresh);
+            out[x + 1] = acc;
+        }
+        for (int x = 1; x <= im->width; x++)
+            out[x] += up[x];
+    }
+}
+
+void integral_build_bits(const image_u1_t* b, integral_t* ii)
+{
+    assert(b != NULL && ii != NULL);
+    assert(b->width == ii->width && b->height == ii->height);
+
+    memset(ii->buf, 0, (ii->width + 1) * sizeof(uint32_t));
+
+    for (int y = 0; y < b->height; y++) {
+        const uint64_t* p = &b->buf[(int64_t)y * b->stride];
+        const uint32_t* __restrict up = &ii->buf[(int64_t)y * ii->stride];
+        uint32_t* __restrict out = &ii->buf[(int64_t)(y + 1) * ii->stride];
+
+        uint32_t acc = 0;
+        out[0] = 0;
+        for (int x = 0; x < b->width; x++) {
+            acc += (p[x >> 6] >> (x & 63)) & 1;
+            out[x + 1] = acc;
+        }
+        for (int x = 1; x <= b->width; x++)
+            out[x] += up[x];
+    }
+}
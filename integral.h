@@ -0,0 +1,60 @@
+#ifndef _INTEGRAL_H
+#define _INTEGRAL_H
+
+#include <stdint.h>
+
+#include "image_u1.h"
+#include "image_u8.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A summed-area table over a thresholded image of width x height pixels.
+ * The table has (width + 1) x (height + 1) entries; entry (x, y) holds the
+ * number of set pixels in the rectangle [0, x) x [0, y), so row 0 and
+ * column 0 are zero. stride is in entries.
+ */
+typedef struct {
+    int32_t width, height;
+    int32_t stride;
+    uint32_t* buf;
+} integral_t;
+
+/**
+ * Creates a table for images of the given size. It is the caller's
+ * responsibility to call integral_destroy() on the returned table.
+ */
+integral_t* integral_create(int width, int height);
+
+void integral_destroy(integral_t* ii);
+
+/**
+ * Fills 'ii' from the pixels of 'im' that are >= thresh. 'ii' must have been
+ * created with the same width and height as 'im'.
+ */
+void integral_build(const image_u8_t* im, int thresh, integral_t* ii);
+
+/**
+ * Fills 'ii' from the set pixels of the binary image 'b'.
+ */
+void integral_build_bits(const image_u1_t* b, integral_t* ii);
+
+/**
+ * Returns the number of set pixels in the rectangle (x, y, width, height),
+ * which must lie inside the image, in four lookups.
+ */
+static inline uint32_t integral_count(const integral_t* ii, int x, int y, int width, int height)
+{
+    const uint32_t* r0 = &ii->buf[(int64_t)y * ii->stride];
+    const uint32_t* r1 = &ii->buf[(int64_t)(y + height) * ii->stride];
+
+    return r1[x + width] - r1[x] - r0[x + width] + r0[x];
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
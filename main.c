@@ -1,11 +1,18 @@
 #include <stdio.h>
 
 #include "april.h"
+#include "batch.h"
+#include "image_io.h"
+#include "quad.h"
+#include "stream.h"
 #include "tag25h9.h"
+#include "threshold.h"
 
 #include <assert.h>
+#ifndef APRIL_NO_OPENCV
 #include <cv.h>
 #include <opencv2/opencv.hpp>
+#endif
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -13,10 +20,29 @@
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "matd.h"
 
+#ifndef APRIL_NO_OPENCV
 using namespace cv;
+#endif
+
+// with -s WIDTHxHEIGHT the input is a headerless Y8 frame of that size.
+static int raw_width = 0, raw_height = 0;
+
+// with -f tags are searched for anywhere in the frame, instead of the frame
+// being one tag.
+static int full_frame = 0;
+static quad_config_t quad_config;
+
+// with -p the thresholding of each frame is split across threads: those of
+// tile_pool, or of the stream pool for frames detected on it.
+static int split_frames = 0;
+static pool_t* tile_pool = NULL;
+
+// the most tags reported per frame.
+#define MAX_TAGS 256
 
 int64_t utime_now() // blacklist-ignore
 {
@@ -35,37 +61,330 @@ int64_t utime_get_useconds(int64_t v)
     return v % 1000000;
 }
 
-uint64_t detector(char* filename)
+#ifndef APRIL_NO_OPENCV
+// decodes 'filename' to grayscale. A JPEG is decoded at the coarsest
+// DCT-domain scale that keeps the 9 cells across the frame at least
+// IMAGE_IO_MIN_CELL pixels wide; the scale used is stored in *scale.
+static Mat load_gray(const char* filename, int* scale)
 {
-    Mat A;
+    int width, height;
 
-    A = imread(filename, 0);
+    // a full frame is decoded whole: its tags may be any size.
+    *scale = 1;
+    if (!full_frame && image_io_jpeg_size(filename, &width, &height) == 0)
+        *scale = image_io_jpeg_scale(width, 9, IMAGE_IO_MIN_CELL);
+
+    switch (*scale) {
+    case 8:
+        return imread(filename, IMREAD_REDUCED_GRAYSCALE_8);
+    case 4:
+        return imread(filename, IMREAD_REDUCED_GRAYSCALE_4);
+    case 2:
+        return imread(filename, IMREAD_REDUCED_GRAYSCALE_2);
+    default:
+        return imread(filename, IMREAD_GRAYSCALE);
+    }
+}
+#endif
 
-    matd_t* B = matd_create_data(A.rows, A.cols, A.data);
-    // matd_print(B, "%5d");
-    int quad_size = A.cols / 9;
+// a loaded grayscale frame: a mapped PGM or raw Y8 file, or an OpenCV
+// decode at 1/scale resolution.
+typedef struct {
+    image_u8_t im;
+    int scale;
+    image_io_mapped_t map;
+#ifndef APRIL_NO_OPENCV
+    Mat mat;
+#endif
+} frame_t;
+
+// loads 'filename' into 'f'. Returns 0, or -1 with a message in 'err'.
+static int frame_load(const char* filename, frame_t* f, char* err, size_t size)
+{
+    // PGM and raw Y8 frames are mapped and viewed in place; anything else
+    // goes through OpenCV.
+    f->scale = 1;
+    f->map.mapping = NULL;
+    if (raw_width > 0 ? image_io_map_raw(filename, raw_width, raw_height, raw_width, &f->map) == 0
+                      : image_io_map_pgm(filename, &f->map) == 0) {
+        f->im = f->map.im;
+        return 0;
+    }
+
+#ifdef APRIL_NO_OPENCV
+    snprintf(err, size, "%s: not an 8-bit PGM or raw Y8 file", filename);
+    return -1;
+#else
+    f->mat = load_gray(filename, &f->scale);
+    if (f->mat.empty()) {
+        snprintf(err, size, "%s: cannot read image", filename);
+        return -1;
+    }
+    f->im = image_u8_view(f->mat.cols, f->mat.rows, (int)f->mat.step, f->mat.data);
+    return 0;
+#endif
+}
+
+static void frame_release(frame_t* f)
+{
+    image_io_unmap(&f->map);
+#ifndef APRIL_NO_OPENCV
+    f->mat.release();
+#endif
+}
+
+// the pool to threshold the calling thread's frame on, or NULL for none.
+static pool_t* frame_pool()
+{
+    if (!split_frames)
+        return NULL;
+    pool_t* pool = pool_current();
+    return pool ? pool : tile_pool;
+}
+
+// samples the tag code of 'im' into *code. Per-frame temporaries come from
+// 'ws', which the caller resets between frames. Returns -1 if the frame is
+// too small to hold the 9x9 cell grid.
+int detector(const image_u8_t* im, workspace_t* ws, uint64_t* code)
+{
+    int quad_size = im->width / 9;
+    if (quad_size == 0 || 7 * quad_size > im->height)
+        return -1;
 
     int count = (quad_size * quad_size * 0.6);
     if (count == 0)
         count = 1;
-    // printf("%d,%d:quad_size=%d, count=%d\n", A.rows, A.cols, quad_size, count);
-    matd_t* x = matd_reduce(B, quad_size, 10, count);
-    // matd_print(x, "%5d");
-    // printf("\n");
+    // printf("%d,%d:quad_size=%d, count=%d\n", im->height, im->width, quad_size, count);
+
+    // binarize against the local light level first, with tiles a quarter
+    // of a cell wide, so a shadow or a gradient across the tag does not
+    // turn whole cells black; tiles inside a flat cell take the threshold
+    // of the nearest edge.
+    int tile_size = quad_size / 4;
+    tile_size = tile_size < 4 ? 4 : tile_size > 32 ? 32 : tile_size;
+    threshold_config_t tc = { tile_size, quad_config.min_contrast, 1, frame_pool() };
+    uint8_t* bits = (uint8_t*)workspace_alloc(ws, (size_t)im->width * im->height);
+    threshold_image(im, &tc, ws, bits, im->width);
+    image_u8_t bin = { im->width, im->height, im->width, bits };
 
-    matd_t* C = matd_select(x, 2, 6, 2, 6);
-    // matd_print(C, "%5d");
-    // printf("\n");
+    // the tag is 9 cells wide; only the interior 5x5 data cells carry the code.
+    *code = matd_sample_code(&bin, quad_size, 128, count, 2, 6, 2, 6);
 
-    uint64_t v = matd_value(C);
+    // printf("v=%llx\n", *code);
 
-    // printf("v=%llx\n", v);
+    return 0;
+}
+
+// finds the tags in the full frame 'im' and writes them to 'line' as
+// "N tags; id=.. hamming=.. rotation=.. center=X,Y; ...", followed by
+// "; N dropped over budget" if the quad budgets cut the search short.
+// Returns the number of tags.
+static int frame_tags(apriltag_family_t* family, const image_u8_t* im, workspace_t* ws, char* line, size_t size, quad_stats_t* stats)
+{
+    quad_config_t qc = quad_config;
+    qc.pool = frame_pool();
+    quad_stats_t st;
+    quad_tag_t* quads = (quad_tag_t*)workspace_alloc(ws, MAX_TAGS * sizeof(quad_tag_t));
+    int nquads = quad_detect(im, &qc, ws, quads, MAX_TAGS, &st);
+    if (stats)
+        *stats = st;
 
-    matd_destroy(B);
-    matd_destroy(x);
-    matd_destroy(C);
+    uint64_t codes[MAX_TAGS];
+    struct quick_decode_entry entries[MAX_TAGS];
+    for (int i = 0; i < nquads; i++)
+        codes[i] = quads[i].code;
+    quick_decode_codewords(family, codes, nquads, entries);
 
-    return v;
+    int ntags = 0;
+    size_t len = 0;
+    line[0] = 0;
+    for (int i = 0; i < nquads; i++) {
+        if (entries[i].hamming == 255)
+            continue;
+        ntags++;
+        if (len < size)
+            len += snprintf(&line[len], size - len, "; id=%u hamming=%d rotation=%d center=%.1f,%.1f",
+                entries[i].id, entries[i].hamming, entries[i].rotation, quads[i].center[0], quads[i].center[1]);
+    }
+    if (st.ndropped > 0 && len < size)
+        snprintf(&line[len], size - len, "; %d dropped over budget", st.ndropped);
+
+    // the count goes first.
+    char head[32];
+    int n = snprintf(head, sizeof(head), "%d tags", ntags);
+    len = strlen(line);
+    if (len + n + 1 > size)
+        len = size - n - 1;
+    memmove(&line[n], line, len);
+    memcpy(line, head, n);
+    line[n + len] = 0;
+
+    return ntags;
+}
+
+// batch_run() decode stage: loads the frame.
+static void* batch_decode(void* arg, const char* path, char* line, size_t size)
+{
+    (void)arg;
+
+    frame_t* f = new frame_t;
+    if (frame_load(path, f, line, size) != 0) {
+        delete f;
+        return NULL;
+    }
+
+    return f;
+}
+
+// batch_run() detect stage: one result line per frame.
+static int batch_detect(void* arg, workspace_t* ws, void* frame, const char* path, char* line, size_t size)
+{
+    apriltag_family_t* family = (apriltag_family_t*)arg;
+    frame_t* f = (frame_t*)frame;
+    struct quick_decode_entry entry;
+    uint64_t v;
+
+    if (full_frame) {
+        char tags[BATCH_LINE_MAX];
+        frame_tags(family, &f->im, ws, tags, sizeof(tags), NULL);
+        frame_release(f);
+        delete f;
+        snprintf(line, size, "%s %s", path, tags);
+        return 0;
+    }
+
+    int ret = detector(&f->im, ws, &v);
+    frame_release(f);
+    delete f;
+    if (ret != 0) {
+        snprintf(line, size, "%s: image too small", path);
+        return -1;
+    }
+
+    quick_decode_codeword(family, v, &entry);
+    snprintf(line, size, "%s rcode=%llx, id=%u, hamming=%d, rotation=%d",
+        path, (unsigned long long)entry.rcode, entry.id, entry.hamming, entry.rotation);
+
+    return 0;
+}
+
+// stream_run() callback: the result part of one frame's line.
+static int stream_detect(void* arg, workspace_t* ws, const stream_frame_t* frame, char* line, size_t size)
+{
+    apriltag_family_t* family = (apriltag_family_t*)arg;
+    struct quick_decode_entry entry;
+    uint64_t v;
+
+    if (full_frame) {
+        frame_tags(family, &frame->im, ws, line, size, NULL);
+        return 0;
+    }
+
+    if (detector(&frame->im, ws, &v) != 0) {
+        snprintf(line, size, "image too small");
+        return -1;
+    }
+
+    quick_decode_codeword(family, v, &entry);
+    snprintf(line, size, "rcode=%llx, id=%u, hamming=%d, rotation=%d",
+        (unsigned long long)entry.rcode, entry.id, entry.hamming, entry.rotation);
+
+    return 0;
+}
+
+#ifndef APRIL_NO_OPENCV
+// a video file or camera read through OpenCV, for streams that are neither
+// Y4M nor raw Y8.
+struct video_source {
+    VideoCapture cap;
+    Mat frame, gray;
+    int width, height;
+};
+
+static int video_read(void* src, uint8_t* buf)
+{
+    video_source* v = (video_source*)src;
+    if (!v->cap.read(v->frame) || v->frame.empty())
+        return -1;
+
+    if (v->frame.type() == CV_8UC1)
+        v->gray = v->frame;
+    else if (v->frame.type() == CV_8UC3)
+        cvtColor(v->frame, v->gray, COLOR_BGR2GRAY);
+    else if (v->frame.type() == CV_8UC4)
+        cvtColor(v->frame, v->gray, COLOR_BGRA2GRAY);
+    else
+        return -1;
+
+    // the ring slots are sized from the properties read at open; a frame of
+    // another size ends the stream.
+    if (v->gray.cols != v->width || v->gray.rows != v->height) {
+        fprintf(stderr, "video frame is %dx%d, expected %dx%d\n", v->gray.cols, v->gray.rows, v->width, v->height);
+        return -1;
+    }
+
+    for (int y = 0; y < v->height; y++)
+        memcpy(&buf[(size_t)y * v->width], v->gray.ptr(y), v->width);
+
+    return 0;
+}
+
+static void video_close(void* src)
+{
+    delete (video_source*)src;
+}
+
+static int video_open(stream_source_t* s, const char* path)
+{
+    video_source* v = new video_source;
+    if (!v->cap.open(path)) {
+        delete v;
+        return -1;
+    }
+
+    v->width = (int)v->cap.get(CAP_PROP_FRAME_WIDTH);
+    v->height = (int)v->cap.get(CAP_PROP_FRAME_HEIGHT);
+    if (v->width <= 0 || v->height <= 0) {
+        delete v;
+        return -1;
+    }
+
+    memset(s, 0, sizeof(*s));
+    s->width = v->width;
+    s->height = v->height;
+    double fps = v->cap.get(CAP_PROP_FPS);
+    if (fps > 0) {
+        s->fps_num = (int)(fps * 1000 + 0.5);
+        s->fps_den = 1000;
+    }
+    s->read = video_read;
+    s->close = video_close;
+    s->src = v;
+
+    return 0;
+}
+#endif
+
+static void usage(const char* name)
+{
+    printf("usage: %s [-s WIDTHxHEIGHT] image\n", name);
+    printf("       %s -b [-r threads] [-j threads] [-t threads] [-u] [-s WIDTHxHEIGHT] (directory | glob | -)\n", name);
+    printf("  -b  batch mode: one result line per image; '-' reads paths from stdin\n");
+    printf("  -r  read-ahead threads (default 1)\n");
+    printf("  -j  decode threads (default one per CPU)\n");
+    printf("  -t  detect threads (default 1)\n");
+    printf("  -u  write results as they finish instead of in input order\n");
+    printf("       %s -v [-l] [-q frames] [-t threads] [-s WIDTHxHEIGHT] (stream | -)...\n", name);
+    printf("  -v  stream mode: Y4M or raw Y8 streams, named pipes or video files;\n");
+    printf("      several streams share -t detect threads (default one per CPU)\n");
+    printf("  -l  latest frame wins: drop frames when detection falls behind\n");
+    printf("  -q  frames buffered between capture and detection (default 4)\n");
+    printf("  -s  input files are raw Y8 frames of this size\n");
+    printf("  -f  find tags anywhere in full frames, instead of each frame being one tag\n");
+    printf("  -d  with -f, find quads at 1/N resolution (default 2); with -v, the quad\n");
+    printf("      stages also have time budgets, and drop candidates when over\n");
+    printf("  -p  threads that threshold each frame in bands (default 1); with several\n");
+    printf("      streams, above 1 splits frames over the -t detect threads instead\n");
 }
 
 int main(int argc, char** argv)
@@ -74,20 +393,188 @@ int main(int argc, char** argv)
     int64_t t3, t2, t1, t0;
     int i;
 
+    int batch = 0, streaming = 0, nbands = 1;
+    batch_config_t config = { 0, 0, 0, 1 };
+    stream_config_t stream_config = { 4, STREAM_PROCESS_ALL, 0 };
+    int opt;
+    quad_config_init(&quad_config);
+    while ((opt = getopt(argc, argv, "br:j:t:us:vlq:fd:p:")) != -1) {
+        if (opt == 'b')
+            batch = 1;
+        else if (opt == 'v')
+            streaming = 1;
+        else if (opt == 'l')
+            stream_config.policy = STREAM_LATEST;
+        else if (opt == 'q')
+            stream_config.capacity = atoi(optarg);
+        else if (opt == 'r')
+            config.nreaders = atoi(optarg);
+        else if (opt == 'j')
+            config.ndecoders = atoi(optarg);
+        else if (opt == 't')
+            config.ndetectors = atoi(optarg);
+        else if (opt == 'u')
+            config.ordered = 0;
+        else if (opt == 'f')
+            full_frame = 1;
+        else if (opt == 'd')
+            quad_config.decimate = atoi(optarg);
+        else if (opt == 'p')
+            nbands = atoi(optarg);
+        else if (opt == 's' && sscanf(optarg, "%dx%d", &raw_width, &raw_height) == 2)
+            continue;
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc || (!streaming && optind != argc - 1)) {
+        usage(argv[0]);
+        return 1;
+    }
+    char* filename = argv[optind];
+
+    // streams want a bound on latency; everything else wants every tag.
+    if (streaming)
+        quad_config_budget(&quad_config);
+
+    // the calling thread takes bands too. Several streams are detected on
+    // a pool with a thread per CPU already, and split their frames over it.
+    split_frames = nbands > 1;
+    if (split_frames && !(streaming && argc - optind > 1))
+        tile_pool = pool_create(nbands - 1);
+
+    if (streaming) {
+        // one decode table for all the streams.
+        apriltag_family_t* family = tag25h9_create();
+        if (tag25h9_decode_init_static(family, 2, QUICK_DECODE_ROTATIONS) != 0)
+            quick_decode_init_ex(family, 2, QUICK_DECODE_ROTATIONS);
+
+        int nsources = argc - optind;
+        stream_source_t* sources = (stream_source_t*)calloc(nsources, sizeof(stream_source_t));
+        stream_source_t** psources = (stream_source_t**)malloc(nsources * sizeof(stream_source_t*));
+        for (i = 0; i < nsources; i++) {
+            const char* path = argv[optind + i];
+            int opened = stream_open(&sources[i], path, raw_width, raw_height) == 0;
+#ifndef APRIL_NO_OPENCV
+            if (!opened && raw_width == 0 && strcmp(path, "-") != 0)
+                opened = video_open(&sources[i], path) == 0;
+#endif
+            if (!opened) {
+                printf("%s: cannot open stream\n", path);
+                return 1;
+            }
+            psources[i] = &sources[i];
+        }
+
+        stream_stats_t* stats = (stream_stats_t*)calloc(nsources, sizeof(stream_stats_t));
+        int ret;
+        if (nsources == 1) {
+            ret = stream_run(&sources[0], &stream_config, stream_detect, family, stdout, &stats[0]);
+        } else {
+            stream_config.nworkers = config.ndetectors;
+            ret = stream_run_many(psources, nsources, &stream_config, stream_detect, family, stdout, stats);
+        }
+        if (ret != 0)
+            fprintf(stderr, "cannot start the stream threads, or out of memory\n");
+
+        // Jain's index over the fraction of each stream's frames that were
+        // processed: 1 when every stream got the same share.
+        double sum = 0, sum2 = 0;
+        for (i = 0; i < nsources; i++) {
+            stream_stats_t* st = &stats[i];
+            fprintf(stderr, "%s: %llu frames: %llu processed, %llu dropped, %.1f frames/s, latency %.3f ms mean, %.3f ms max, detect %.3f s\n",
+                argv[optind + i], (unsigned long long)st->ncaptured, (unsigned long long)st->nprocessed, (unsigned long long)st->ndropped,
+                st->elapsed > 0 ? st->nprocessed * 1e6 / st->elapsed : 0.0,
+                st->nprocessed ? st->sum_latency / 1000.0 / st->nprocessed : 0.0, st->max_latency / 1000.0, st->busy / 1e6);
+
+            double share = st->ncaptured ? (double)st->nprocessed / st->ncaptured : 1.0;
+            sum += share;
+            sum2 += share * share;
+            stream_close(&sources[i]);
+        }
+        if (nsources > 1)
+            fprintf(stderr, "fairness %.3f\n", sum2 > 0 ? sum * sum / (nsources * sum2) : 1.0);
+
+        free(stats);
+        free(psources);
+        free(sources);
+        quick_decode_uninit(family);
+        tag25h9_destroy(family);
+        pool_destroy(tile_pool);
+        return ret != 0;
+    }
+
+    if (batch) {
+        // one read-only table shared by all workers.
+        apriltag_family_t* family = tag25h9_create();
+        if (tag25h9_decode_init_static(family, 2, QUICK_DECODE_ROTATIONS) != 0)
+            quick_decode_init_ex(family, 2, QUICK_DECODE_ROTATIONS);
+
+        batch_stats_t stats;
+        if (batch_run(filename, &config, batch_decode, batch_detect, family, stdout, &stats) != 0) {
+            printf("%s: cannot open, or cannot start the batch threads\n", filename);
+            return 1;
+        }
+        fprintf(stderr, "%llu images (%llu failed) in %.3f s, %.1f images/s\n",
+            (unsigned long long)stats.nimages, (unsigned long long)stats.nerrors, stats.elapsed / 1e6,
+            stats.elapsed > 0 ? stats.nimages * 1e6 / stats.elapsed : 0.0);
+        fprintf(stderr, "decode stage %.3f s, detect stage %.3f s of thread time\n",
+            stats.decode_time / 1e6, stats.detect_time / 1e6);
+
+        quick_decode_uninit(family);
+        tag25h9_destroy(family);
+        pool_destroy(tile_pool);
+        return stats.nerrors != 0;
+    }
+
     t0 = utime_now();
 
     t1 = utime_now();
     apriltag_family_t* family = tag25h9_create();
-    quick_decode_init(family, 2);
+    if (tag25h9_decode_init_static(family, 2, QUICK_DECODE_ROTATIONS) != 0)
+        quick_decode_init_ex(family, 2, QUICK_DECODE_ROTATIONS);
     t2 = utime_now();
     printf("decode init time  %8.3f ms\n", utime_get_useconds(t2 - t1) / 1000.0);
 
+    workspace_t* ws = workspace_create(0);
+    char err[256];
+
     for (i = 0; i < 10; i++) {
         t1 = utime_now();
         t3 = utime_now();
-        uint64_t v = detector(argv[1]);
+        frame_t f;
+        if (frame_load(filename, &f, err, sizeof(err)) != 0) {
+            printf("%s\n", err);
+            exit(-1);
+        }
+
+        uint64_t v;
+        if (full_frame) {
+            char tags[1024];
+            quad_stats_t stats;
+            frame_tags(family, &f.im, ws, tags, sizeof(tags), &stats);
+            workspace_reset(ws);
+            frame_release(&f);
+            t2 = utime_now();
+            printf("decode image time %8.3f ms: threshold %.3f, components %.3f, fit %.3f, sample %.3f ms%s\n",
+                utime_get_useconds(t2 - t1) / 1000.0, stats.time[QUAD_STAGE_THRESHOLD] / 1000.0,
+                stats.time[QUAD_STAGE_COMPONENTS] / 1000.0, stats.time[QUAD_STAGE_FIT] / 1000.0,
+                stats.time[QUAD_STAGE_SAMPLE] / 1000.0, stats.over_budget ? " (over budget)" : "");
+            if (i == 0)
+                printf("%d components, %d candidates, %d quads\n%s\n", stats.ncomponents, stats.ncandidates, stats.nquads, tags);
+            continue;
+        }
+        if (detector(&f.im, ws, &v) != 0) {
+            printf("%s: image too small\n", filename);
+            exit(-1);
+        }
+        workspace_reset(ws);
+        frame_release(&f);
         t2 = utime_now();
         printf("decode image time %8.3f ms\n", utime_get_useconds(t2 - t1) / 1000.0);
+        if (i == 0)
+            printf("decode scale      1/%d\n", f.scale);
 
         t1 = utime_now();
         quick_decode_codeword(family, v, &entry);
@@ -98,4 +585,7 @@ int main(int argc, char** argv)
             entry.rcode, entry.id, entry.hamming, entry.rotation, utime_get_useconds(t2 - t3) / 1000.0);
     }
     printf("all time          %8.3f ms\n", utime_get_useconds(t2 - t0) / 1000.0);
+
+    workspace_destroy(ws);
+    pool_destroy(tile_pool);
 }
\ No newline at end of file
@@ -38,14 +38,27 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MATD_X86 1
+#endif
+
 #include "matd.h"
+#include "matd_view.h"
 
 #define sq(x) ((x) * (x))
 #define max(a, b) (a) > (b) ? (a) : (b)
 
-static matd_t* matd_create_scalar(TYPE v)
+// zeroed storage for a matrix of n elements, from 'ws' or, if NULL, the heap.
+static matd_t* matd_alloc(workspace_t* ws, int n)
 {
-    matd_t* m = (matd_t*)calloc(1, sizeof(matd_t) + sizeof(TYPE));
+    size_t size = sizeof(matd_t) + n * sizeof(TYPE);
+    return (matd_t*)(ws ? workspace_calloc(ws, size) : calloc(1, size));
+}
+
+static matd_t* matd_create_scalar_ws(workspace_t* ws, TYPE v)
+{
+    matd_t* m = matd_alloc(ws, 1);
     m->nrows = 0;
     m->ncols = 0;
     m->data[0] = v;
@@ -53,6 +66,11 @@ static matd_t* matd_create_scalar(TYPE v)
     return m;
 }
 
+static matd_t* matd_create_scalar(TYPE v)
+{
+    return matd_create_scalar_ws(NULL, v);
+}
+
 static inline int matd_is_scalar(const matd_t* a)
 {
     assert(a != NULL);
@@ -75,33 +93,42 @@ static inline void matd_put_scalar(matd_t* m, TYPE value)
     m->data[0] = value;
 }
 
-matd_t* matd_create(int rows, int cols)
+matd_t* matd_create_ws(workspace_t* ws, int rows, int cols)
 {
     assert(rows >= 0);
     assert(cols >= 0);
 
     if (rows == 0 || cols == 0)
-        return matd_create_scalar(0);
+        return matd_create_scalar_ws(ws, 0);
 
-    matd_t* m = (matd_t*)calloc(1, sizeof(matd_t) + (rows * cols * sizeof(TYPE)));
+    matd_t* m = matd_alloc(ws, rows * cols);
     m->nrows = rows;
     m->ncols = cols;
 
     return m;
 }
 
-matd_t* matd_create_data(int rows, int cols, const uint8_t* data)
+matd_t* matd_create(int rows, int cols)
+{
+    return matd_create_ws(NULL, rows, cols);
+}
+
+matd_t* matd_create_data_ws(workspace_t* ws, int rows, int cols, const uint8_t* data)
 {
     if (rows == 0 || cols == 0)
-        return matd_create_scalar(data[0]);
+        return matd_create_scalar_ws(ws, data[0]);
 
-    matd_t* m = matd_create(rows, cols);
-    for (int i = 0; i < rows * cols; i++)
-        m->data[i] = data[i];
+    matd_t* m = matd_create_ws(ws, rows, cols);
+    matd_view_copy(matd_view_of(m), matd_view_make(data, rows, cols, cols));
 
     return m;
 }
 
+matd_t* matd_create_data(int rows, int cols, const uint8_t* data)
+{
+    return matd_create_data_ws(NULL, rows, cols, data);
+}
+
 matd_t* matd_identity(int dim)
 {
     if (dim == 0)
@@ -150,33 +177,31 @@ matd_t* matd_copy(const matd_t* m)
     assert(m != NULL);
 
     matd_t* x = matd_create(m->nrows, m->ncols);
-    if (matd_is_scalar(m))
-        x->data[0] = m->data[0];
-    else
-        memcpy(x->data, m->data, sizeof(TYPE) * m->ncols * m->nrows);
+    matd_view_copy(matd_view_of(x), matd_view_of(m));
 
     return x;
 }
 
-matd_t* matd_select(const matd_t* a, int r0, int r1, int c0, int c1)
+matd_t* matd_select_ws(workspace_t* ws, const matd_t* a, int r0, int r1, int c0, int c1)
 {
     assert(a != NULL);
 
     assert(r0 >= 0 && r0 < a->nrows);
     assert(c0 >= 0 && c0 < a->ncols);
 
-    int nrows = r1 - r0 + 1;
-    int ncols = c1 - c0 + 1;
-
-    matd_t* r = matd_create(nrows, ncols);
-
-    for (int row = r0; row <= r1; row++)
-        for (int col = c0; col <= c1; col++)
-            MATD_EL(r, row - r0, col - c0) = MATD_EL(a, row, col);
+    // the result owns its elements, so this one has to copy; C++ callers
+    // can take matd_view_of(a).select() instead.
+    matd_t* r = matd_create_ws(ws, r1 - r0 + 1, c1 - c0 + 1);
+    matd_view_copy(matd_view_of(r), matd_view_of(a).select(r0, r1, c0, c1));
 
     return r;
 }
 
+matd_t* matd_select(const matd_t* a, int r0, int r1, int c0, int c1)
+{
+    return matd_select_ws(NULL, a, r0, r1, c0, c1);
+}
+
 void matd_print(const matd_t* m, const char* fmt)
 {
     assert(m != NULL);
@@ -234,16 +259,7 @@ matd_t* matd_multiply(const matd_t* a, const matd_t* b)
 
     assert(a->ncols == b->nrows);
     matd_t* m = matd_create(a->nrows, b->ncols);
-
-    for (int i = 0; i < m->nrows; i++) {
-        for (int j = 0; j < m->ncols; j++) {
-            TYPE acc = 0;
-            for (int k = 0; k < a->ncols; k++) {
-                acc += MATD_EL(a, i, k) * MATD_EL(b, k, j);
-            }
-            MATD_EL(m, i, j) = acc;
-        }
-    }
+    matd_view_multiply(matd_view_of(m), matd_view_of(a), matd_view_of(b));
 
     return m;
 }
@@ -252,16 +268,8 @@ matd_t* matd_scale(const matd_t* a, TYPE s)
 {
     assert(a != NULL);
 
-    if (matd_is_scalar(a))
-        return matd_create_scalar(a->data[0] * s);
-
     matd_t* m = matd_create(a->nrows, a->ncols);
-
-    for (int i = 0; i < m->nrows; i++) {
-        for (int j = 0; j < m->ncols; j++) {
-            MATD_EL(m, i, j) = s * MATD_EL(a, i, j);
-        }
-    }
+    matd_view_scale(matd_view_of(m), matd_view_of(a), s);
 
     return m;
 }
@@ -270,16 +278,7 @@ void matd_scale_inplace(matd_t* a, TYPE s)
 {
     assert(a != NULL);
 
-    if (matd_is_scalar(a)) {
-        a->data[0] *= s;
-        return;
-    }
-
-    for (int i = 0; i < a->nrows; i++) {
-        for (int j = 0; j < a->ncols; j++) {
-            MATD_EL(a, i, j) *= s;
-        }
-    }
+    matd_view_scale(matd_view_of(a), matd_view_of(a), s);
 }
 
 matd_t* matd_add(const matd_t* a, const matd_t* b)
@@ -289,16 +288,8 @@ matd_t* matd_add(const matd_t* a, const matd_t* b)
     assert(a->nrows == b->nrows);
     assert(a->ncols == b->ncols);
 
-    if (matd_is_scalar(a))
-        return matd_create_scalar(a->data[0] + b->data[0]);
-
     matd_t* m = matd_create(a->nrows, a->ncols);
-
-    for (int i = 0; i < m->nrows; i++) {
-        for (int j = 0; j < m->ncols; j++) {
-            MATD_EL(m, i, j) = MATD_EL(a, i, j) + MATD_EL(b, i, j);
-        }
-    }
+    matd_view_add(matd_view_of(m), matd_view_of(a), matd_view_of(b));
 
     return m;
 }
@@ -310,16 +301,7 @@ void matd_add_inplace(matd_t* a, const matd_t* b)
     assert(a->nrows == b->nrows);
     assert(a->ncols == b->ncols);
 
-    if (matd_is_scalar(a)) {
-        a->data[0] += b->data[0];
-        return;
-    }
-
-    for (int i = 0; i < a->nrows; i++) {
-        for (int j = 0; j < a->ncols; j++) {
-            MATD_EL(a, i, j) += MATD_EL(b, i, j);
-        }
-    }
+    matd_view_add(matd_view_of(a), matd_view_of(a), matd_view_of(b));
 }
 
 matd_t* matd_subtract(const matd_t* a, const matd_t* b)
@@ -329,16 +311,8 @@ matd_t* matd_subtract(const matd_t* a, const matd_t* b)
     assert(a->nrows == b->nrows);
     assert(a->ncols == b->ncols);
 
-    if (matd_is_scalar(a))
-        return matd_create_scalar(a->data[0] - b->data[0]);
-
     matd_t* m = matd_create(a->nrows, a->ncols);
-
-    for (int i = 0; i < m->nrows; i++) {
-        for (int j = 0; j < m->ncols; j++) {
-            MATD_EL(m, i, j) = MATD_EL(a, i, j) - MATD_EL(b, i, j);
-        }
-    }
+    matd_view_subtract(matd_view_of(m), matd_view_of(a), matd_view_of(b));
 
     return m;
 }
@@ -350,131 +324,391 @@ void matd_subtract_inplace(matd_t* a, const matd_t* b)
     assert(a->nrows == b->nrows);
     assert(a->ncols == b->ncols);
 
-    if (matd_is_scalar(a)) {
-        a->data[0] -= b->data[0];
-        return;
-    }
-
-    for (int i = 0; i < a->nrows; i++) {
-        for (int j = 0; j < a->ncols; j++) {
-            MATD_EL(a, i, j) -= MATD_EL(b, i, j);
-        }
-    }
+    matd_view_subtract(matd_view_of(a), matd_view_of(a), matd_view_of(b));
 }
 
 matd_t* matd_transpose(const matd_t* a)
 {
     assert(a != NULL);
 
-    if (matd_is_scalar(a))
-        return matd_create_scalar(a->data[0]);
-
     matd_t* m = matd_create(a->ncols, a->nrows);
+    matd_view_transpose(matd_view_of(m), matd_view_of(a));
 
-    for (int i = 0; i < a->nrows; i++) {
-        for (int j = 0; j < a->ncols; j++) {
-            MATD_EL(m, j, i) = MATD_EL(a, i, j);
-        }
-    }
     return m;
 }
 
 TYPE matd_max(matd_t* m)
 {
-    TYPE d = 0;
-    for (int x = 0; x < m->nrows; x++) {
-        for (int y = 0; y < m->ncols; y++) {
-            if (MATD_EL(m, x, y) > d)
-                d = MATD_EL(m, x, y);
+    if (matd_is_scalar(m))
+        return 0;
+    return matd_view_max(matd_view_of(m));
+}
+
+int matd_nonzero(matd_t* m)
+{
+    if (matd_is_scalar(m))
+        return 0;
+    return matd_view_nonzero(matd_view_of(m));
+}
+
+matd_t* matd_reduce_ws(workspace_t* ws, const matd_t* m, int dim, int thresh, int num)
+{
+    matd_t* t = matd_create_ws(ws, m->nrows / dim, m->ncols / dim);
+    if (matd_is_scalar(t))
+        return t;
+
+    matd_view<TYPE> counts = matd_view_of(t);
+    matd_view_count_cells(counts, matd_view_of(m), dim, thresh);
+    matd_view_threshold(counts, counts, num);
+
+    return t;
+}
+
+matd_t* matd_reduce(matd_t* m, int dim, int thresh, int num)
+{
+    return matd_reduce_ws(NULL, m, dim, thresh, num);
+}
+
+uint64_t matd_value(matd_t* t)
+{
+    uint64_t v = 0;
+    for (int x = 0; x < t->nrows; x++) {
+        for (int y = 0; y < t->ncols; y++) {
+            v = v << 1;
+            if (MATD_EL(t, x, y) == 1) {
+                v += 1;
+            }
         }
     }
+    return v;
+}
 
-    return d;
+uint64_t matd_reduce_value(matd_t* m, int dim, int thresh, int num)
+{
+    // only complete cells are counted, as in matd_reduce().
+    matd_t* t = matd_create(m->nrows / dim, m->ncols / dim);
+    uint64_t v = 0;
+
+    if (!matd_is_scalar(t)) {
+        matd_view_count_cells(matd_view_of(t), matd_view_of(m), dim, thresh);
+        v = matd_view_bits(matd_view_of(t), num);
+    }
+    matd_destroy(t);
+
+    return v;
 }
 
-int matd_nonzero(matd_t* m)
+/**
+ * Cell counting kernels. A kernel walks one image row that is split into
+ * 'ncells' consecutive spans of 'dim' pixels, and adds the number of pixels
+ * >= thresh (0 <= thresh <= 255) in span i to counts[i]. The best kernel for
+ * the running CPU is picked on first use.
+ */
+typedef void (*matd_count_row_t)(const uint8_t* row, int dim, int ncells, int thresh, int* counts);
+
+static void matd_count_row_scalar(const uint8_t* row, int dim, int ncells, int thresh, int* counts)
+{
+    for (int c = 0; c < ncells; c++) {
+        const uint8_t* p = &row[c * dim];
+        int n = 0;
+        for (int x = 0; x < dim; x++)
+            n += (p[x] >= thresh);
+        counts[c] += n;
+    }
+}
+
+#ifdef MATD_X86
+
+// v >= t for unsigned bytes is max(v, t) == v; the 0xff/0x00 result is
+// turned into 0/1 and summed horizontally with psadbw.
+__attribute__((target("sse2"))) static void matd_count_row_sse2(const uint8_t* row, int dim, int ncells, int thresh, int* counts)
 {
-    int count = 0;
-    for (int x = 0; x < m->nrows; x++) {
-        for (int y = 0; y < m->ncols; y++) {
-            if (MATD_EL(m, x, y) != 0)
-                count++;
+    const __m128i t = _mm_set1_epi8((char)thresh);
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (int c = 0; c < ncells; c++) {
+        const uint8_t* p = &row[c * dim];
+        __m128i acc = _mm_setzero_si128();
+        int x = 0;
+        for (; x + 16 <= dim; x += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)&p[x]);
+            __m128i ge = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, t), v), one);
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(ge, zero));
         }
+        int n = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+        for (; x < dim; x++)
+            n += (p[x] >= thresh);
+        counts[c] += n;
     }
+}
 
-    return count;
+__attribute__((target("avx2"))) static void matd_count_row_avx2(const uint8_t* row, int dim, int ncells, int thresh, int* counts)
+{
+    const __m256i t = _mm256_set1_epi8((char)thresh);
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (int c = 0; c < ncells; c++) {
+        const uint8_t* p = &row[c * dim];
+        __m256i acc = _mm256_setzero_si256();
+        int x = 0;
+        for (; x + 32 <= dim; x += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)&p[x]);
+            __m256i ge = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, t), v), one);
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(ge, zero));
+        }
+        __m128i acc2 = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        if (x + 16 <= dim) {
+            __m128i v = _mm_loadu_si128((const __m128i*)&p[x]);
+            __m128i ge = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, _mm256_castsi256_si128(t)), v),
+                _mm256_castsi256_si128(one));
+            acc2 = _mm_add_epi64(acc2, _mm_sad_epu8(ge, _mm_setzero_si128()));
+            x += 16;
+        }
+        int n = _mm_cvtsi128_si32(acc2) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc2, acc2));
+        for (; x < dim; x++)
+            n += (p[x] >= thresh);
+        counts[c] += n;
+    }
 }
 
-matd_t* matd_reduce(matd_t* m, int dim, int thresh, int num)
+// AVX-512BW compares straight into a mask register, and a masked load
+// handles the tail of each span without reading past it.
+__attribute__((target("avx512f,avx512bw,popcnt"))) static void matd_count_row_avx512(const uint8_t* row, int dim, int ncells, int thresh, int* counts)
 {
-    int new_r = m->nrows / dim;
-    int new_c = m->ncols / dim;
-
-    matd_t* t = matd_create(new_r, new_c);
-    for (int x = 0; x < m->nrows; x++) {
-        for (int y = 0; y < m->ncols; y++) {
-            int r = x / dim;
-            int c = y / dim;
-            // printf("%d = %d\n", MATD_EL(m, x, y), thresh);
-            if (r < new_r && c < new_c) {
-                // printf("r=%d,c=%d\n", r, c);
-                if (MATD_EL(m, x, y) >= thresh)
-                    MATD_EL(t, r, c) += 1;
-            }
+    const __m512i t = _mm512_set1_epi8((char)thresh);
+
+    for (int c = 0; c < ncells; c++) {
+        const uint8_t* p = &row[c * dim];
+        int n = 0;
+        int x = 0;
+        for (; x + 64 <= dim; x += 64)
+            n += _mm_popcnt_u64(_mm512_cmpge_epu8_mask(_mm512_loadu_si512(&p[x]), t));
+        if (x < dim) {
+            __mmask64 tail = _cvtu64_mask64(UINT64_MAX >> (64 - (dim - x)));
+            n += _mm_popcnt_u64(_mm512_mask_cmpge_epu8_mask(tail, _mm512_maskz_loadu_epi8(tail, &p[x]), t));
         }
+        counts[c] += n;
     }
+}
 
-    for (int x = 0; x < t->nrows; x++) {
-        for (int y = 0; y < t->ncols; y++) {
-            // printf("%d = %d\n", MATD_EL(t, x, y), num);
-            if (MATD_EL(t, x, y) >= num) {
-                MATD_EL(t, x, y) = 1;
-            } else {
-                MATD_EL(t, x, y) = 0;
-            }
+#endif
+
+static const char* matd_count_row_isa = NULL;
+static matd_count_row_t matd_count_row_fn = NULL;
+
+static matd_count_row_t matd_count_row_select(void)
+{
+    if (__atomic_load_n(&matd_count_row_isa, __ATOMIC_ACQUIRE))
+        return __atomic_load_n(&matd_count_row_fn, __ATOMIC_RELAXED);
+
+    const char* isa = "scalar";
+    matd_count_row_t fn = matd_count_row_scalar;
+
+    // MATD_COUNT_ISA=avx2|sse2|scalar caps the kernel choice, which is handy
+    // for benchmarking and for ruling out a kernel when chasing a bug.
+    const char* cap = getenv("MATD_COUNT_ISA");
+    int level = 3;
+    if (cap && !strcmp(cap, "avx2"))
+        level = 2;
+    else if (cap && !strcmp(cap, "sse2"))
+        level = 1;
+    else if (cap && !strcmp(cap, "scalar"))
+        level = 0;
+
+#ifdef MATD_X86
+    __builtin_cpu_init();
+    if (level >= 3 && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt")) {
+        isa = "avx512";
+        fn = matd_count_row_avx512;
+    } else if (level >= 2 && __builtin_cpu_supports("avx2")) {
+        isa = "avx2";
+        fn = matd_count_row_avx2;
+    } else if (level >= 1 && __builtin_cpu_supports("sse2")) {
+        isa = "sse2";
+        fn = matd_count_row_sse2;
+    }
+#endif
+
+    // a racing first call from another thread picks the same kernel; the
+    // name is stored last, as it marks the kernel as picked.
+    __atomic_store_n(&matd_count_row_fn, fn, __ATOMIC_RELAXED);
+    __atomic_store_n(&matd_count_row_isa, isa, __ATOMIC_RELEASE);
+    return fn;
+}
+
+const char* matd_count_isa(void)
+{
+    matd_count_row_select();
+    return matd_count_row_isa;
+}
+
+// adds to counts(r, c) the number of pixels >= thresh in cell (r, c) of the
+// grid of dim x dim cells over 'im'; every cell must lie inside 'im'. Like
+// matd_view_count_cells(), with the row kernels doing the counting.
+static void matd_count_cells(const matd_view<const uint8_t>& im, int dim, int thresh, const matd_view<int>& counts)
+{
+    assert(counts.nrows * dim <= im.nrows && counts.ncols * dim <= im.ncols);
+
+    if (thresh > 255)
+        return;
+
+    if (thresh <= 0) {
+        for (int r = 0; r < counts.nrows; r++) {
+            for (int c = 0; c < counts.ncols; c++)
+                counts(r, c) += dim * dim;
         }
+        return;
     }
 
+    matd_count_row_t count_row = matd_count_row_select();
+
+    for (int y = 0; y < counts.nrows * dim; y++)
+        count_row(im.row(y), dim, counts.ncols, thresh, counts.row(y / dim));
+}
+
+matd_t* matd_reduce_image_ws(workspace_t* ws, const image_u8_t* im, int dim, int thresh, int num)
+{
+    assert(im != NULL);
+    assert(dim > 0);
+
+    matd_t* t = matd_create_ws(ws, im->height / dim, im->width / dim);
+    if (matd_is_scalar(t))
+        return t;
+
+    matd_view<TYPE> counts = matd_view_of(t);
+    matd_count_cells(matd_view_of(im), dim, thresh, counts);
+    matd_view_threshold(counts, counts, num);
+
     return t;
 }
 
-uint64_t matd_value(matd_t* t)
+matd_t* matd_reduce_image(const image_u8_t* im, int dim, int thresh, int num)
+{
+    return matd_reduce_image_ws(NULL, im, dim, thresh, num);
+}
+
+uint64_t matd_reduce_value_image(const image_u8_t* im, int dim, int thresh, int num)
 {
+    assert(im != NULL);
+    assert(dim > 0);
+
+    matd_t* t = matd_create(im->height / dim, im->width / dim);
     uint64_t v = 0;
-    for (int x = 0; x < t->nrows; x++) {
-        for (int y = 0; y < t->ncols; y++) {
-            v = v << 1;
-            if (MATD_EL(t, x, y) == 1) {
-                v += 1;
-            }
+
+    if (!matd_is_scalar(t)) {
+        matd_count_cells(matd_view_of(im), dim, thresh, matd_view_of(t));
+        v = matd_view_bits(matd_view_of(t), num);
+    }
+    matd_destroy(t);
+
+    return v;
+}
+
+uint64_t matd_sample_code(const image_u8_t* im, int dim, int thresh, int num, int r0, int r1, int c0, int c1)
+{
+    assert(im != NULL);
+    assert(dim > 0);
+    assert(r0 >= 0 && r0 <= r1 && (r1 + 1) * dim <= im->height);
+    assert(c0 >= 0 && c0 <= c1 && (c1 + 1) * dim <= im->width);
+
+    int nrows = r1 - r0 + 1;
+    int ncols = c1 - c0 + 1;
+    assert(nrows * ncols <= 64);
+
+    int buf[64];
+    memset(buf, 0, nrows * ncols * sizeof(int));
+    matd_view<int> counts = matd_view_make(buf, nrows, ncols, ncols);
+
+    // the selected cells are a view into the frame; nothing is copied.
+    matd_count_cells(matd_view_of(im).select(r0 * dim, (r1 + 1) * dim - 1, c0 * dim, (c1 + 1) * dim - 1), dim, thresh, counts);
+
+    return matd_view_bits(counts, num);
+}
+
+matd_t* matd_reduce_bits(const image_u1_t* b, int dim, int num)
+{
+    assert(b != NULL);
+    assert(dim > 0);
+
+    matd_t* t = matd_create(b->height / dim, b->width / dim);
+
+    for (unsigned int x = 0; x < t->nrows; x++) {
+        for (unsigned int y = 0; y < t->ncols; y++) {
+            MATD_EL(t, x, y) = image_u1_count(b, y * dim, x * dim, dim, dim) >= num ? 1 : 0;
         }
     }
+
+    return t;
+}
+
+uint64_t matd_reduce_value_bits(const image_u1_t* b, int dim, int num)
+{
+    assert(b != NULL);
+    assert(dim > 0);
+
+    uint64_t v = 0;
+
+    for (int x = 0; x < b->height / dim; x++) {
+        for (int y = 0; y < b->width / dim; y++) {
+            v = (v << 1) | (image_u1_count(b, y * dim, x * dim, dim, dim) >= num);
+        }
+    }
+
     return v;
 }
 
-uint64_t matd_reduce_value(matd_t* m, int dim, int thresh, int num)
+uint64_t matd_sample_code_bits(const image_u1_t* b, int dim, int num, int r0, int r1, int c0, int c1)
 {
+    assert(b != NULL);
+    assert(dim > 0);
+    assert(r0 >= 0 && r0 <= r1 && (r1 + 1) * dim <= b->height);
+    assert(c0 >= 0 && c0 <= c1 && (c1 + 1) * dim <= b->width);
+    assert((r1 - r0 + 1) * (c1 - c0 + 1) <= 64);
+
     uint64_t v = 0;
 
-    int new_r = m->nrows / dim;
-    int new_c = m->ncols / dim;
-    matd_t* t = matd_create(new_r, new_c);
-    for (int x = 0; x < m->nrows; x++) {
-        for (int y = 0; y < m->ncols; y++) {
-            int r = x / dim;
-            int c = y / dim;
-            // printf("%d = %d\n", MATD_EL(m, x, y), thresh);
-            if (MATD_EL(m, x, y) >= thresh)
-                MATD_EL(t, r, c) += 1;
+    for (int x = r0; x <= r1; x++) {
+        for (int y = c0; y <= c1; y++) {
+            v = (v << 1) | (image_u1_count(b, y * dim, x * dim, dim, dim) >= num);
         }
     }
 
-    for (int x = 0; x < t->nrows; x++) {
-        for (int y = 0; y < t->ncols; y++) {
-            v = v << 1;
-            if (MATD_EL(t, x, y) >= num) {
-                v += 1;
-            }
+    return v;
+}
+
+matd_t* matd_reduce_integral(const integral_t* ii, int x0, int y0, int dim, int num)
+{
+    assert(ii != NULL);
+    assert(dim > 0);
+    assert(x0 >= 0 && x0 <= ii->width && y0 >= 0 && y0 <= ii->height);
+
+    matd_t* t = matd_create((ii->height - y0) / dim, (ii->width - x0) / dim);
+
+    for (unsigned int x = 0; x < t->nrows; x++) {
+        for (unsigned int y = 0; y < t->ncols; y++) {
+            MATD_EL(t, x, y) = (int)integral_count(ii, x0 + y * dim, y0 + x * dim, dim, dim) >= num ? 1 : 0;
+        }
+    }
+
+    return t;
+}
+
+uint64_t matd_sample_code_integral(const integral_t* ii, int x0, int y0, int dim, int num, int r0, int r1, int c0, int c1)
+{
+    assert(ii != NULL);
+    assert(dim > 0);
+    assert(x0 >= 0 && y0 >= 0);
+    assert(r0 >= 0 && r0 <= r1 && y0 + (r1 + 1) * dim <= ii->height);
+    assert(c0 >= 0 && c0 <= c1 && x0 + (c1 + 1) * dim <= ii->width);
+    assert((r1 - r0 + 1) * (c1 - c0 + 1) <= 64);
+
+    uint64_t v = 0;
+
+    for (int x = r0; x <= r1; x++) {
+        for (int y = c0; y <= c1; y++) {
+            v = (v << 1) | ((int)integral_count(ii, x0 + y * dim, y0 + x * dim, dim, dim) >= num);
         }
     }
 
@@ -6,6 +6,11 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "image_u1.h"
+#include "image_u8.h"
+#include "integral.h"
+#include "workspace.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -18,6 +23,10 @@ extern "C" {
  *
  * nrows and ncols are 1-based counts with the exception that a scalar (non-matrix)
  *   is represented with nrows=0 and/or ncols=0.
+ *
+ * The operations are implemented on the typed, strided matd_view<T> of
+ * matd_view.h, which C++ code can also use directly for copy-free
+ * sub-matrices and 8- or 16-bit elements.
  */
 typedef struct {
     unsigned int nrows, ncols;
@@ -177,6 +186,72 @@ uint64_t matd_value(matd_t* t);
 
 uint64_t matd_reduce_value(matd_t* m, int dim, int thresh, int num);
 
+/**
+ * Same as matd_reduce(), but reads the pixels straight out of the 8-bit image
+ * view 'im' instead of an int matrix, so the frame never has to be widened
+ * or copied. Only complete dim x dim cells are counted. It is the caller's
+ * responsibility to call matd_destroy() on the returned matrix.
+ */
+matd_t* matd_reduce_image(const image_u8_t* im, int dim, int thresh, int num);
+
+/**
+ * Same as matd_reduce_value(), but reads the pixels straight out of the
+ * 8-bit image view 'im'. Only complete dim x dim cells are counted.
+ */
+uint64_t matd_reduce_value_image(const image_u8_t* im, int dim, int thresh, int num);
+
+/**
+ * Fused equivalent of matd_value(matd_select(matd_reduce_image(im, dim, thresh, num),
+ * r0, r1, c0, c1)): counts the pixels >= thresh in each dim x dim cell of
+ * rows 'r0' through 'r1' and columns 'c0' through 'c1' (inclusive, zero-based
+ * cell indexes), and packs one bit per cell (count >= num) in row-major order,
+ * first cell in the most significant position. Cells outside the selection are
+ * never read and nothing is allocated. At most 64 cells may be selected.
+ */
+uint64_t matd_sample_code(const image_u8_t* im, int dim, int thresh, int num, int r0, int r1, int c0, int c1);
+
+/**
+ * Binary-image counterparts of matd_reduce_image(), matd_reduce_value_image()
+ * and matd_sample_code() for a frame that was already thresholded with
+ * image_u1_threshold(). Cell counts come from masked popcounts over the packed
+ * row words, so one thresholded frame can be sampled with many grid
+ * hypotheses cheaply.
+ */
+matd_t* matd_reduce_bits(const image_u1_t* b, int dim, int num);
+uint64_t matd_reduce_value_bits(const image_u1_t* b, int dim, int num);
+uint64_t matd_sample_code_bits(const image_u1_t* b, int dim, int num, int r0, int r1, int c0, int c1);
+
+/**
+ * Summed-area-table counterparts of matd_reduce_image() and matd_sample_code().
+ * The grid of dim x dim cells starts at pixel (x0, y0) of the image that 'ii'
+ * was built from, so grid offsets, cell sizes and minimum counts can all be
+ * varied per query at a cost of four lookups per cell. matd_reduce_integral()
+ * covers every complete cell of the shifted grid; it is the caller's
+ * responsibility to call matd_destroy() on the returned matrix.
+ */
+matd_t* matd_reduce_integral(const integral_t* ii, int x0, int y0, int dim, int num);
+uint64_t matd_sample_code_integral(const integral_t* ii, int x0, int y0, int dim, int num, int r0, int r1, int c0, int c1);
+
+/**
+ * Variants of matd_create(), matd_create_data(), matd_select(), matd_reduce()
+ * and matd_reduce_image() that allocate the returned matrix from the
+ * workspace 'ws' instead of the heap, for the per-frame temporaries of the
+ * detector. The matrix lives until the next workspace_reset() and must not
+ * be passed to matd_destroy(). With a NULL ws they allocate from the heap,
+ * like the plain functions.
+ */
+matd_t* matd_create_ws(workspace_t* ws, int rows, int cols);
+matd_t* matd_create_data_ws(workspace_t* ws, int rows, int cols, const uint8_t* data);
+matd_t* matd_select_ws(workspace_t* ws, const matd_t* a, int r0, int r1, int c0, int c1);
+matd_t* matd_reduce_ws(workspace_t* ws, const matd_t* m, int dim, int thresh, int num);
+matd_t* matd_reduce_image_ws(workspace_t* ws, const image_u8_t* im, int dim, int thresh, int num);
+
+/**
+ * Returns the name of the cell counting kernel used by matd_reduce_image()
+ * and matd_sample_code() on this CPU ("avx512", "avx2", "sse2" or "scalar").
+ */
+const char* matd_count_isa(void);
+
 #ifdef __cplusplus
 }
 #endif
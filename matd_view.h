@@ -0,0 +1,266 @@
+#ifndef _MATD_VIEW_H
+#define _MATD_VIEW_H
+
+/**
+ * Typed, strided matrices. C++ only.
+ *
+ * A matd_view<T> does not own its elements: element (row, col) lives at
+ * data[row * stride + col], with stride in elements and at least ncols. So
+ * a sub-matrix is just another view on the same storage, made in O(1) by
+ * select(), and 8-bit pixels or 16-bit counts can be worked on where they
+ * are instead of being widened into an int matd_t first. The C matd_*()
+ * functions are wrappers that run these templates on views of their matd_t
+ * arguments.
+ *
+ *   matd_view<const uint8_t> frame = matd_view_of(&im);
+ *   matd_view<const uint8_t> cell = frame.select(2 * dim, 3 * dim - 1, 2 * dim, 3 * dim - 1);
+ *   int n = matd_view_count(cell, thresh);
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image_u8.h"
+#include "matd.h"
+#include "workspace.h"
+
+template <typename T>
+struct matd_view {
+    T* data;
+    int nrows, ncols;
+    ptrdiff_t stride;
+
+    T& operator()(int row, int col) const
+    {
+        return data[row * stride + col];
+    }
+
+    T* row(int row) const
+    {
+        return &data[row * stride];
+    }
+
+    /**
+     * A view of rows 'r0' through 'r1' and columns 'c0' through 'c1'
+     * (inclusive, zero-based), like matd_select() but without a copy.
+     */
+    matd_view select(int r0, int r1, int c0, int c1) const
+    {
+        assert(r0 >= 0 && r0 <= r1 && r1 < nrows);
+        assert(c0 >= 0 && c0 <= c1 && c1 < ncols);
+
+        matd_view v = { &(*this)(r0, c0), r1 - r0 + 1, c1 - c0 + 1, stride };
+        return v;
+    }
+
+    operator matd_view<const T>() const
+    {
+        matd_view<const T> v = { data, nrows, ncols, stride };
+        return v;
+    }
+};
+
+template <typename T>
+static inline matd_view<T> matd_view_make(T* data, int nrows, int ncols, ptrdiff_t stride)
+{
+    matd_view<T> v = { data, nrows, ncols, stride };
+    return v;
+}
+
+/**
+ * Views of a matd_t. A scalar is viewed as a 1x1 matrix.
+ */
+static inline matd_view<TYPE> matd_view_of(matd_t* m)
+{
+    if (m->nrows == 0 || m->ncols == 0)
+        return matd_view_make(m->data, 1, 1, 1);
+    return matd_view_make(m->data, (int)m->nrows, (int)m->ncols, m->ncols);
+}
+
+static inline matd_view<const TYPE> matd_view_of(const matd_t* m)
+{
+    return matd_view_of((matd_t*)m);
+}
+
+/**
+ * A view of the pixels of 'im', rows by columns.
+ */
+static inline matd_view<const uint8_t> matd_view_of(const image_u8_t* im)
+{
+    return matd_view_make(im->buf, im->height, im->width, im->stride);
+}
+
+/**
+ * Allocates a zeroed, contiguous rows x cols matrix from 'ws', valid until
+ * the next workspace_reset().
+ */
+template <typename T>
+static inline matd_view<T> matd_view_alloc(workspace_t* ws, int nrows, int ncols)
+{
+    T* data = (T*)workspace_calloc(ws, (size_t)nrows * ncols * sizeof(T));
+    return matd_view_make(data, nrows, ncols, ncols);
+}
+
+// applies f(dst(i, j), a(i, j)) over two views of the same size.
+template <typename D, typename A, typename F>
+static inline void matd_view_apply(const matd_view<D>& dst, const matd_view<A>& a, F f)
+{
+    assert(dst.nrows == a.nrows && dst.ncols == a.ncols);
+
+    for (int i = 0; i < dst.nrows; i++) {
+        D* d = dst.row(i);
+        const A* s = a.row(i);
+        for (int j = 0; j < dst.ncols; j++)
+            f(d[j], s[j]);
+    }
+}
+
+template <typename D, typename A>
+static inline void matd_view_copy(const matd_view<D>& dst, const matd_view<A>& a)
+{
+    matd_view_apply(dst, a, [](D& d, const A& s) { d = (D)s; });
+}
+
+template <typename D, typename A, typename B>
+static inline void matd_view_add(const matd_view<D>& dst, const matd_view<A>& a, const matd_view<B>& b)
+{
+    assert(a.nrows == b.nrows && a.ncols == b.ncols);
+    matd_view_copy(dst, a);
+    matd_view_apply(dst, b, [](D& d, const B& s) { d += s; });
+}
+
+template <typename D, typename A, typename B>
+static inline void matd_view_subtract(const matd_view<D>& dst, const matd_view<A>& a, const matd_view<B>& b)
+{
+    assert(a.nrows == b.nrows && a.ncols == b.ncols);
+    matd_view_copy(dst, a);
+    matd_view_apply(dst, b, [](D& d, const B& s) { d -= s; });
+}
+
+template <typename D, typename A, typename S>
+static inline void matd_view_scale(const matd_view<D>& dst, const matd_view<A>& a, S s)
+{
+    matd_view_apply(dst, a, [s](D& d, const A& v) { d = s * v; });
+}
+
+/**
+ * dst = a * b. dst must not overlap a or b.
+ */
+template <typename D, typename A, typename B>
+static inline void matd_view_multiply(const matd_view<D>& dst, const matd_view<A>& a, const matd_view<B>& b)
+{
+    assert(a.ncols == b.nrows);
+    assert(dst.nrows == a.nrows && dst.ncols == b.ncols);
+
+    for (int i = 0; i < dst.nrows; i++) {
+        for (int j = 0; j < dst.ncols; j++) {
+            D acc = 0;
+            for (int k = 0; k < a.ncols; k++)
+                acc += a(i, k) * b(k, j);
+            dst(i, j) = acc;
+        }
+    }
+}
+
+template <typename D, typename A>
+static inline void matd_view_transpose(const matd_view<D>& dst, const matd_view<A>& a)
+{
+    assert(dst.nrows == a.ncols && dst.ncols == a.nrows);
+
+    for (int i = 0; i < a.nrows; i++) {
+        for (int j = 0; j < a.ncols; j++)
+            dst(j, i) = a(i, j);
+    }
+}
+
+/**
+ * dst = 1 where a >= thresh, 0 elsewhere.
+ */
+template <typename D, typename A, typename V>
+static inline void matd_view_threshold(const matd_view<D>& dst, const matd_view<A>& a, V thresh)
+{
+    matd_view_apply(dst, a, [thresh](D& d, const A& s) { d = s >= thresh ? 1 : 0; });
+}
+
+/**
+ * The largest element of 'a', or 0 if all of them are negative.
+ */
+template <typename T>
+static inline T matd_view_max(const matd_view<T>& a)
+{
+    T d = 0;
+    for (int i = 0; i < a.nrows; i++) {
+        for (int j = 0; j < a.ncols; j++) {
+            if (a(i, j) > d)
+                d = a(i, j);
+        }
+    }
+
+    return d;
+}
+
+template <typename T>
+static inline int matd_view_nonzero(const matd_view<T>& a)
+{
+    int count = 0;
+    for (int i = 0; i < a.nrows; i++) {
+        for (int j = 0; j < a.ncols; j++)
+            count += a(i, j) != 0;
+    }
+
+    return count;
+}
+
+/**
+ * The number of elements of 'a' that are >= thresh.
+ */
+template <typename T, typename V>
+static inline int matd_view_count(const matd_view<T>& a, V thresh)
+{
+    int count = 0;
+    for (int i = 0; i < a.nrows; i++) {
+        const T* p = a.row(i);
+        for (int j = 0; j < a.ncols; j++)
+            count += p[j] >= thresh;
+    }
+
+    return count;
+}
+
+/**
+ * Adds to counts(r, c) the number of elements >= thresh in cell (r, c) of
+ * a grid of dim x dim cells over 'a'. Cells are only counted if they lie
+ * inside both 'a' and 'counts'.
+ */
+template <typename C, typename T, typename V>
+static inline void matd_view_count_cells(const matd_view<C>& counts, const matd_view<T>& a, int dim, V thresh)
+{
+    int nrows = counts.nrows < a.nrows / dim ? counts.nrows : a.nrows / dim;
+    int ncols = counts.ncols < a.ncols / dim ? counts.ncols : a.ncols / dim;
+
+    for (int r = 0; r < nrows; r++) {
+        for (int c = 0; c < ncols; c++)
+            counts(r, c) += matd_view_count(a.select(r * dim, (r + 1) * dim - 1, c * dim, (c + 1) * dim - 1), thresh);
+    }
+}
+
+/**
+ * Packs one bit per element of 'a', set if the element is >= num, in
+ * row-major order with the first element in the most significant position.
+ * Only the last 64 elements fit.
+ */
+template <typename T, typename V>
+static inline uint64_t matd_view_bits(const matd_view<T>& a, V num)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < a.nrows; i++) {
+        const T* p = a.row(i);
+        for (int j = 0; j < a.ncols; j++)
+            v = (v << 1) | (p[j] >= num);
+    }
+
+    return v;
+}
+
+#endif
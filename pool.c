@@ -0,0 +1,315 @@
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+// tasks per worker deque; a full deque spills to the shared queue.
+#define POOL_DEQUE_SIZE 256
+
+// the most threads that help the caller of pool_for().
+#define POOL_FOR_HELPERS 64
+
+/**
+ * A worker and its deque. Only the worker pushes, at 'bottom'; anyone,
+ * the worker included, takes from 'top' with a compare-and-swap, so a task
+ * is run exactly once however many threads race for it.
+ */
+struct pool_worker {
+    int64_t top __attribute__((aligned(64)));
+    int64_t bottom __attribute__((aligned(64)));
+    pool_task_t* tasks[POOL_DEQUE_SIZE];
+
+    pool_t* pool;
+    int index;
+    pthread_t thread;
+};
+
+struct pool {
+    struct pool_worker* workers;
+    int nworkers;
+
+    // the shared queue, a list of tasks from threads outside the pool.
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pool_task_t *shared_head, *shared_tail;
+    int64_t nshared;
+
+    int64_t nqueued; // tasks submitted but not yet taken
+    int nsleeping;
+    int stop;
+    int started; // nworkers is final; set under the mutex
+};
+
+// the worker the calling thread is, if any.
+static __thread struct pool_worker* pool_self;
+
+static int pool_deque_push(struct pool_worker* w, pool_task_t* task)
+{
+    int64_t b = w->bottom;
+    if (b - __atomic_load_n(&w->top, __ATOMIC_ACQUIRE) >= POOL_DEQUE_SIZE)
+        return -1;
+
+    __atomic_store_n(&w->tasks[b % POOL_DEQUE_SIZE], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static pool_task_t* pool_deque_take(struct pool_worker* w)
+{
+    for (;;) {
+        int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+        if (t >= __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE))
+            return NULL;
+
+        // the slot may be refilled as soon as top moves past it, so it is
+        // read before the swap and only used if the swap succeeds.
+        pool_task_t* task = __atomic_load_n(&w->tasks[t % POOL_DEQUE_SIZE], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&w->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return task;
+    }
+}
+
+static pool_task_t* pool_shared_take(pool_t* pool)
+{
+    if (__atomic_load_n(&pool->nshared, __ATOMIC_ACQUIRE) == 0)
+        return NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool_task_t* task = pool->shared_head;
+    if (task) {
+        pool->shared_head = task->next;
+        if (!pool->shared_head)
+            pool->shared_tail = NULL;
+        __atomic_sub_fetch(&pool->nshared, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return task;
+}
+
+// the next task for worker 'w': its own, then shared, then stolen.
+static pool_task_t* pool_take(struct pool_worker* w)
+{
+    pool_t* pool = w->pool;
+
+    pool_task_t* task = pool_deque_take(w);
+    if (!task)
+        task = pool_shared_take(pool);
+    for (int i = 1; !task && i < pool->nworkers; i++)
+        task = pool_deque_take(&pool->workers[(w->index + i) % pool->nworkers]);
+
+    if (task)
+        __atomic_sub_fetch(&pool->nqueued, 1, __ATOMIC_SEQ_CST);
+
+    return task;
+}
+
+static void* pool_worker_thread(void* p)
+{
+    struct pool_worker* w = (struct pool_worker*)p;
+    pool_t* pool = w->pool;
+    pool_self = w;
+
+    // nworkers is only known once every thread has been created.
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->started)
+        pthread_cond_wait(&pool->cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+
+    int spins = 0;
+    for (;;) {
+        pool_task_t* task = pool_take(w);
+        if (task) {
+            task->run(task, w->index);
+            spins = 0;
+            continue;
+        }
+
+        if (__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST) && __atomic_load_n(&pool->nqueued, __ATOMIC_SEQ_CST) == 0)
+            break;
+
+        // a task counted in nqueued may still be on its way into a deque,
+        // so look again for a while before sleeping.
+        if (spins++ < 64) {
+            sched_yield();
+            continue;
+        }
+        spins = 0;
+
+        // nsleeping is raised before nqueued is checked, and submitters
+        // raise nqueued before they check nsleeping, so a submission is
+        // never missed.
+        pthread_mutex_lock(&pool->mutex);
+        __atomic_add_fetch(&pool->nsleeping, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->nqueued, __ATOMIC_SEQ_CST) == 0 && !__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST))
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        __atomic_sub_fetch(&pool->nsleeping, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return NULL;
+}
+
+pool_t* pool_create(int nworkers)
+{
+    if (nworkers <= 0)
+        nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers <= 0)
+        nworkers = 1;
+
+    pool_t* pool = (pool_t*)calloc(1, sizeof(pool_t));
+    if (!pool)
+        return NULL;
+    pool->workers = (struct pool_worker*)aligned_alloc(64, nworkers * sizeof(struct pool_worker));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    memset(pool->workers, 0, nworkers * sizeof(struct pool_worker));
+    for (int i = 0; i < nworkers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+    }
+
+    // a thread that cannot be created leaves the pool one worker short.
+    int n = 0;
+    for (int i = 0; i < nworkers; i++)
+        n += pthread_create(&pool->workers[n].thread, NULL, pool_worker_thread, &pool->workers[n]) == 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->nworkers = n;
+    pool->started = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (n == 0) {
+        pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void pool_destroy(pool_t* pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->nworkers; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    assert(pool->nqueued == 0);
+
+    free(pool->workers);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+int pool_size(const pool_t* pool)
+{
+    return pool->nworkers;
+}
+
+pool_t* pool_current(void)
+{
+    return pool_self ? pool_self->pool : NULL;
+}
+
+void pool_submit(pool_t* pool, pool_task_t* task)
+{
+    struct pool_worker* w = pool_self;
+    if (!w || w->pool != pool || pool_deque_push(w, task) != 0) {
+        pthread_mutex_lock(&pool->mutex);
+        task->next = NULL;
+        if (pool->shared_tail)
+            pool->shared_tail->next = task;
+        else
+            pool->shared_head = task;
+        pool->shared_tail = task;
+        __atomic_add_fetch(&pool->nshared, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    __atomic_add_fetch(&pool->nqueued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->nsleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+struct pool_for_job {
+    void (*fn)(void* arg, int i);
+    void* arg;
+    int n;
+    int next; // the next index to claim
+    int nactive; // helpers that have not finished
+};
+
+struct pool_for_helper {
+    pool_task_t task;
+    struct pool_for_job* job;
+};
+
+static void pool_for_loop(struct pool_for_job* job)
+{
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n)
+        job->fn(job->arg, i);
+}
+
+static void pool_for_run(pool_task_t* task, int worker)
+{
+    (void)worker;
+    struct pool_for_job* job = ((struct pool_for_helper*)task)->job;
+
+    pool_for_loop(job);
+    // the job lives on the caller's stack, and may be gone right after.
+    __atomic_sub_fetch(&job->nactive, 1, __ATOMIC_RELEASE);
+}
+
+void pool_for(pool_t* pool, int n, void (*fn)(void* arg, int i), void* arg)
+{
+    int nhelpers = pool ? pool->nworkers : 0;
+    nhelpers = nhelpers < n - 1 ? nhelpers : n - 1;
+    nhelpers = nhelpers < POOL_FOR_HELPERS ? nhelpers : POOL_FOR_HELPERS;
+    if (nhelpers <= 0) {
+        for (int i = 0; i < n; i++)
+            fn(arg, i);
+        return;
+    }
+
+    struct pool_for_job job = { fn, arg, n, 0, nhelpers };
+    struct pool_for_helper helpers[POOL_FOR_HELPERS];
+    for (int i = 0; i < nhelpers; i++) {
+        helpers[i].task.run = pool_for_run;
+        helpers[i].job = &job;
+        pool_submit(pool, &helpers[i].task);
+    }
+
+    pool_for_loop(&job);
+
+    // every index is claimed, but helpers may still be running or queued.
+    // A worker runs queued tasks meanwhile, which include its own helpers.
+    struct pool_worker* w = pool_self && pool_self->pool == pool ? pool_self : NULL;
+    while (__atomic_load_n(&job.nactive, __ATOMIC_ACQUIRE) > 0) {
+        pool_task_t* task = w ? pool_take(w) : NULL;
+        if (task)
+            task->run(task, w->index);
+        else
+            sched_yield();
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A work-stealing thread pool. Every worker has a bounded deque of tasks:
+ * tasks submitted from a worker go to the bottom of its own deque, tasks
+ * submitted from other threads go to a shared queue, and a worker that
+ * runs out of work takes from the shared queue and then steals from the top
+ * of the other workers' deques. Workers also take their own tasks from the
+ * top, oldest first, so tasks that re-submit themselves take turns instead
+ * of starving the ones queued behind them. Idle workers sleep until a task
+ * is submitted.
+ *
+ * Tasks are not allocated by the pool: embed a pool_task_t as the first
+ * member of a larger struct and cast back to it in run(). A task must not
+ * be submitted again before it has started running.
+ */
+typedef struct pool_task pool_task_t;
+
+struct pool_task {
+    void (*run)(pool_task_t* task, int worker); // 'worker' is in [0, pool_size())
+    pool_task_t* next; // used by the pool
+};
+
+typedef struct pool pool_t;
+
+/**
+ * Creates a pool of 'nworkers' threads, or one per CPU if 'nworkers' is 0.
+ * The pool has fewer workers if some threads cannot be created; returns
+ * NULL if none can, or if memory runs out.
+ */
+pool_t* pool_create(int nworkers);
+
+/**
+ * Runs every task submitted so far to completion, then stops and frees the
+ * pool.
+ */
+void pool_destroy(pool_t* pool);
+
+int pool_size(const pool_t* pool);
+
+/**
+ * Returns the pool the calling thread is a worker of, or NULL if it is not
+ * a pool thread. A task can hand it to code that splits its work with
+ * pool_for(), so the split runs on the task's own pool rather than on a
+ * second set of threads.
+ */
+pool_t* pool_current(void);
+
+void pool_submit(pool_t* pool, pool_task_t* task);
+
+/**
+ * Runs fn(arg, i) for every i in [0, n) on the pool's workers and the
+ * calling thread, and returns when all of them have finished. A worker
+ * waiting in pool_for() runs other queued tasks meanwhile, so tasks may
+ * call it too. With a NULL pool the calls run on the calling thread.
+ */
+void pool_for(pool_t* pool, int n, void (*fn)(void* arg, int i), void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
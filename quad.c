@@ -0,0 +1,742 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "quad.h"
+#include "threshold.h"
+
+// the black square is 7 cells wide: a black border cell on each side of the
+// 5x5 data cells. The white margin is one more cell around it.
+#define QUAD_CELLS 7
+
+// samples across an edge when refining a side, enough for a range of 4
+// pixels.
+#define QUAD_MAX_PROFILE 19
+
+// the least ratio of the fitted quad's area to that of the hull around it.
+#define QUAD_MIN_FILL 0.85
+
+static int64_t quad_utime_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void quad_config_init(quad_config_t* config)
+{
+    memset(config, 0, sizeof(*config));
+    config->decimate = 2;
+    config->tile_size = 4;
+    config->min_contrast = 20;
+    config->min_side = 24;
+}
+
+void quad_config_budget(quad_config_t* config)
+{
+    config->budget[QUAD_STAGE_THRESHOLD] = 5000;
+    config->budget[QUAD_STAGE_COMPONENTS] = 5000;
+    config->budget[QUAD_STAGE_FIT] = 4000;
+    config->budget[QUAD_STAGE_SAMPLE] = 2000;
+}
+
+// the average of each decimate x decimate block of 'im'.
+static image_u8_t quad_decimate(const image_u8_t* im, int decimate, workspace_t* ws)
+{
+    int width = im->width / decimate, height = im->height / decimate;
+    uint8_t* buf = (uint8_t*)workspace_alloc(ws, (size_t)width * height);
+    int n = decimate * decimate;
+
+    for (int y = 0; y < height; y++) {
+        uint8_t* q = &buf[y * width];
+        const uint8_t* p = &im->buf[(int64_t)y * decimate * im->stride];
+        if (decimate == 2) {
+            // the common case, in a loop the compiler vectorizes.
+            const uint8_t* p1 = p + im->stride;
+            for (int x = 0; x < width; x++)
+                q[x] = (uint8_t)((p[2 * x] + p[2 * x + 1] + p1[2 * x] + p1[2 * x + 1] + 2) >> 2);
+            continue;
+        }
+        for (int x = 0; x < width; x++) {
+            int sum = 0;
+            for (int dy = 0; dy < decimate; dy++) {
+                for (int dx = 0; dx < decimate; dx++)
+                    sum += p[(int64_t)dy * im->stride + x * decimate + dx];
+            }
+            q[x] = (uint8_t)((sum + n / 2) / n);
+        }
+    }
+
+    return image_u8_view(width, height, width, buf);
+}
+
+// the runs of black pixels of each row, and the union-find forest over
+// them. Run r covers pixels x0[r] to x1[r] of row y[r].
+struct quad_runs {
+    int nruns;
+    int32_t *x0, *x1, *y;
+    uint32_t* parent;
+};
+
+static uint32_t quad_find(uint32_t* parent, uint32_t r)
+{
+    while (parent[r] != r) {
+        parent[r] = parent[parent[r]];
+        r = parent[r];
+    }
+    return r;
+}
+
+static void quad_union(uint32_t* parent, uint32_t a, uint32_t b)
+{
+    a = quad_find(parent, a);
+    b = quad_find(parent, b);
+    // the older run becomes the root, so roots stay in raster order.
+    if (a < b)
+        parent[b] = a;
+    else if (b < a)
+        parent[a] = b;
+}
+
+static void quad_components(const uint8_t* bin, int width, int height, workspace_t* ws, struct quad_runs* runs)
+{
+    int nruns = 0;
+    for (int y = 0; y < height; y++) {
+        const uint8_t* p = &bin[(int64_t)y * width];
+        for (int x = 0; x < width; x++)
+            nruns += p[x] == 0 && (x == 0 || p[x - 1] != 0);
+    }
+
+    runs->nruns = nruns;
+    runs->x0 = (int32_t*)workspace_alloc(ws, (nruns + 1) * sizeof(int32_t));
+    runs->x1 = (int32_t*)workspace_alloc(ws, (nruns + 1) * sizeof(int32_t));
+    runs->y = (int32_t*)workspace_alloc(ws, (nruns + 1) * sizeof(int32_t));
+    runs->parent = (uint32_t*)workspace_alloc(ws, (nruns + 1) * sizeof(uint32_t));
+
+    int n = 0, prev = 0, prev_end = 0;
+    for (int y = 0; y < height; y++) {
+        const uint8_t* p = &bin[(int64_t)y * width];
+        int start = n;
+        for (int x = 0; x < width;) {
+            if (p[x] != 0) {
+                x++;
+                continue;
+            }
+            int x0 = x;
+            while (x < width && p[x] == 0)
+                x++;
+            runs->x0[n] = x0;
+            runs->x1[n] = x - 1;
+            runs->y[n] = y;
+            runs->parent[n] = n;
+
+            // join the runs of the row above that overlap this one.
+            while (prev < prev_end && runs->x1[prev] < x0)
+                prev++;
+            for (int r = prev; r < prev_end && runs->x0[r] <= x - 1; r++)
+                quad_union(runs->parent, r, n);
+            n++;
+        }
+        prev = start;
+        prev_end = n;
+    }
+    assert(n == nruns);
+
+    for (int r = 0; r < nruns; r++)
+        runs->parent[r] = quad_find(runs->parent, r);
+}
+
+struct quad_candidate {
+    uint32_t root;
+    int npixels;
+    int first, count; // its points, in the sorted point array
+};
+
+static int quad_candidate_compare(const void* a, const void* b)
+{
+    const struct quad_candidate* ca = (const struct quad_candidate*)a;
+    const struct quad_candidate* cb = (const struct quad_candidate*)b;
+    if (ca->npixels != cb->npixels)
+        return ca->npixels > cb->npixels ? -1 : 1;
+    return ca->root < cb->root ? -1 : ca->root > cb->root;
+}
+
+// sorts 'n' candidates largest first with a bottom-up merge sort whose
+// scratch comes from 'ws': qsort() may take its scratch from the heap.
+static void quad_sort_candidates(struct quad_candidate* cands, int n, workspace_t* ws)
+{
+    struct quad_candidate* tmp = (struct quad_candidate*)workspace_alloc(ws, (n + 1) * sizeof(*cands));
+    struct quad_candidate *src = cands, *dst = tmp;
+
+    for (int width = 1; width < n; width *= 2) {
+        for (int lo = 0; lo < n; lo += 2 * width) {
+            int mid = lo + width < n ? lo + width : n;
+            int hi = lo + 2 * width < n ? lo + 2 * width : n;
+            int i = lo, j = mid, k = lo;
+            while (i < mid && j < hi)
+                dst[k++] = quad_candidate_compare(&src[j], &src[i]) < 0 ? src[j++] : src[i++];
+            while (i < mid)
+                dst[k++] = src[i++];
+            while (j < hi)
+                dst[k++] = src[j++];
+        }
+        struct quad_candidate* t = src;
+        src = dst;
+        dst = t;
+    }
+
+    if (src != cands)
+        memcpy(cands, src, n * sizeof(*cands));
+}
+
+static int64_t quad_cross(const int32_t* o, const int32_t* a, const int32_t* b)
+{
+    return (int64_t)(a[0] - o[0]) * (b[1] - o[1]) - (int64_t)(a[1] - o[1]) * (b[0] - o[0]);
+}
+
+// the convex hull of 'n' points, sorted by y then x, written to 'hull' in
+// order around it. Returns the number of hull points.
+static int quad_hull(const int32_t (*pts)[2], int n, int32_t (*hull)[2])
+{
+    if (n < 3) {
+        memcpy(hull, pts, n * sizeof(*pts));
+        return n;
+    }
+
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        while (k >= 2 && quad_cross(hull[k - 2], hull[k - 1], pts[i]) <= 0)
+            k--;
+        memcpy(hull[k++], pts[i], sizeof(*pts));
+    }
+    for (int i = n - 2, lower = k + 1; i >= 0; i--) {
+        while (k >= lower && quad_cross(hull[k - 2], hull[k - 1], pts[i]) <= 0)
+            k--;
+        memcpy(hull[k++], pts[i], sizeof(*pts));
+    }
+
+    return k - 1;
+}
+
+static double quad_area(const double (*p)[2], int n)
+{
+    double a = 0;
+    for (int i = 0; i < n; i++) {
+        const double* q = p[(i + 1) % n];
+        a += p[i][0] * q[1] - q[0] * p[i][1];
+    }
+    return a / 2;
+}
+
+// the hull point farthest from 'from'.
+static int quad_farthest(const int32_t (*hull)[2], int n, const int32_t* from)
+{
+    int best = 0;
+    int64_t dbest = -1;
+    for (int i = 0; i < n; i++) {
+        int64_t dx = hull[i][0] - from[0], dy = hull[i][1] - from[1];
+        if (dx * dx + dy * dy > dbest) {
+            dbest = dx * dx + dy * dy;
+            best = i;
+        }
+    }
+    return best;
+}
+
+// the hull points farthest from the line a-b on either side of it.
+static void quad_farthest_sides(const int32_t (*hull)[2], int n, int a, int b, int* left, int* right)
+{
+    int64_t lbest = 0, rbest = 0;
+    *left = *right = -1;
+    for (int i = 0; i < n; i++) {
+        int64_t c = quad_cross(hull[a], hull[b], hull[i]);
+        if (c > lbest) {
+            lbest = c;
+            *left = i;
+        }
+        if (-c > rbest) {
+            rbest = -c;
+            *right = i;
+        }
+    }
+}
+
+// the largest quad on the hull: the two ends of (about) its diameter, and
+// the points farthest from the diagonal between them on either side, then
+// the same again across the other diagonal. Returns -1 if the hull is not
+// quad-shaped.
+static int quad_from_hull(const int32_t (*hull)[2], int n, double p[4][2])
+{
+    if (n < 4)
+        return -1;
+
+    int a = quad_farthest(hull, n, hull[0]);
+    int b = quad_farthest(hull, n, hull[a]);
+    int l, r;
+    quad_farthest_sides(hull, n, a, b, &l, &r);
+    if (l < 0 || r < 0)
+        return -1;
+    quad_farthest_sides(hull, n, l, r, &a, &b);
+    if (a < 0 || b < 0)
+        return -1;
+
+    int idx[4] = { b, l, a, r };
+    for (int i = 0; i < 4; i++) {
+        p[i][0] = hull[idx[i]][0];
+        p[i][1] = hull[idx[i]][1];
+    }
+
+    double hull_area = 0;
+    for (int i = 0; i < n; i++) {
+        const int32_t* q = hull[(i + 1) % n];
+        hull_area += (double)hull[i][0] * q[1] - (double)q[0] * hull[i][1];
+    }
+    hull_area = fabs(hull_area) / 2;
+
+    double area = quad_area(p, 4);
+    if (area < 0) {
+        // make the corners go clockwise on screen (positive area with y
+        // pointing down).
+        double t[2] = { p[1][0], p[1][1] };
+        memcpy(p[1], p[3], sizeof(t));
+        memcpy(p[3], t, sizeof(t));
+        area = -area;
+    }
+    if (area < QUAD_MIN_FILL * hull_area)
+        return -1;
+
+    // every corner between about 35 and 145 degrees.
+    for (int i = 0; i < 4; i++) {
+        const double* p0 = p[(i + 3) % 4];
+        const double* p1 = p[i];
+        const double* p2 = p[(i + 1) % 4];
+        double ax = p0[0] - p1[0], ay = p0[1] - p1[1];
+        double bx = p2[0] - p1[0], by = p2[1] - p1[1];
+        double la = sqrt(ax * ax + ay * ay), lb = sqrt(bx * bx + by * by);
+        if (la == 0 || lb == 0 || fabs(ax * bx + ay * by) > 0.82 * la * lb)
+            return -1;
+    }
+
+    return 0;
+}
+
+// turns the corners so that p[0] is the one nearest the image's top-left
+// (the least x + y), keeping them clockwise. The code is read from p[0], so
+// the rotation its decode reports is relative to the image, as it is for a
+// whole-frame tag, rather than to whichever corner the hull search found.
+static void quad_orient(double p[4][2])
+{
+    int first = 0;
+    for (int i = 1; i < 4; i++) {
+        if (p[i][0] + p[i][1] < p[first][0] + p[first][1])
+            first = i;
+    }
+
+    double q[4][2];
+    for (int i = 0; i < 4; i++) {
+        q[i][0] = p[(first + i) % 4][0];
+        q[i][1] = p[(first + i) % 4][1];
+    }
+    memcpy(p, q, sizeof(q));
+}
+
+// bilinear interpolation of 'im' at (x, y), with pixel centers at integer
+// coordinates. Returns -1 outside the image.
+static inline double quad_pixel(const image_u8_t* im, double x, double y)
+{
+    if (!(x >= 0 && y >= 0 && x < im->width - 1 && y < im->height - 1))
+        return -1;
+
+    int ix = (int)x, iy = (int)y;
+    double fx = x - ix, fy = y - iy;
+    const uint8_t* p = &im->buf[(int64_t)iy * im->stride + ix];
+    double top = p[0] + fx * (p[1] - p[0]);
+    double bottom = p[im->stride] + fx * (p[im->stride + 1] - p[im->stride]);
+    return top + fy * (bottom - top);
+}
+
+// moves each side of the quad to the strongest black-to-white edge within
+// 'range' pixels of it, and the corners to where the sides meet. The quad
+// is left as it is if a side has no edge.
+static void quad_refine(const image_u8_t* im, double p[4][2], double range)
+{
+    if (range > (QUAD_MAX_PROFILE - 3) / 4)
+        range = (QUAD_MAX_PROFILE - 3) / 4;
+
+    double line[4][4]; // a point on each side and its direction
+
+    for (int i = 0; i < 4; i++) {
+        const double* a = p[i];
+        const double* b = p[(i + 1) % 4];
+        double dx = b[0] - a[0], dy = b[1] - a[1];
+        double len = sqrt(dx * dx + dy * dy);
+        double nx = dy / len, ny = -dx / len; // outward
+
+        int nsamples = (int)(len / 2);
+        nsamples = nsamples < 4 ? 4 : nsamples > 32 ? 32 : nsamples;
+
+        double sw = 0, sx = 0, sy = 0, sxx = 0, sxy = 0, syy = 0;
+        for (int k = 0; k < nsamples; k++) {
+            // stay clear of the corners, where the edges bend.
+            double t = 0.15 + 0.7 * (k + 0.5) / nsamples;
+            double x = a[0] + t * dx, y = a[1] + t * dy;
+
+            // the profile across the edge every half pixel, and the edge
+            // where it rises most over a pixel, interpolated between
+            // samples.
+            double profile[QUAD_MAX_PROFILE];
+            int nprofile = (int)(4 * range) + 3, inside = 1;
+            for (int j = 0; j < nprofile && inside; j++) {
+                double o = -range - 0.5 + 0.5 * j;
+                profile[j] = quad_pixel(im, x + nx * o, y + ny * o);
+                inside = profile[j] >= 0;
+            }
+            if (!inside)
+                continue;
+
+            int peak = -1;
+            double best = 0;
+            for (int j = 1; j + 1 < nprofile - 1; j++) {
+                if (profile[j + 1] - profile[j - 1] > best) {
+                    best = profile[j + 1] - profile[j - 1];
+                    peak = j;
+                }
+            }
+            if (peak < 0)
+                continue;
+
+            double best_s = -range - 0.5 + 0.5 * peak;
+            if (peak > 1 && peak + 2 < nprofile) {
+                double gm = profile[peak] - profile[peak - 2], gp = profile[peak + 2] - profile[peak];
+                double den = gm - 2 * best + gp;
+                if (den < 0)
+                    best_s += 0.25 * (gm - gp) / den;
+            }
+
+            double ex = x + nx * best_s, ey = y + ny * best_s;
+            sw += best;
+            sx += best * ex;
+            sy += best * ey;
+            sxx += best * ex * ex;
+            sxy += best * ex * ey;
+            syy += best * ey * ey;
+        }
+        if (sw == 0)
+            return;
+
+        // the weighted least-squares line: through the centroid, along the
+        // principal axis of the points.
+        double mx = sx / sw, my = sy / sw;
+        double cxx = sxx / sw - mx * mx, cxy = sxy / sw - mx * my, cyy = syy / sw - my * my;
+        double theta = 0.5 * atan2(2 * cxy, cxx - cyy);
+        line[i][0] = mx;
+        line[i][1] = my;
+        line[i][2] = cos(theta);
+        line[i][3] = sin(theta);
+    }
+
+    double q[4][2];
+    for (int i = 0; i < 4; i++) {
+        const double* l0 = line[(i + 3) % 4];
+        const double* l1 = line[i];
+        // l0.p + s * l0.d = l1.p + t * l1.d
+        double det = l0[2] * l1[3] - l0[3] * l1[2];
+        if (fabs(det) < 1e-6)
+            return;
+        double s = ((l1[0] - l0[0]) * l1[3] - (l1[1] - l0[1]) * l1[2]) / det;
+        q[i][0] = l0[0] + s * l0[2];
+        q[i][1] = l0[1] + s * l0[3];
+
+        double dx = q[i][0] - p[i][0], dy = q[i][1] - p[i][1];
+        if (dx * dx + dy * dy > 4 * range * range)
+            return;
+    }
+
+    memcpy(p, q, sizeof(q));
+}
+
+// the homography that maps the unit square's corners (0, 0), (1, 0),
+// (1, 1), (0, 1) to p[0..3] (Heckbert, "Fundamentals of Texture Mapping").
+static int quad_homography(const double p[4][2], double* H)
+{
+    double dx1 = p[1][0] - p[2][0], dx2 = p[3][0] - p[2][0], dx3 = p[0][0] - p[1][0] + p[2][0] - p[3][0];
+    double dy1 = p[1][1] - p[2][1], dy2 = p[3][1] - p[2][1], dy3 = p[0][1] - p[1][1] + p[2][1] - p[3][1];
+
+    double den = dx1 * dy2 - dx2 * dy1;
+    if (fabs(den) < 1e-9)
+        return -1;
+    double g = (dx3 * dy2 - dx2 * dy3) / den;
+    double h = (dx1 * dy3 - dx3 * dy1) / den;
+
+    H[0] = p[1][0] - p[0][0] + g * p[1][0];
+    H[1] = p[3][0] - p[0][0] + h * p[3][0];
+    H[2] = p[0][0];
+    H[3] = p[1][1] - p[0][1] + g * p[1][1];
+    H[4] = p[3][1] - p[0][1] + h * p[3][1];
+    H[5] = p[0][1];
+    H[6] = g;
+    H[7] = h;
+    H[8] = 1;
+
+    return 0;
+}
+
+// the mean of 3x3 points spread over 'spread' of cell (row, col) of the
+// 7x7 grid of the black square, or -1 if any of them is outside 'im'.
+static double quad_cell(const image_u8_t* im, const double* H, int row, int col, double spread)
+{
+    double sum = 0;
+    for (int i = -1; i <= 1; i++) {
+        for (int j = -1; j <= 1; j++) {
+            double x, y;
+            quad_project(H, (col + 0.5 + j * spread / 3) / QUAD_CELLS, (row + 0.5 + i * spread / 3) / QUAD_CELLS, &x, &y);
+            double v = quad_pixel(im, x, y);
+            if (v < 0)
+                return -1;
+            sum += v;
+        }
+    }
+    return sum / 9;
+}
+
+// least-squares fit of v = a * col + b * row + c, an illumination gradient
+// over the tag. Returns -1 if the samples do not determine it.
+static int quad_gray_model(const double (*s)[3], int n, double* m)
+{
+    double A[3][4] = { { 0 } };
+    for (int k = 0; k < n; k++) {
+        double x[3] = { s[k][0], s[k][1], 1 };
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++)
+                A[i][j] += x[i] * x[j];
+            A[i][3] += x[i] * s[k][2];
+        }
+    }
+
+    // Gauss-Jordan with partial pivoting.
+    for (int c = 0; c < 3; c++) {
+        int pivot = c;
+        for (int r = c + 1; r < 3; r++) {
+            if (fabs(A[r][c]) > fabs(A[pivot][c]))
+                pivot = r;
+        }
+        if (fabs(A[pivot][c]) < 1e-9)
+            return -1;
+        for (int j = 0; j < 4; j++) {
+            double t = A[c][j];
+            A[c][j] = A[pivot][j];
+            A[pivot][j] = t;
+        }
+        for (int r = 0; r < 3; r++) {
+            if (r == c)
+                continue;
+            double f = A[r][c] / A[c][c];
+            for (int j = c; j < 4; j++)
+                A[r][j] -= f * A[c][j];
+        }
+    }
+    for (int i = 0; i < 3; i++)
+        m[i] = A[i][3] / A[i][i];
+
+    return 0;
+}
+
+// samples the data cells of 'q' against gray models of its black border and
+// white margin. Returns -1 if the margin is out of the image or the contrast
+// is too low.
+static int quad_sample(const image_u8_t* im, int min_contrast, quad_tag_t* q)
+{
+    double black[4 * (QUAD_CELLS - 1)][3], white[4 * (QUAD_CELLS + 1)][3];
+    int nblack = 0, nwhite = 0;
+
+    for (int r = -1; r <= QUAD_CELLS; r++) {
+        for (int c = -1; c <= QUAD_CELLS; c++) {
+            int ring = r == -1 || r == QUAD_CELLS || c == -1 || c == QUAD_CELLS;
+            int border = !ring && (r == 0 || r == QUAD_CELLS - 1 || c == 0 || c == QUAD_CELLS - 1);
+            if (!ring && !border)
+                continue;
+
+            // the margin is narrow in real prints; keep to the part of it
+            // next to the black square.
+            double v = quad_cell(im, q->H, r, c, ring ? 0.5 : 1.0);
+            if (v < 0)
+                continue;
+            double(*s)[3] = ring ? &white[nwhite++] : &black[nblack++];
+            (*s)[0] = c;
+            (*s)[1] = r;
+            (*s)[2] = v;
+        }
+    }
+
+    // a tag cut by the frame's edge cannot be checked against its margin.
+    double mb[3], mw[3];
+    if (nwhite < 3 * (QUAD_CELLS + 1) || nblack < 2 * (QUAD_CELLS - 1))
+        return -1;
+    if (quad_gray_model(black, nblack, mb) != 0 || quad_gray_model(white, nwhite, mw) != 0)
+        return -1;
+
+    double mid = (QUAD_CELLS - 1) / 2.0;
+    q->contrast = (int)((mw[0] - mb[0]) * mid + (mw[1] - mb[1]) * mid + mw[2] - mb[2]);
+    if (q->contrast < min_contrast)
+        return -1;
+
+    uint64_t code = 0;
+    for (int r = 1; r < QUAD_CELLS - 1; r++) {
+        for (int c = 1; c < QUAD_CELLS - 1; c++) {
+            double v = quad_cell(im, q->H, r, c, 1.0);
+            if (v < 0)
+                return -1;
+            double thresh = ((mb[0] + mw[0]) * c + (mb[1] + mw[1]) * r + mb[2] + mw[2]) / 2;
+            code = (code << 1) | (v > thresh);
+        }
+    }
+    q->code = code;
+
+    return 0;
+}
+
+int quad_detect(const image_u8_t* im, const quad_config_t* config, workspace_t* ws, quad_tag_t* quads, int max, quad_stats_t* stats)
+{
+    quad_stats_t st;
+    memset(&st, 0, sizeof(st));
+    int d = config->decimate > 1 ? config->decimate : 1;
+
+    // threshold
+    int64_t t0 = quad_utime_now();
+    image_u8_t small = d > 1 ? quad_decimate(im, d, ws) : *im;
+    int width = small.width, height = small.height;
+    uint8_t* bin = (uint8_t*)workspace_alloc(ws, (size_t)width * height);
+    threshold_config_t tc = { config->tile_size, config->min_contrast, 0, config->pool };
+    threshold_image(&small, &tc, ws, bin, width);
+
+    // components
+    int64_t t1 = quad_utime_now();
+    struct quad_runs runs;
+    quad_components(bin, width, height, ws, &runs);
+
+    int* npixels = (int*)workspace_calloc(ws, (runs.nruns + 1) * sizeof(int));
+    int* nrunsof = (int*)workspace_calloc(ws, (runs.nruns + 1) * sizeof(int));
+    int32_t(*box)[4] = (int32_t(*)[4])workspace_alloc(ws, (runs.nruns + 1) * sizeof(*box));
+    for (int r = 0; r < runs.nruns; r++) {
+        uint32_t root = runs.parent[r];
+        if (root == (uint32_t)r) {
+            st.ncomponents++;
+            box[root][0] = box[root][1] = runs.x0[r];
+            box[root][2] = box[root][3] = runs.y[r];
+        }
+        npixels[root] += runs.x1[r] - runs.x0[r] + 1;
+        nrunsof[root]++;
+        box[root][0] = runs.x0[r] < box[root][0] ? runs.x0[r] : box[root][0];
+        box[root][1] = runs.x1[r] > box[root][1] ? runs.x1[r] : box[root][1];
+        box[root][3] = runs.y[r];
+    }
+
+    // candidates are large enough and clear of the frame's edge, which
+    // would cut off the white margin.
+    int min_side = config->min_side / d > 2 ? config->min_side / d : 2;
+    struct quad_candidate* cands = (struct quad_candidate*)workspace_alloc(ws, (st.ncomponents + 1) * sizeof(*cands));
+    int* cand_of = nrunsof; // reused: run root -> candidate index + 1
+    int npoints = 0;
+    for (int r = 0; r < runs.nruns; r++) {
+        if (runs.parent[r] != (uint32_t)r)
+            continue;
+        const int32_t* b = box[r];
+        int n = nrunsof[r];
+        nrunsof[r] = 0;
+        if (b[1] - b[0] + 1 < min_side || b[3] - b[2] + 1 < min_side || b[0] == 0 || b[2] == 0 || b[1] == width - 1 || b[3] == height - 1)
+            continue;
+
+        struct quad_candidate* c = &cands[st.ncandidates++];
+        c->root = r;
+        c->npixels = npixels[r];
+        c->first = npoints;
+        c->count = 0;
+        npoints += 2 * n;
+        cand_of[r] = st.ncandidates;
+    }
+
+    // the end points of every candidate's runs, grouped by candidate and in
+    // raster order within each.
+    int32_t(*pts)[2] = (int32_t(*)[2])workspace_alloc(ws, (npoints + 1) * sizeof(*pts));
+    for (int r = 0; r < runs.nruns; r++) {
+        int k = cand_of[runs.parent[r]];
+        if (k == 0)
+            continue;
+        struct quad_candidate* c = &cands[k - 1];
+        int32_t* p = pts[c->first + c->count++];
+        p[0] = runs.x0[r];
+        p[1] = runs.y[r];
+        p = pts[c->first + c->count++];
+        p[0] = runs.x1[r];
+        p[1] = runs.y[r];
+    }
+    quad_sort_candidates(cands, st.ncandidates, ws);
+
+    // fit
+    int64_t t2 = quad_utime_now();
+    quad_tag_t* fitted = (quad_tag_t*)workspace_alloc(ws, (st.ncandidates + 1) * sizeof(quad_tag_t));
+    int32_t(*hull)[2] = (int32_t(*)[2])workspace_alloc(ws, (npoints + 1) * sizeof(*hull));
+    int nfitted = 0;
+    for (int i = 0; i < st.ncandidates; i++) {
+        if (config->budget[QUAD_STAGE_FIT] > 0 && quad_utime_now() - t2 > config->budget[QUAD_STAGE_FIT]) {
+            st.over_budget |= 1 << QUAD_STAGE_FIT;
+            st.ndropped += st.ncandidates - i;
+            break;
+        }
+
+        const struct quad_candidate* c = &cands[i];
+        int n = quad_hull(&pts[c->first], c->count, hull);
+        quad_tag_t* q = &fitted[nfitted];
+        if (quad_from_hull(hull, n, q->p) != 0)
+            continue;
+
+        // back to full resolution: pixel centers of the decimated image sit
+        // in the middle of their blocks.
+        for (int k = 0; k < 4; k++) {
+            q->p[k][0] = q->p[k][0] * d + (d - 1) / 2.0;
+            q->p[k][1] = q->p[k][1] * d + (d - 1) / 2.0;
+        }
+        quad_refine(im, q->p, d + 1.0);
+        quad_orient(q->p);
+        nfitted++;
+    }
+
+    // sample
+    int64_t t3 = quad_utime_now();
+    int nquads = 0;
+    for (int i = 0; i < nfitted && nquads < max; i++) {
+        if (config->budget[QUAD_STAGE_SAMPLE] > 0 && quad_utime_now() - t3 > config->budget[QUAD_STAGE_SAMPLE]) {
+            st.over_budget |= 1 << QUAD_STAGE_SAMPLE;
+            st.ndropped += nfitted - i;
+            break;
+        }
+
+        quad_tag_t* q = &fitted[i];
+        if (quad_homography(q->p, q->H) != 0 || quad_sample(im, config->min_contrast, q) != 0)
+            continue;
+        quad_project(q->H, 0.5, 0.5, &q->center[0], &q->center[1]);
+        quads[nquads++] = *q;
+    }
+    int64_t t4 = quad_utime_now();
+
+    st.time[QUAD_STAGE_THRESHOLD] = t1 - t0;
+    st.time[QUAD_STAGE_COMPONENTS] = t2 - t1;
+    st.time[QUAD_STAGE_FIT] = t3 - t2;
+    st.time[QUAD_STAGE_SAMPLE] = t4 - t3;
+    for (int s = QUAD_STAGE_THRESHOLD; s <= QUAD_STAGE_COMPONENTS; s++) {
+        if (config->budget[s] > 0 && st.time[s] > config->budget[s])
+            st.over_budget |= 1 << s;
+    }
+    st.nquads = nquads;
+
+    // a caller that does not look at the stats still hears about a cut.
+    if (stats)
+        *stats = st;
+    else if (st.ndropped > 0)
+        fprintf(stderr, "quad_detect: over budget, %d of %d candidates dropped\n", st.ndropped, st.ncandidates);
+
+    return nquads;
+}
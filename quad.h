@@ -0,0 +1,122 @@
+#ifndef _QUAD_H
+#define _QUAD_H
+
+#include <stdint.h>
+
+#include "image_u8.h"
+#include "pool.h"
+#include "workspace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Finds tags anywhere in a frame, at any position, rotation and
+ * perspective, in four stages:
+ *
+ *   threshold   adaptive binarization with threshold_image(): each pixel
+ *               is compared with the midpoint of the darkest and brightest
+ *               pixels around it, over tiles of tile_size pixels; tiles
+ *               with too little contrast are left undecided.
+ *   components  black runs of each row are joined to the overlapping runs
+ *               of the row above with union-find; every component large
+ *               enough to be a tag's black square is a candidate.
+ *   fit         the quad with the largest area inside the convex hull of a
+ *               candidate's runs, with its sides then refined to the
+ *               strongest edge of the full-resolution image.
+ *   sample      the 5x5 data cells are sampled through the homography from
+ *               tag to image, and compared against the black border and the
+ *               white margin around the quad.
+ *
+ * The threshold and components stages work on every pixel, so their cost
+ * is set through 'decimate', which runs them at 1/decimate resolution.
+ * The fit and sample stages work per candidate, largest first. They have
+ * no time limit unless the caller sets budgets (quad_config_budget()); then
+ * they stop when their budget is spent, so a cluttered frame costs bounded
+ * time and loses only its smallest candidates, at the price of results
+ * that depend on the machine's load. quad_stats_t reports each stage's
+ * time, which stages ran out and how many candidates they dropped.
+ *
+ * Everything is allocated from the workspace, so frames of the same size
+ * allocate nothing from the heap once it has grown.
+ */
+
+enum {
+    QUAD_STAGE_THRESHOLD,
+    QUAD_STAGE_COMPONENTS,
+    QUAD_STAGE_FIT,
+    QUAD_STAGE_SAMPLE,
+    QUAD_NSTAGES,
+};
+
+typedef struct {
+    int decimate; // threshold and components at 1/decimate resolution, 1 or more
+    int tile_size; // adaptive threshold tile, in (decimated) pixels
+    int min_contrast; // least difference between white and black
+    int min_side; // shortest side of a tag's black square, in pixels
+    int64_t budget[QUAD_NSTAGES]; // per stage, in microseconds; 0 for none, the default
+    pool_t* pool; // runs the threshold stage in bands; NULL for none
+} quad_config_t;
+
+/**
+ * The defaults, without time budgets, so the result depends only on the
+ * frame.
+ */
+void quad_config_init(quad_config_t* config);
+
+/**
+ * Sets stage budgets sized for 1080p at 60 frames per second: the whole
+ * frame in about 16 ms of one core, leaving the other cores for other
+ * frames. For callers that need a bound on latency more than every tag,
+ * such as live streams.
+ */
+void quad_config_budget(quad_config_t* config);
+
+typedef struct {
+    // the corners of the tag's black square, in image pixels, going
+    // clockwise on screen from the one nearest the image's top-left; the
+    // code's first row runs from p[0] to p[1].
+    double p[4][2];
+    double center[2];
+
+    // maps tag coordinates to the image: (u, v) in [0, 1]^2 spans the black
+    // square, with (0, 0) at p[0], (1, 0) at p[1] and (0, 1) at p[3].
+    double H[9];
+
+    uint64_t code; // the 5x5 data cells, MSB first, 1 for white
+    int contrast; // white minus black level
+} quad_tag_t;
+
+typedef struct {
+    int64_t time[QUAD_NSTAGES]; // microseconds spent in each stage
+    int over_budget; // bit s is set if stage s ran out of time
+    int ndropped; // candidates skipped because a stage ran out of time
+    int ncomponents; // connected black components
+    int ncandidates; // of which large enough to fit
+    int nquads; // quads sampled
+} quad_stats_t;
+
+/**
+ * Finds up to 'max' quads in 'im' and writes them to 'quads'. Returns the
+ * number found. Candidates dropped for being over budget are counted in
+ * 'stats', or if it is NULL, reported on stderr. The codes still have to be looked up in the tag family
+ * (quick_decode_codeword()), which rejects the quads that are not tags.
+ */
+int quad_detect(const image_u8_t* im, const quad_config_t* config, workspace_t* ws, quad_tag_t* quads, int max, quad_stats_t* stats);
+
+/**
+ * Maps tag coordinates (u, v) through H to image coordinates (x, y).
+ */
+static inline void quad_project(const double* H, double u, double v, double* x, double* y)
+{
+    double w = H[6] * u + H[7] * v + H[8];
+    *x = (H[0] * u + H[1] * v + H[2]) / w;
+    *y = (H[3] * u + H[4] * v + H[5]) / w;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
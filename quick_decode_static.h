@@ -0,0 +1,76 @@
+#ifndef _QUICK_DECODE_STATIC_H
+#define _QUICK_DECODE_STATIC_H
+
+/**
+ * Compile-time generated quick_decode tables for built-in tag families.
+ *
+ * The tables are built by the same qd_table_fill() code quick_decode_init_ex()
+ * runs, but evaluated by the compiler, so they end up as read-only data: no
+ * init time and no heap at run time. C++ only.
+ *
+ *   QUICK_DECODE_STATIC(tag25h9_qd2, tag25h9_codes, 5, 2, QUICK_DECODE_ROTATIONS);
+ *   family->impl = (void*)&tag25h9_qd2;
+ */
+
+#include "april.h"
+
+template <uint32_t LOGSIZE>
+struct quick_decode_table {
+    uint32_t maxprobe;
+    uint64_t entries[1u << LOGSIZE];
+};
+
+template <uint32_t LOGSIZE, uint32_t NCODES>
+constexpr quick_decode_table<LOGSIZE> quick_decode_table_build(const uint64_t (&codes)[NCODES], uint32_t d, int maxhamming, int flags)
+{
+    quick_decode_table<LOGSIZE> table {};
+    struct quick_decode qd {};
+
+    qd.nentries = 1u << LOGSIZE;
+    qd.shift = 64 - LOGSIZE;
+    qd.rotations = (flags & QUICK_DECODE_ROTATIONS) != 0;
+    qd.maxhamming = maxhamming;
+    rotate90_lut_init(&qd.rot, d);
+
+    for (uint32_t i = 0; i < qd.nentries; i++)
+        table.entries[i] = QD_EMPTY;
+
+    qd_table_fill(&qd, table.entries, codes, 0, NCODES);
+    table.maxprobe = qd.maxprobe;
+
+    return table;
+}
+
+template <uint32_t LOGSIZE>
+constexpr struct quick_decode quick_decode_static(const quick_decode_table<LOGSIZE>& table, uint32_t d, int maxhamming, int flags)
+{
+    struct quick_decode qd {};
+
+    qd.nentries = 1u << LOGSIZE;
+    qd.shift = 64 - LOGSIZE;
+    qd.maxprobe = table.maxprobe;
+    qd.entries = table.entries;
+    qd.rotations = (flags & QUICK_DECODE_ROTATIONS) != 0;
+    qd.maxhamming = maxhamming;
+    qd.builtin = 1;
+    rotate90_lut_init(&qd.rot, d);
+
+    return qd;
+}
+
+#define QUICK_DECODE_STATIC_LOGSIZE(codes, d, maxhamming, flags) \
+    qd_table_logsize(sizeof(codes) / sizeof((codes)[0]), (d) * (d), (maxhamming), ((flags) & QUICK_DECODE_ROTATIONS) != 0)
+
+/**
+ * Defines 'name' as a static, read-only struct quick_decode for the family
+ * whose codes are the constexpr array 'codes', equivalent to what
+ * quick_decode_init_ex(family, maxhamming, flags) would build at run time.
+ * maxhamming may be at most 3, though 3 is slow to compile.
+ */
+#define QUICK_DECODE_STATIC(name, codes, d, maxhamming, flags)                                          \
+    static constexpr quick_decode_table<QUICK_DECODE_STATIC_LOGSIZE(codes, d, maxhamming, flags)>       \
+        name##_table = quick_decode_table_build<QUICK_DECODE_STATIC_LOGSIZE(codes, d, maxhamming, flags)>( \
+            codes, d, maxhamming, flags);                                                               \
+    static constexpr struct quick_decode name = quick_decode_static(name##_table, d, maxhamming, flags)
+
+#endif
@@ -0,0 +1,677 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "stream.h"
+
+#define STREAM_BUF_SIZE (64 << 10)
+
+// a Y4M or raw Y8 stream read through a small buffer, so frame headers do
+// not cost a system call per byte.
+struct stream_fd {
+    int fd;
+    int y4m;
+    size_t luma, chroma; // bytes per frame
+    size_t pos, len;
+    uint8_t buf[STREAM_BUF_SIZE];
+};
+
+static int stream_fd_fill(struct stream_fd* f)
+{
+    ssize_t n;
+    do
+        n = read(f->fd, f->buf, sizeof(f->buf));
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return -1;
+    f->pos = 0;
+    f->len = n;
+    return 0;
+}
+
+static int stream_fd_getc(struct stream_fd* f)
+{
+    if (f->pos == f->len && stream_fd_fill(f) != 0)
+        return -1;
+    return f->buf[f->pos++];
+}
+
+// reads 'n' bytes into 'dst', or skips them if dst is NULL. Large reads
+// bypass the buffer.
+static int stream_fd_read(struct stream_fd* f, uint8_t* dst, size_t n)
+{
+    while (n > 0) {
+        if (f->pos == f->len) {
+            if (dst && n >= sizeof(f->buf)) {
+                ssize_t r = read(f->fd, dst, n);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                    return -1;
+                dst += r;
+                n -= r;
+                continue;
+            }
+            if (stream_fd_fill(f) != 0)
+                return -1;
+        }
+
+        size_t k = f->len - f->pos < n ? f->len - f->pos : n;
+        if (dst) {
+            memcpy(dst, &f->buf[f->pos], k);
+            dst += k;
+        }
+        f->pos += k;
+        n -= k;
+    }
+
+    return 0;
+}
+
+// reads the rest of a header line into 'line'. Returns -1 at the end of
+// the stream or if the line is too long.
+static int stream_fd_line(struct stream_fd* f, char* line, size_t size)
+{
+    size_t i = 0;
+    for (;;) {
+        int c = stream_fd_getc(f);
+        if (c < 0 || i + 1 == size)
+            return -1;
+        if (c == '\n')
+            break;
+        line[i++] = c;
+    }
+    line[i] = 0;
+    return 0;
+}
+
+static int stream_fd_next(void* src, uint8_t* buf)
+{
+    struct stream_fd* f = (struct stream_fd*)src;
+
+    if (f->y4m) {
+        char line[256];
+        if (stream_fd_line(f, line, sizeof(line)) != 0 || strncmp(line, "FRAME", 5) != 0)
+            return -1;
+    }
+
+    if (stream_fd_read(f, buf, f->luma) != 0)
+        return -1;
+    return stream_fd_read(f, NULL, f->chroma);
+}
+
+static void stream_fd_close(void* src)
+{
+    struct stream_fd* f = (struct stream_fd*)src;
+    if (f->fd != STDIN_FILENO)
+        close(f->fd);
+    free(f);
+}
+
+// parses the Y4M stream header after the "YUV4MPEG2" magic.
+static int stream_parse_y4m(stream_source_t* s, struct stream_fd* f, const char* params)
+{
+    char colorspace[32] = "420";
+
+    for (const char* p = params; *p; p++) {
+        if (p[-1] != ' ')
+            continue;
+        if (*p == 'W')
+            s->width = atoi(p + 1);
+        else if (*p == 'H')
+            s->height = atoi(p + 1);
+        else if (*p == 'F')
+            sscanf(p + 1, "%d:%d", &s->fps_num, &s->fps_den);
+        else if (*p == 'C')
+            sscanf(p + 1, "%31s", colorspace);
+    }
+
+    if (s->width <= 0 || s->height <= 0)
+        return -1;
+
+    size_t w = s->width, h = s->height;
+    size_t cw = (w + 1) / 2, ch = (h + 1) / 2;
+    f->luma = w * h;
+
+    // high bit depth colorspaces ("420p10", "mono16", ...) are not supported.
+    if (!strcmp(colorspace, "420") || !strcmp(colorspace, "420jpeg") || !strcmp(colorspace, "420paldv")
+        || !strcmp(colorspace, "420mpeg2"))
+        f->chroma = 2 * cw * ch;
+    else if (!strcmp(colorspace, "422"))
+        f->chroma = 2 * cw * h;
+    else if (!strcmp(colorspace, "444"))
+        f->chroma = 2 * w * h;
+    else if (!strcmp(colorspace, "444alpha"))
+        f->chroma = 3 * w * h;
+    else if (!strcmp(colorspace, "mono"))
+        f->chroma = 0;
+    else
+        return -1;
+
+    return 0;
+}
+
+int stream_open(stream_source_t* s, const char* path, int raw_width, int raw_height)
+{
+    memset(s, 0, sizeof(*s));
+
+    struct stream_fd* f = (struct stream_fd*)calloc(1, sizeof(struct stream_fd));
+    f->fd = !strcmp(path, "-") ? STDIN_FILENO : open(path, O_RDONLY);
+    if (f->fd < 0) {
+        free(f);
+        return -1;
+    }
+
+    s->read = stream_fd_next;
+    s->close = stream_fd_close;
+    s->src = f;
+
+    if (raw_width > 0) {
+        if (raw_height <= 0) {
+            stream_close(s);
+            return -1;
+        }
+        s->width = raw_width;
+        s->height = raw_height;
+        f->luma = (size_t)raw_width * raw_height;
+        return 0;
+    }
+
+    // the header line, with a leading space so every parameter follows one.
+    char line[256];
+    line[0] = ' ';
+    if (stream_fd_line(f, line + 1, sizeof(line) - 1) != 0 || strncmp(line + 1, "YUV4MPEG2 ", 10) != 0
+        || stream_parse_y4m(s, f, line + 10) != 0) {
+        stream_close(s);
+        return -1;
+    }
+    f->y4m = 1;
+
+    return 0;
+}
+
+void stream_close(stream_source_t* s)
+{
+    if (s->close)
+        s->close(s->src);
+    s->close = NULL;
+    s->src = NULL;
+}
+
+static int64_t stream_utime_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * The lock-free single-producer single-consumer ring. The capture thread
+ * fills slot head % capacity and publishes it by advancing head; the
+ * detection thread reads slot tail % capacity and frees it by advancing
+ * tail. Each index is written by one thread only, on its own cache line.
+ *
+ * A side that finds the ring empty (or full) spins briefly and then blocks
+ * on the condition variable, after raising its waiting flag. The other side
+ * only takes the mutex to wake it when that flag is up, so the mutex stays
+ * off the path while both sides keep up.
+ */
+struct stream_ring {
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    int eof __attribute__((aligned(64)));
+    int producer_waiting, consumer_waiting;
+    uint64_t ndropped; // written by the producer
+
+    uint32_t capacity;
+    int policy;
+    stream_frame_t* frames;
+    uint8_t* pixels;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static int stream_ring_readable(struct stream_ring* r)
+{
+    return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != r->tail || __atomic_load_n(&r->eof, __ATOMIC_SEQ_CST);
+}
+
+static int stream_ring_writable(struct stream_ring* r)
+{
+    return r->head - __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) < r->capacity;
+}
+
+// waits until ready(r). 'waiting' is the caller's flag.
+static void stream_ring_wait(struct stream_ring* r, int* waiting, int (*ready)(struct stream_ring*))
+{
+    for (int spins = 0; !ready(r); spins++) {
+        if (spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+            continue;
+        }
+        if (spins < 128) {
+            sched_yield();
+            continue;
+        }
+
+        // the flag is raised before ready() is checked again, and the
+        // other side publishes before it checks the flag, so one of the two
+        // always sees the other.
+        pthread_mutex_lock(&r->mutex);
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+        while (!ready(r))
+            pthread_cond_wait(&r->cond, &r->mutex);
+        __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&r->mutex);
+        break;
+    }
+}
+
+// wakes the other side if it is blocked in stream_ring_wait().
+static void stream_ring_wake(struct stream_ring* r, int* waiting)
+{
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&r->mutex);
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->mutex);
+    }
+}
+
+static void stream_ring_destroy(struct stream_ring* r)
+{
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->mutex);
+    free(r->frames);
+    free(r->pixels);
+}
+
+// returns -1 if the frames cannot be allocated.
+static int stream_ring_init(struct stream_ring* r, const stream_source_t* s, const stream_config_t* config)
+{
+    memset(r, 0, sizeof(*r));
+    r->capacity = config->capacity >= 2 ? config->capacity : 2;
+    r->policy = config->policy;
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    size_t frame_size = (size_t)s->width * s->height;
+    r->pixels = (uint8_t*)malloc(r->capacity * frame_size);
+    r->frames = (stream_frame_t*)calloc(r->capacity, sizeof(stream_frame_t));
+    if (!r->pixels || !r->frames) {
+        stream_ring_destroy(r);
+        return -1;
+    }
+    for (uint32_t i = 0; i < r->capacity; i++)
+        r->frames[i].im = image_u8_view(s->width, s->height, s->width, &r->pixels[i * frame_size]);
+    return 0;
+}
+
+// the frame at the tail, after skipping to the newest one under
+// STREAM_LATEST, or NULL if the ring is empty. Called by the consumer.
+static const stream_frame_t* stream_ring_take(struct stream_ring* r, stream_stats_t* st)
+{
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (head == r->tail)
+        return NULL;
+
+    // free the older frames.
+    if (r->policy == STREAM_LATEST && head - r->tail > 1) {
+        st->ndropped += head - 1 - r->tail;
+        __atomic_store_n(&r->tail, head - 1, __ATOMIC_SEQ_CST);
+        stream_ring_wake(r, &r->producer_waiting);
+    }
+
+    return &r->frames[r->tail % r->capacity];
+}
+
+// frees the frame returned by stream_ring_take().
+static void stream_ring_release(struct stream_ring* r)
+{
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_SEQ_CST);
+    stream_ring_wake(r, &r->producer_waiting);
+}
+
+struct stream_capture {
+    stream_source_t* s;
+    struct stream_ring* ring;
+    uint8_t* scratch; // where dropped frames are read to
+    uint64_t ncaptured;
+
+    // called after every frame and at the end of the stream, if set.
+    void (*notify)(void* arg);
+    void* notify_arg;
+};
+
+static void* stream_capture_thread(void* p)
+{
+    struct stream_capture* c = (struct stream_capture*)p;
+    struct stream_ring* r = c->ring;
+    stream_source_t* s = c->s;
+
+    for (;;) {
+        if (!stream_ring_writable(r)) {
+            if (r->policy == STREAM_PROCESS_ALL) {
+                stream_ring_wait(r, &r->producer_waiting, stream_ring_writable);
+                continue;
+            }
+
+            // keep draining the source, so the frames that are kept stay
+            // fresh.
+            if (s->read(s->src, c->scratch) != 0)
+                break;
+            c->ncaptured++;
+            __atomic_store_n(&r->ndropped, r->ndropped + 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        stream_frame_t* frame = &r->frames[r->head % r->capacity];
+        if (s->read(s->src, (uint8_t*)frame->im.buf) != 0)
+            break;
+        frame->seq = c->ncaptured++;
+        frame->capture_time = stream_utime_now();
+        frame->pts = s->fps_num > 0 ? (int64_t)(frame->seq * 1000000 * (double)s->fps_den / s->fps_num) : -1;
+
+        __atomic_store_n(&r->head, r->head + 1, __ATOMIC_SEQ_CST);
+        stream_ring_wake(r, &r->consumer_waiting);
+        if (c->notify)
+            c->notify(c->notify_arg);
+    }
+
+    __atomic_store_n(&r->eof, 1, __ATOMIC_SEQ_CST);
+    stream_ring_wake(r, &r->consumer_waiting);
+    if (c->notify)
+        c->notify(c->notify_arg);
+
+    return NULL;
+}
+
+// detects 'frame' and formats its output line, prefixed with 'prefix', into
+// 'out'.
+static void stream_process(const stream_frame_t* frame, stream_detect_t detect, void* arg, workspace_t* ws,
+    const char* prefix, char* out, size_t size, stream_stats_t* st)
+{
+    char line[512];
+    line[0] = 0;
+    int64_t t0 = stream_utime_now();
+    detect(arg, ws, frame, line, sizeof(line));
+    workspace_reset(ws);
+
+    int64_t t1 = stream_utime_now();
+    int64_t latency = t1 - frame->capture_time;
+    snprintf(out, size, "%s%llu %lld.%06lld %lld %.3f %s\n", prefix, (unsigned long long)frame->seq,
+        (long long)(frame->capture_time / 1000000), (long long)(frame->capture_time % 1000000),
+        (long long)frame->pts, latency / 1000.0, line);
+
+    st->nprocessed++;
+    st->busy += t1 - t0;
+    st->sum_latency += latency;
+    if (latency > st->max_latency)
+        st->max_latency = latency;
+}
+
+int stream_run(stream_source_t* s, const stream_config_t* config, stream_detect_t detect, void* arg, FILE* out, stream_stats_t* stats)
+{
+    struct stream_ring ring;
+    if (stream_ring_init(&ring, s, config) != 0)
+        return -1;
+
+    struct stream_capture capture = { s, &ring, NULL, 0, NULL, NULL };
+    if (ring.policy == STREAM_LATEST)
+        capture.scratch = (uint8_t*)malloc((size_t)s->width * s->height);
+
+    int64_t t0 = stream_utime_now();
+
+    pthread_t thread;
+    if ((ring.policy == STREAM_LATEST && !capture.scratch) || pthread_create(&thread, NULL, stream_capture_thread, &capture) != 0) {
+        free(capture.scratch);
+        stream_ring_destroy(&ring);
+        return -1;
+    }
+
+    stream_stats_t st;
+    memset(&st, 0, sizeof(st));
+    workspace_t* ws = workspace_create(0);
+    char line[1024];
+
+    for (;;) {
+        stream_ring_wait(&ring, &ring.consumer_waiting, stream_ring_readable);
+
+        // eof is set after the last frame is published, so an empty ring
+        // seen after eof stays empty.
+        const stream_frame_t* frame = stream_ring_take(&ring, &st);
+        if (!frame)
+            break;
+
+        stream_process(frame, detect, arg, ws, "", line, sizeof(line), &st);
+        fputs(line, out);
+        stream_ring_release(&ring);
+    }
+
+    pthread_join(thread, NULL);
+    fflush(out);
+
+    st.elapsed = stream_utime_now() - t0;
+    st.ncaptured = capture.ncaptured;
+    st.ndropped += ring.ndropped;
+    assert(st.ncaptured == st.nprocessed + st.ndropped);
+
+    workspace_destroy(ws);
+    free(capture.scratch);
+    stream_ring_destroy(&ring);
+
+    if (stats)
+        *stats = st;
+
+    return 0;
+}
+
+struct stream_many;
+
+/**
+ * One stream of stream_run_many(): its ring and capture thread, and the
+ * pool task that detects its frames. At most one task per stream is queued
+ * or running at a time, which keeps each stream's frames in order; the
+ * 'scheduled' flag hands that right between the capture thread and the
+ * task.
+ */
+struct stream_task {
+    pool_task_t task;
+    struct stream_many* m;
+    int index;
+    int scheduled;
+    struct stream_ring ring;
+    struct stream_capture capture;
+    pthread_t thread;
+    int started; // the capture thread was created
+    stream_stats_t st;
+};
+
+struct stream_many {
+    pool_t* pool;
+    // per worker, one per level of nesting: a worker waiting in pool_for()
+    // inside detect may run another stream's frame meanwhile, which must not
+    // reset the workspace of the frame it interrupted. Created on first use.
+    workspace_t** ws;
+    int nsources;
+    stream_detect_t detect;
+    void* arg;
+    FILE* out;
+
+    // guards the output and the count of finished streams.
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int nfinished;
+};
+
+static void stream_task_schedule(void* p)
+{
+    struct stream_task* t = (struct stream_task*)p;
+    if (!__atomic_exchange_n(&t->scheduled, 1, __ATOMIC_SEQ_CST))
+        pool_submit(t->m->pool, &t->task);
+}
+
+// how many frames the calling worker is detecting, the innermost included.
+static __thread int stream_depth;
+
+static void stream_task_run(pool_task_t* task, int worker)
+{
+    struct stream_task* t = (struct stream_task*)task;
+    struct stream_many* m = t->m;
+
+    // one frame per run, so streams sharing a worker take turns.
+    const stream_frame_t* frame = stream_ring_take(&t->ring, &t->st);
+    if (frame) {
+        // each stream has at most one frame in detection, so a worker nests
+        // at most nsources deep.
+        workspace_t** ws = &m->ws[worker * m->nsources + stream_depth];
+        if (!*ws)
+            *ws = workspace_create(0);
+
+        char prefix[16], line[1024];
+        snprintf(prefix, sizeof(prefix), "%d ", t->index);
+        stream_depth++;
+        stream_process(frame, m->detect, m->arg, *ws, prefix, line, sizeof(line), &t->st);
+        stream_depth--;
+        stream_ring_release(&t->ring);
+
+        pthread_mutex_lock(&m->mutex);
+        fputs(line, m->out);
+        pthread_mutex_unlock(&m->mutex);
+    } else if (__atomic_load_n(&t->ring.eof, __ATOMIC_SEQ_CST) && !stream_ring_take(&t->ring, &t->st)) {
+        // the stream has ended; 'scheduled' stays set, so the task never
+        // runs again.
+        pthread_mutex_lock(&m->mutex);
+        m->nfinished++;
+        pthread_cond_signal(&m->cond);
+        pthread_mutex_unlock(&m->mutex);
+        return;
+    }
+
+    // a frame published after the flag is cleared schedules the task from
+    // the capture thread; one published before it is seen here.
+    __atomic_store_n(&t->scheduled, 0, __ATOMIC_SEQ_CST);
+    if (stream_ring_readable(&t->ring))
+        stream_task_schedule(t);
+}
+
+int stream_run_many(stream_source_t** sources, int nsources, const stream_config_t* config, stream_detect_t detect, void* arg, FILE* out, stream_stats_t* stats)
+{
+    struct stream_many m;
+    memset(&m, 0, sizeof(m));
+    m.pool = pool_create(config->nworkers);
+    if (!m.pool)
+        return -1;
+    m.nsources = nsources;
+    m.ws = (workspace_t**)calloc((size_t)pool_size(m.pool) * nsources, sizeof(workspace_t*));
+    if (!m.ws) {
+        pool_destroy(m.pool);
+        return -1;
+    }
+    m.detect = detect;
+    m.arg = arg;
+    m.out = out;
+    pthread_mutex_init(&m.mutex, NULL);
+    pthread_cond_init(&m.cond, NULL);
+
+    // the rings have members aligned to cache lines.
+    struct stream_task* tasks = (struct stream_task*)aligned_alloc(64, nsources * sizeof(struct stream_task));
+    int ninit = 0;
+    if (tasks) {
+        memset(tasks, 0, nsources * sizeof(struct stream_task));
+        for (; ninit < nsources; ninit++) {
+            struct stream_task* t = &tasks[ninit];
+            if (stream_ring_init(&t->ring, sources[ninit], config) != 0)
+                break;
+            if (t->ring.policy == STREAM_LATEST) {
+                t->capture.scratch = (uint8_t*)malloc((size_t)sources[ninit]->width * sources[ninit]->height);
+                if (!t->capture.scratch) {
+                    stream_ring_destroy(&t->ring);
+                    break;
+                }
+            }
+        }
+    }
+
+    // nothing has started yet, so running out of memory is undone here.
+    if (ninit < nsources) {
+        for (int i = 0; i < ninit; i++) {
+            free(tasks[i].capture.scratch);
+            stream_ring_destroy(&tasks[i].ring);
+        }
+        free(tasks);
+        free(m.ws);
+        pool_destroy(m.pool);
+        pthread_cond_destroy(&m.cond);
+        pthread_mutex_destroy(&m.mutex);
+        return -1;
+    }
+
+    int64_t t0 = stream_utime_now();
+
+    // a stream whose capture thread cannot be created ends at once, with no
+    // frames, while the others run to their end.
+    int ret = 0;
+    for (int i = 0; i < nsources; i++) {
+        struct stream_task* t = &tasks[i];
+        t->task.run = stream_task_run;
+        t->m = &m;
+        t->index = i;
+        t->capture.s = sources[i];
+        t->capture.ring = &t->ring;
+        t->capture.notify = stream_task_schedule;
+        t->capture.notify_arg = t;
+        t->started = pthread_create(&t->thread, NULL, stream_capture_thread, &t->capture) == 0;
+        if (!t->started) {
+            ret = -1;
+            __atomic_store_n(&t->ring.eof, 1, __ATOMIC_SEQ_CST);
+            stream_task_schedule(t);
+        }
+    }
+
+    pthread_mutex_lock(&m.mutex);
+    while (m.nfinished < nsources)
+        pthread_cond_wait(&m.cond, &m.mutex);
+    pthread_mutex_unlock(&m.mutex);
+
+    int64_t elapsed = stream_utime_now() - t0;
+
+    for (int i = 0; i < nsources; i++) {
+        struct stream_task* t = &tasks[i];
+        if (t->started)
+            pthread_join(t->thread, NULL);
+
+        t->st.elapsed = elapsed;
+        t->st.ncaptured = t->capture.ncaptured;
+        t->st.ndropped += t->ring.ndropped;
+        assert(t->st.ncaptured == t->st.nprocessed + t->st.ndropped);
+        if (stats)
+            stats[i] = t->st;
+    }
+    fflush(out);
+
+    for (int i = 0; i < pool_size(m.pool) * nsources; i++)
+        workspace_destroy(m.ws[i]);
+    free(m.ws);
+    pool_destroy(m.pool);
+    for (int i = 0; i < nsources; i++) {
+        free(tasks[i].capture.scratch);
+        stream_ring_destroy(&tasks[i].ring);
+    }
+    free(tasks);
+    pthread_cond_destroy(&m.cond);
+    pthread_mutex_destroy(&m.mutex);
+
+    return ret;
+}
@@ -0,0 +1,128 @@
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "image_u8.h"
+#include "workspace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A source of grayscale frames of a fixed size, read one after another by
+ * the capture thread of stream_run().
+ */
+typedef struct {
+    int width, height;
+    int fps_num, fps_den; // frame rate, or 0/0 if unknown
+
+    // reads the next frame's luma plane, width x height bytes, into 'buf'.
+    // Returns 0, or -1 at the end of the stream.
+    int (*read)(void* src, uint8_t* buf);
+    void (*close)(void* src);
+    void* src;
+} stream_source_t;
+
+/**
+ * Opens a Y4M stream or, if raw_width > 0, a headerless stream of
+ * raw_width x raw_height Y8 frames. 'path' may be a file, a named pipe or
+ * "-" for stdin. Only the luma plane of Y4M frames is kept; 8-bit
+ * colorspaces (420*, 422, 444, 444alpha, mono) are supported. Returns 0, or
+ * -1 if the stream cannot be opened or has an unsupported header.
+ */
+int stream_open(stream_source_t* s, const char* path, int raw_width, int raw_height);
+
+void stream_close(stream_source_t* s);
+
+/**
+ * A captured frame. capture_time is when the capture thread finished
+ * reading it (CLOCK_MONOTONIC, microseconds); pts is its presentation time
+ * in microseconds from the stream's frame rate, or -1 if unknown.
+ */
+typedef struct {
+    uint64_t seq;
+    int64_t capture_time;
+    int64_t pts;
+    image_u8_t im;
+} stream_frame_t;
+
+/**
+ * Processes one frame: writes its result line (without the newline) to
+ * 'line' and returns 0, or -1 if the frame could not be processed. 'ws' is
+ * reset after every frame.
+ */
+typedef int (*stream_detect_t)(void* arg, workspace_t* ws, const stream_frame_t* frame, char* line, size_t size);
+
+enum {
+    STREAM_PROCESS_ALL, // capture waits for detection; nothing is dropped
+    STREAM_LATEST, // detection takes the newest frame and drops the rest
+};
+
+typedef struct {
+    int capacity; // ring slots, at least 2
+    int policy; // STREAM_PROCESS_ALL or STREAM_LATEST
+    int nworkers; // stream_run_many() detection threads, 0 for one per CPU
+} stream_config_t;
+
+typedef struct {
+    uint64_t ncaptured; // frames read from the source
+    uint64_t nprocessed; // frames detected
+    uint64_t ndropped; // frames skipped under STREAM_LATEST
+    int64_t max_latency; // capture to result, in microseconds
+    int64_t sum_latency;
+    int64_t busy; // time spent detecting, in microseconds
+    int64_t elapsed; // wall time in microseconds
+} stream_stats_t;
+
+/**
+ * Runs a capture thread that reads frames from 's' into a ring of
+ * config->capacity preallocated frames, while the calling thread detects
+ * them and writes one line per frame to 'out': sequence number, capture
+ * time, presentation time, capture-to-result latency, then the detector's
+ * line.
+ *
+ * The ring is single producer and single consumer, and lock-free unless
+ * one side has to sleep for the other. Under STREAM_PROCESS_ALL a full ring
+ * stalls the capture, so every frame is processed but latency grows up to
+ * the ring's capacity if detection falls behind. Under STREAM_LATEST the
+ * capture never waits: it keeps draining the source and drops frames while
+ * the ring is full, and detection skips to the newest frame in the ring, so
+ * the latency stays around one detection time however far behind the
+ * source it is.
+ *
+ * Returns 0, or -1 if the ring or the capture thread cannot be set up, in
+ * which case nothing is read from 's'.
+ */
+int stream_run(stream_source_t* s, const stream_config_t* config, stream_detect_t detect, void* arg, FILE* out, stream_stats_t* stats);
+
+/**
+ * Like stream_run(), for many streams at once: each stream has its own
+ * capture thread and ring, while the frames of all of them are detected by
+ * one work-stealing pool of config->nworkers threads (see pool.h), each
+ * with its own workspace. 'arg', and so any decode table it holds, is
+ * shared by all of them.
+ *
+ * A stream has at most one frame in detection at a time, so its lines come
+ * out in capture order, and a worker detects one frame of a stream before
+ * moving to the next stream with work, so streams share the workers evenly.
+ * Lines of different streams are interleaved in 'out', each prefixed with
+ * the index of its stream in 'sources'. 'stats' has one entry per stream.
+ *
+ * 'detect' runs on a pool worker, so it may split a frame's work over the
+ * same pool with pool_for(pool_current()) instead of a pool of its own.
+ * Returns 0, or -1 if the pool or the rings cannot be set up, in which case
+ * nothing is read. Also returns -1, after the other streams have ended, if
+ * a stream's capture thread cannot be created; that stream ends with no
+ * frames.
+ */
+int stream_run_many(stream_source_t** sources, int nsources, const stream_config_t* config, stream_detect_t detect, void* arg, FILE* out, stream_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
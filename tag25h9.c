@@ -37,6 +37,45 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include <string.h>
 
 #include "april.h"
+#include "quick_decode_static.h"
+
+static constexpr uint64_t tag25h9_codes[35] = {
+    0x000000000155cbf1UL,
+    0x0000000001e4d1b6UL,
+    0x00000000017b0b68UL,
+    0x0000000001eac9cdUL,
+    0x00000000012e14ceUL,
+    0x00000000003548bbUL,
+    0x00000000007757e6UL,
+    0x0000000001065dabUL,
+    0x0000000001baa2e7UL,
+    0x0000000000dea688UL,
+    0x000000000081d927UL,
+    0x000000000051b241UL,
+    0x0000000000dbc8aeUL,
+    0x0000000001e50e19UL,
+    0x00000000015819d2UL,
+    0x00000000016d8282UL,
+    0x000000000163e035UL,
+    0x00000000009d9b81UL,
+    0x000000000173eec4UL,
+    0x0000000000ae3a09UL,
+    0x00000000005f7c51UL,
+    0x0000000001a137fcUL,
+    0x0000000000dc9562UL,
+    0x0000000001802e45UL,
+    0x0000000001c3542cUL,
+    0x0000000000870fa4UL,
+    0x0000000000914709UL,
+    0x00000000016684f0UL,
+    0x0000000000c8f2a5UL,
+    0x0000000000833ebbUL,
+    0x000000000059717fUL,
+    0x00000000013cd050UL,
+    0x0000000000fa0ad1UL,
+    0x0000000001b763b0UL,
+    0x0000000000b991ceUL,
+};
 
 apriltag_family_t* tag25h9_create()
 {
@@ -47,41 +86,7 @@ apriltag_family_t* tag25h9_create()
     tf->h = 9;
     tf->ncodes = 35;
     tf->codes = (uint64_t*)calloc(35, sizeof(uint64_t));
-    tf->codes[0] = 0x000000000155cbf1UL;
-    tf->codes[1] = 0x0000000001e4d1b6UL;
-    tf->codes[2] = 0x00000000017b0b68UL;
-    tf->codes[3] = 0x0000000001eac9cdUL;
-    tf->codes[4] = 0x00000000012e14ceUL;
-    tf->codes[5] = 0x00000000003548bbUL;
-    tf->codes[6] = 0x00000000007757e6UL;
-    tf->codes[7] = 0x0000000001065dabUL;
-    tf->codes[8] = 0x0000000001baa2e7UL;
-    tf->codes[9] = 0x0000000000dea688UL;
-    tf->codes[10] = 0x000000000081d927UL;
-    tf->codes[11] = 0x000000000051b241UL;
-    tf->codes[12] = 0x0000000000dbc8aeUL;
-    tf->codes[13] = 0x0000000001e50e19UL;
-    tf->codes[14] = 0x00000000015819d2UL;
-    tf->codes[15] = 0x00000000016d8282UL;
-    tf->codes[16] = 0x000000000163e035UL;
-    tf->codes[17] = 0x00000000009d9b81UL;
-    tf->codes[18] = 0x000000000173eec4UL;
-    tf->codes[19] = 0x0000000000ae3a09UL;
-    tf->codes[20] = 0x00000000005f7c51UL;
-    tf->codes[21] = 0x0000000001a137fcUL;
-    tf->codes[22] = 0x0000000000dc9562UL;
-    tf->codes[23] = 0x0000000001802e45UL;
-    tf->codes[24] = 0x0000000001c3542cUL;
-    tf->codes[25] = 0x0000000000870fa4UL;
-    tf->codes[26] = 0x0000000000914709UL;
-    tf->codes[27] = 0x00000000016684f0UL;
-    tf->codes[28] = 0x0000000000c8f2a5UL;
-    tf->codes[29] = 0x0000000000833ebbUL;
-    tf->codes[30] = 0x000000000059717fUL;
-    tf->codes[31] = 0x00000000013cd050UL;
-    tf->codes[32] = 0x0000000000fa0ad1UL;
-    tf->codes[33] = 0x0000000001b763b0UL;
-    tf->codes[34] = 0x0000000000b991ceUL;
+    memcpy(tf->codes, tag25h9_codes, sizeof(tag25h9_codes));
     return tf;
 }
 
@@ -91,3 +96,28 @@ void tag25h9_destroy(apriltag_family_t* tf)
     free(tf->codes);
     free(tf);
 }
+
+QUICK_DECODE_STATIC(tag25h9_qd0, tag25h9_codes, 5, 0, 0);
+QUICK_DECODE_STATIC(tag25h9_qd1, tag25h9_codes, 5, 1, 0);
+QUICK_DECODE_STATIC(tag25h9_qd2, tag25h9_codes, 5, 2, 0);
+QUICK_DECODE_STATIC(tag25h9_qd0r, tag25h9_codes, 5, 0, QUICK_DECODE_ROTATIONS);
+QUICK_DECODE_STATIC(tag25h9_qd1r, tag25h9_codes, 5, 1, QUICK_DECODE_ROTATIONS);
+QUICK_DECODE_STATIC(tag25h9_qd2r, tag25h9_codes, 5, 2, QUICK_DECODE_ROTATIONS);
+
+int tag25h9_decode_init_static(apriltag_family_t* tf, int maxhamming, int flags)
+{
+    static const struct quick_decode* const tables[2][3] = {
+        { &tag25h9_qd0, &tag25h9_qd1, &tag25h9_qd2 },
+        { &tag25h9_qd0r, &tag25h9_qd1r, &tag25h9_qd2r },
+    };
+
+    assert(tf->impl == NULL);
+
+    // only tables are compiled in, and they are never files.
+    if (maxhamming < 0 || maxhamming > 2 || (flags & ~(QUICK_DECODE_TABLE | QUICK_DECODE_ROTATIONS)) != 0)
+        return -1;
+
+    // the tables are never written through impl.
+    tf->impl = (void*)tables[(flags & QUICK_DECODE_ROTATIONS) != 0][maxhamming];
+    return 0;
+}
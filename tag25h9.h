@@ -41,4 +41,13 @@ either expressed or implied, of the Regents of The University of Michigan.
 apriltag_family_t* tag25h9_create();
 void tag25h9_destroy(apriltag_family_t* tf);
 
+/**
+ * Attaches the compile-time generated decode table for 'maxhamming' (0 to 2)
+ * and 'flags' to 'tf', instead of building one with quick_decode_init_ex().
+ * The table is static read-only data; quick_decode_uninit() just detaches it.
+ * Returns -1 if no such table was compiled in, which includes any flag but
+ * QUICK_DECODE_TABLE and QUICK_DECODE_ROTATIONS.
+ */
+int tag25h9_decode_init_static(apriltag_family_t* tf, int maxhamming, int flags);
+
 #endif
@@ -0,0 +1,401 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define THRESHOLD_X86 1
+#endif
+
+#include "threshold.h"
+
+// the least pixels per band worth handing to another thread.
+#define THRESHOLD_BAND_PIXELS 65536
+
+// bands per thread, so a thread that finishes early takes another one.
+#define THRESHOLD_BANDS_PER_THREAD 4
+
+/**
+ * Row kernels. minmax_row() folds a row of 'n' pixels into per-column
+ * minima and maxima, so a tile's rows are reduced vertically at full SIMD
+ * width and only the last step across the tile's columns is scalar.
+ * binarize_row() writes 255 where p > thr and 0 elsewhere, or 127 where
+ * und is 0xff, with thr and und already expanded from tiles to columns.
+ */
+typedef void (*threshold_minmax_row_t)(const uint8_t* p, int n, uint8_t* lo, uint8_t* hi);
+typedef void (*threshold_binarize_row_t)(const uint8_t* p, const uint8_t* thr, const uint8_t* und, int n, uint8_t* out);
+
+static void threshold_minmax_row_scalar(const uint8_t* p, int n, uint8_t* lo, uint8_t* hi)
+{
+    for (int x = 0; x < n; x++) {
+        lo[x] = p[x] < lo[x] ? p[x] : lo[x];
+        hi[x] = p[x] > hi[x] ? p[x] : hi[x];
+    }
+}
+
+static void threshold_binarize_row_scalar(const uint8_t* p, const uint8_t* thr, const uint8_t* und, int n, uint8_t* out)
+{
+    for (int x = 0; x < n; x++)
+        out[x] = und[x] ? 127 : (p[x] > thr[x] ? 255 : 0);
+}
+
+#ifdef THRESHOLD_X86
+
+__attribute__((target("sse2"))) static void threshold_minmax_row_sse2(const uint8_t* p, int n, uint8_t* lo, uint8_t* hi)
+{
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&p[x]);
+        _mm_storeu_si128((__m128i*)&lo[x], _mm_min_epu8(v, _mm_loadu_si128((const __m128i*)&lo[x])));
+        _mm_storeu_si128((__m128i*)&hi[x], _mm_max_epu8(v, _mm_loadu_si128((const __m128i*)&hi[x])));
+    }
+    threshold_minmax_row_scalar(&p[x], n - x, &lo[x], &hi[x]);
+}
+
+// p > t for unsigned bytes is max(p, t) != t; the undecided columns are
+// then blended to 127.
+__attribute__((target("sse2"))) static void threshold_binarize_row_sse2(const uint8_t* p, const uint8_t* thr, const uint8_t* und, int n, uint8_t* out)
+{
+    const __m128i gray = _mm_set1_epi8(127);
+    const __m128i ones = _mm_set1_epi8(-1);
+
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&p[x]);
+        __m128i t = _mm_loadu_si128((const __m128i*)&thr[x]);
+        __m128i u = _mm_loadu_si128((const __m128i*)&und[x]);
+        __m128i gt = _mm_xor_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, t), t), ones);
+        _mm_storeu_si128((__m128i*)&out[x], _mm_or_si128(_mm_andnot_si128(u, gt), _mm_and_si128(u, gray)));
+    }
+    threshold_binarize_row_scalar(&p[x], &thr[x], &und[x], n - x, &out[x]);
+}
+
+__attribute__((target("avx2"))) static void threshold_minmax_row_avx2(const uint8_t* p, int n, uint8_t* lo, uint8_t* hi)
+{
+    int x = 0;
+    for (; x + 32 <= n; x += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&p[x]);
+        _mm256_storeu_si256((__m256i*)&lo[x], _mm256_min_epu8(v, _mm256_loadu_si256((const __m256i*)&lo[x])));
+        _mm256_storeu_si256((__m256i*)&hi[x], _mm256_max_epu8(v, _mm256_loadu_si256((const __m256i*)&hi[x])));
+    }
+    threshold_minmax_row_scalar(&p[x], n - x, &lo[x], &hi[x]);
+}
+
+__attribute__((target("avx2"))) static void threshold_binarize_row_avx2(const uint8_t* p, const uint8_t* thr, const uint8_t* und, int n, uint8_t* out)
+{
+    const __m256i gray = _mm256_set1_epi8(127);
+    const __m256i ones = _mm256_set1_epi8(-1);
+
+    int x = 0;
+    for (; x + 32 <= n; x += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&p[x]);
+        __m256i t = _mm256_loadu_si256((const __m256i*)&thr[x]);
+        __m256i u = _mm256_loadu_si256((const __m256i*)&und[x]);
+        __m256i gt = _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, t), t), ones);
+        _mm256_storeu_si256((__m256i*)&out[x], _mm256_blendv_epi8(gt, gray, u));
+    }
+    threshold_binarize_row_scalar(&p[x], &thr[x], &und[x], n - x, &out[x]);
+}
+
+// AVX-512BW compares straight into mask registers, and masked loads and
+// stores handle the tail of the row.
+__attribute__((target("avx512f,avx512bw"))) static void threshold_minmax_row_avx512(const uint8_t* p, int n, uint8_t* lo, uint8_t* hi)
+{
+    for (int x = 0; x < n; x += 64) {
+        __mmask64 m = n - x >= 64 ? ~(__mmask64)0 : _cvtu64_mask64(UINT64_MAX >> (64 - (n - x)));
+        __m512i v = _mm512_maskz_loadu_epi8(m, &p[x]);
+        _mm512_mask_storeu_epi8(&lo[x], m, _mm512_min_epu8(v, _mm512_maskz_loadu_epi8(m, &lo[x])));
+        _mm512_mask_storeu_epi8(&hi[x], m, _mm512_max_epu8(v, _mm512_maskz_loadu_epi8(m, &hi[x])));
+    }
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void threshold_binarize_row_avx512(const uint8_t* p, const uint8_t* thr, const uint8_t* und, int n, uint8_t* out)
+{
+    const __m512i white = _mm512_set1_epi8(-1);
+    const __m512i gray = _mm512_set1_epi8(127);
+
+    for (int x = 0; x < n; x += 64) {
+        __mmask64 m = n - x >= 64 ? ~(__mmask64)0 : _cvtu64_mask64(UINT64_MAX >> (64 - (n - x)));
+        __m512i v = _mm512_maskz_loadu_epi8(m, &p[x]);
+        __m512i u = _mm512_maskz_loadu_epi8(m, &und[x]);
+        __m512i r = _mm512_maskz_mov_epi8(_mm512_cmpgt_epu8_mask(v, _mm512_maskz_loadu_epi8(m, &thr[x])), white);
+        r = _mm512_mask_mov_epi8(r, _mm512_test_epi8_mask(u, u), gray);
+        _mm512_mask_storeu_epi8(&out[x], m, r);
+    }
+}
+
+#endif
+
+static const char* threshold_kernel_isa = NULL;
+static threshold_minmax_row_t threshold_minmax_row_fn = NULL;
+static threshold_binarize_row_t threshold_binarize_row_fn = NULL;
+
+static void threshold_select(void)
+{
+    if (__atomic_load_n(&threshold_kernel_isa, __ATOMIC_ACQUIRE))
+        return;
+
+    const char* isa = "scalar";
+    threshold_minmax_row_t minmax = threshold_minmax_row_scalar;
+    threshold_binarize_row_t binarize = threshold_binarize_row_scalar;
+
+    // THRESHOLD_ISA=avx2|sse2|scalar caps the kernel choice, like
+    // MATD_COUNT_ISA does for the cell counter.
+    const char* cap = getenv("THRESHOLD_ISA");
+    int level = 3;
+    if (cap && !strcmp(cap, "avx2"))
+        level = 2;
+    else if (cap && !strcmp(cap, "sse2"))
+        level = 1;
+    else if (cap && !strcmp(cap, "scalar"))
+        level = 0;
+
+#ifdef THRESHOLD_X86
+    __builtin_cpu_init();
+    if (level >= 3 && __builtin_cpu_supports("avx512bw")) {
+        isa = "avx512";
+        minmax = threshold_minmax_row_avx512;
+        binarize = threshold_binarize_row_avx512;
+    } else if (level >= 2 && __builtin_cpu_supports("avx2")) {
+        isa = "avx2";
+        minmax = threshold_minmax_row_avx2;
+        binarize = threshold_binarize_row_avx2;
+    } else if (level >= 1 && __builtin_cpu_supports("sse2")) {
+        isa = "sse2";
+        minmax = threshold_minmax_row_sse2;
+        binarize = threshold_binarize_row_sse2;
+    }
+#endif
+
+    // a racing first call from another thread picks the same kernels; the
+    // name is stored last, as it marks the kernels as picked.
+    __atomic_store_n(&threshold_minmax_row_fn, minmax, __ATOMIC_RELAXED);
+    __atomic_store_n(&threshold_binarize_row_fn, binarize, __ATOMIC_RELAXED);
+    __atomic_store_n(&threshold_kernel_isa, isa, __ATOMIC_RELEASE);
+}
+
+const char* threshold_isa(void)
+{
+    threshold_select();
+    return threshold_kernel_isa;
+}
+
+struct threshold_job {
+    const image_u8_t* im;
+    int ts, tw, th;
+    int min_contrast;
+    int nbands;
+
+    // per tile, row-major.
+    uint8_t* mins;
+    uint8_t* maxs;
+    uint8_t* thresh;
+    uint8_t* und; // 0xff if undecided
+
+    uint8_t* scratch; // 2 * width bytes per band
+    uint8_t* out;
+    int stride;
+};
+
+// the rows of tiles [*ty0, *ty1) of band 'i'.
+static void threshold_band(const struct threshold_job* job, int i, int* ty0, int* ty1)
+{
+    *ty0 = (int)((int64_t)job->th * i / job->nbands);
+    *ty1 = (int)((int64_t)job->th * (i + 1) / job->nbands);
+}
+
+// each tile's darkest and brightest pixel.
+static void threshold_statistics(void* arg, int i)
+{
+    const struct threshold_job* job = (const struct threshold_job*)arg;
+    const image_u8_t* im = job->im;
+    int ts = job->ts, tw = job->tw;
+    uint8_t* lo = &job->scratch[(size_t)2 * im->width * i];
+    uint8_t* hi = lo + im->width;
+    // picked by threshold_image() before any band starts.
+    threshold_minmax_row_t minmax = __atomic_load_n(&threshold_minmax_row_fn, __ATOMIC_RELAXED);
+
+    int ty0, ty1;
+    threshold_band(job, i, &ty0, &ty1);
+    for (int ty = ty0; ty < ty1; ty++) {
+        memset(lo, 255, im->width);
+        memset(hi, 0, im->width);
+        int y1 = (ty + 1) * ts < im->height ? (ty + 1) * ts : im->height;
+        for (int y = ty * ts; y < y1; y++)
+            minmax(&im->buf[(int64_t)y * im->stride], im->width, lo, hi);
+
+        for (int tx = 0, x = 0; tx < tw; tx++) {
+            int end = x + ts < im->width ? x + ts : im->width;
+            uint8_t l = 255, h = 0;
+            for (; x < end; x++) {
+                l = lo[x] < l ? lo[x] : l;
+                h = hi[x] > h ? hi[x] : h;
+            }
+            job->mins[ty * tw + tx] = l;
+            job->maxs[ty * tw + tx] = h;
+        }
+    }
+}
+
+// each tile's threshold, from the range of its 3x3 neighbourhood: the
+// three rows of tiles are folded into one first, then each tile takes in
+// its left and right neighbours.
+static void threshold_smooth(void* arg, int i)
+{
+    const struct threshold_job* job = (const struct threshold_job*)arg;
+    int tw = job->tw, th = job->th;
+    uint8_t* lo = &job->scratch[(size_t)2 * job->im->width * i];
+    uint8_t* hi = lo + job->im->width;
+
+    int ty0, ty1;
+    threshold_band(job, i, &ty0, &ty1);
+    for (int ty = ty0; ty < ty1; ty++) {
+        memcpy(lo, &job->mins[ty * tw], tw);
+        memcpy(hi, &job->maxs[ty * tw], tw);
+        for (int y = ty - 1; y <= ty + 1; y += 2) {
+            if (y < 0 || y >= th)
+                continue;
+            const uint8_t* l = &job->mins[y * tw];
+            const uint8_t* h = &job->maxs[y * tw];
+            for (int tx = 0; tx < tw; tx++) {
+                lo[tx] = l[tx] < lo[tx] ? l[tx] : lo[tx];
+                hi[tx] = h[tx] > hi[tx] ? h[tx] : hi[tx];
+            }
+        }
+
+        uint8_t* thresh = &job->thresh[ty * tw];
+        uint8_t* und = &job->und[ty * tw];
+        for (int tx = 0; tx < tw; tx++) {
+            uint8_t l = lo[tx], h = hi[tx];
+            if (tx > 0) {
+                l = lo[tx - 1] < l ? lo[tx - 1] : l;
+                h = hi[tx - 1] > h ? hi[tx - 1] : h;
+            }
+            if (tx + 1 < tw) {
+                l = lo[tx + 1] < l ? lo[tx + 1] : l;
+                h = hi[tx + 1] > h ? hi[tx + 1] : h;
+            }
+            thresh[tx] = l + (h - l) / 2;
+            und[tx] = h - l < job->min_contrast ? 0xff : 0;
+        }
+    }
+}
+
+// spreads the thresholds of decided tiles to undecided ones, a ring of
+// tiles at a time: every tile of a ring takes the mean threshold of its
+// neighbours in earlier rings, so the result does not depend on the order
+// tiles are visited in.
+static void threshold_fill(const struct threshold_job* job, workspace_t* ws)
+{
+    int tw = job->tw, th = job->th;
+    int ntiles = tw * th;
+    int32_t* queue = (int32_t*)workspace_alloc(ws, ntiles * sizeof(int32_t));
+    uint8_t* state = (uint8_t*)workspace_alloc(ws, ntiles); // 0 undecided, 1 queued, 2 decided
+
+    int n = 0;
+    for (int t = 0; t < ntiles; t++) {
+        state[t] = job->und[t] ? 0 : 2;
+        if (state[t])
+            queue[n++] = t;
+    }
+
+    for (int ring = 0; ring < n;) {
+        int end = n;
+        for (int k = ring; k < end; k++) {
+            int tx = queue[k] % tw, ty = queue[k] / tw;
+            for (int y = ty - 1; y <= ty + 1; y++) {
+                for (int x = tx - 1; x <= tx + 1; x++) {
+                    if (y < 0 || y >= th || x < 0 || x >= tw || state[y * tw + x])
+                        continue;
+                    state[y * tw + x] = 1;
+                    queue[n++] = y * tw + x;
+                }
+            }
+        }
+
+        for (int k = end; k < n; k++) {
+            int tx = queue[k] % tw, ty = queue[k] / tw;
+            int sum = 0, count = 0;
+            for (int y = ty - 1; y <= ty + 1; y++) {
+                for (int x = tx - 1; x <= tx + 1; x++) {
+                    if (y < 0 || y >= th || x < 0 || x >= tw || state[y * tw + x] != 2)
+                        continue;
+                    sum += job->thresh[y * tw + x];
+                    count++;
+                }
+            }
+            assert(count > 0);
+            job->thresh[queue[k]] = (uint8_t)((sum + count / 2) / count);
+            job->und[queue[k]] = 0;
+        }
+        for (int k = end; k < n; k++)
+            state[queue[k]] = 2;
+        ring = end;
+    }
+}
+
+static void threshold_binarize(void* arg, int i)
+{
+    const struct threshold_job* job = (const struct threshold_job*)arg;
+    const image_u8_t* im = job->im;
+    int ts = job->ts, tw = job->tw;
+    uint8_t* thr = &job->scratch[(size_t)2 * im->width * i];
+    uint8_t* und = thr + im->width;
+    threshold_binarize_row_t binarize = __atomic_load_n(&threshold_binarize_row_fn, __ATOMIC_RELAXED);
+
+    int ty0, ty1;
+    threshold_band(job, i, &ty0, &ty1);
+    for (int ty = ty0; ty < ty1; ty++) {
+        for (int tx = 0, x = 0; tx < tw; tx++) {
+            int end = x + ts < im->width ? x + ts : im->width;
+            memset(&thr[x], job->thresh[ty * tw + tx], end - x);
+            memset(&und[x], job->und[ty * tw + tx], end - x);
+            x = end;
+        }
+
+        int y1 = (ty + 1) * ts < im->height ? (ty + 1) * ts : im->height;
+        for (int y = ty * ts; y < y1; y++)
+            binarize(&im->buf[(int64_t)y * im->stride], thr, und, im->width, &job->out[(int64_t)y * job->stride]);
+    }
+}
+
+void threshold_image(const image_u8_t* im, const threshold_config_t* config, workspace_t* ws, uint8_t* out, int stride)
+{
+    threshold_select();
+
+    struct threshold_job job;
+    job.im = im;
+    job.ts = config->tile_size > 0 ? config->tile_size : 1;
+    job.tw = (im->width + job.ts - 1) / job.ts;
+    job.th = (im->height + job.ts - 1) / job.ts;
+    job.min_contrast = config->min_contrast;
+    job.out = out;
+    job.stride = stride;
+
+    // enough bands to keep every thread busy, but none too small to be
+    // worth the hand-off.
+    int64_t npixels = (int64_t)im->width * im->height;
+    int nbands = 1;
+    if (config->pool) {
+        int64_t most = npixels / THRESHOLD_BAND_PIXELS;
+        nbands = THRESHOLD_BANDS_PER_THREAD * (pool_size(config->pool) + 1);
+        nbands = nbands < most ? nbands : (int)most;
+    }
+    nbands = nbands < job.th ? nbands : job.th;
+    job.nbands = nbands > 1 ? nbands : 1;
+
+    // everything the bands use is allocated here: the workspace is not for
+    // the pool's threads.
+    size_t ntiles = (size_t)job.tw * job.th;
+    job.mins = (uint8_t*)workspace_alloc(ws, ntiles);
+    job.maxs = (uint8_t*)workspace_alloc(ws, ntiles);
+    job.thresh = (uint8_t*)workspace_alloc(ws, ntiles);
+    job.und = (uint8_t*)workspace_alloc(ws, ntiles);
+    job.scratch = (uint8_t*)workspace_alloc(ws, (size_t)2 * im->width * job.nbands);
+
+    pool_for(config->pool, job.nbands, threshold_statistics, &job);
+    pool_for(config->pool, job.nbands, threshold_smooth, &job);
+    if (config->fill)
+        threshold_fill(&job, ws);
+    pool_for(config->pool, job.nbands, threshold_binarize, &job);
+}
@@ -0,0 +1,59 @@
+#ifndef _THRESHOLD_H
+#define _THRESHOLD_H
+
+#include <stdint.h>
+
+#include "image_u8.h"
+#include "pool.h"
+#include "workspace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Adaptive binarization over tiles, for frames whose lighting is uneven
+ * enough that no single threshold fits them all. It runs in three passes:
+ *
+ *   statistics  the darkest and brightest pixel of every tile of
+ *               tile_size x tile_size pixels.
+ *   smoothing   each tile's range is widened to its 3x3 neighbourhood of
+ *               tiles, so a pixel near an edge between tiles sees both sides
+ *               of it; the tile's threshold is the middle of that range.
+ *               Tiles with less than min_contrast between the two have no
+ *               edge to go by and are undecided.
+ *   binarize    each pixel is compared with its tile's threshold.
+ *
+ * The first and last passes read every pixel, so they run on SIMD kernels
+ * picked for the running CPU, and are split into bands of tile rows that
+ * run in parallel on 'pool'. Bands never share a tile, so the output does
+ * not depend on how many threads ran it.
+ */
+typedef struct {
+    int tile_size; // in pixels, 1 or more
+    int min_contrast; // least difference between white and black
+    int fill; // undecided tiles take the threshold of the nearest decided ones
+    pool_t* pool; // runs the bands; NULL runs them on the calling thread
+} threshold_config_t;
+
+/**
+ * Writes 0 (black) or 255 (white) per pixel of 'im' to 'out', whose rows are
+ * 'stride' bytes apart. Pixels of undecided tiles are written as 127: every
+ * undecided tile without 'fill', and none with it unless the whole frame is
+ * undecided. Temporaries come from 'ws', and the pool threads do not touch
+ * it.
+ */
+void threshold_image(const image_u8_t* im, const threshold_config_t* config, workspace_t* ws, uint8_t* out, int stride);
+
+/**
+ * Returns the name of the kernels threshold_image() uses on this CPU:
+ * "avx512", "avx2", "sse2" or "scalar". THRESHOLD_ISA=avx2|sse2|scalar
+ * caps the choice.
+ */
+const char* threshold_isa(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,153 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workspace.h"
+
+#define WORKSPACE_ALIGN 64
+
+// the block header is padded to the alignment, so data starts aligned.
+#define WORKSPACE_HEADER ((sizeof(workspace_block_t) + WORKSPACE_ALIGN - 1) & ~(size_t)(WORKSPACE_ALIGN - 1))
+
+static uint64_t workspace_nallocs = 0;
+
+#ifdef WORKSPACE_COUNT_ALLOCS
+
+// route the process' allocations through counting wrappers around glibc's
+// allocator.
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t align, size_t size);
+
+void* malloc(size_t size)
+{
+    __atomic_add_fetch(&workspace_nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    __atomic_add_fetch(&workspace_nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size)
+{
+    __atomic_add_fetch(&workspace_nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, size);
+}
+
+void* aligned_alloc(size_t align, size_t size)
+{
+    __atomic_add_fetch(&workspace_nallocs, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(align, size);
+}
+
+int posix_memalign(void** p, size_t align, size_t size)
+{
+    __atomic_add_fetch(&workspace_nallocs, 1, __ATOMIC_RELAXED);
+    *p = __libc_memalign(align, size);
+    return *p ? 0 : 12; // ENOMEM
+}
+}
+
+#define workspace_malloc(size) aligned_alloc(WORKSPACE_ALIGN, size)
+
+#else
+
+static void* workspace_malloc(size_t size)
+{
+    __atomic_add_fetch(&workspace_nallocs, 1, __ATOMIC_RELAXED);
+    return aligned_alloc(WORKSPACE_ALIGN, size);
+}
+
+#endif
+
+uint64_t workspace_heap_allocs(void)
+{
+    return __atomic_load_n(&workspace_nallocs, __ATOMIC_RELAXED);
+}
+
+static workspace_block_t* workspace_block_create(size_t size)
+{
+    size = (size + WORKSPACE_ALIGN - 1) & ~(size_t)(WORKSPACE_ALIGN - 1);
+
+    workspace_block_t* block = (workspace_block_t*)workspace_malloc(WORKSPACE_HEADER + size);
+    assert(block != NULL);
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    return block;
+}
+
+workspace_t* workspace_create(size_t size)
+{
+    workspace_t* ws = (workspace_t*)calloc(1, sizeof(workspace_t));
+    if (size > 0)
+        ws->block = workspace_block_create(size);
+
+    return ws;
+}
+
+void workspace_destroy(workspace_t* ws)
+{
+    if (!ws)
+        return;
+
+    workspace_reset(ws);
+    free(ws->block);
+    free(ws);
+}
+
+void* workspace_alloc(workspace_t* ws, size_t size)
+{
+    size = (size + WORKSPACE_ALIGN - 1) & ~(size_t)(WORKSPACE_ALIGN - 1);
+    ws->frame_used += size;
+
+    workspace_block_t* block = ws->block;
+    if (!block || block->size - block->used < size) {
+        // chain a block at least as big as everything used so far this
+        // frame, so a frame needs only a few of them.
+        if (block) {
+            block->next = ws->overflow;
+            ws->overflow = block;
+        }
+        block = ws->block = workspace_block_create(size > ws->frame_used ? size : ws->frame_used);
+    }
+
+    void* p = (uint8_t*)block + WORKSPACE_HEADER + block->used;
+    block->used += size;
+
+    return p;
+}
+
+void* workspace_calloc(workspace_t* ws, size_t size)
+{
+    void* p = workspace_alloc(ws, size);
+    memset(p, 0, size);
+    return p;
+}
+
+void workspace_reset(workspace_t* ws)
+{
+    if (ws->frame_used > ws->high_water)
+        ws->high_water = ws->frame_used;
+
+    // replace a frame's chain of blocks with one block that holds it all.
+    if (ws->overflow) {
+        while (ws->overflow) {
+            workspace_block_t* next = ws->overflow->next;
+            free(ws->overflow);
+            ws->overflow = next;
+        }
+        free(ws->block);
+        ws->block = workspace_block_create(ws->high_water);
+    }
+
+    if (ws->block)
+        ws->block->used = 0;
+    ws->frame_used = 0;
+}
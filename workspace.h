@@ -0,0 +1,72 @@
+#ifndef _WORKSPACE_H
+#define _WORKSPACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A frame-scoped arena for the detector's temporaries. Allocations are
+ * carved out of one block and never freed one by one; workspace_reset()
+ * releases all of them at once between frames.
+ *
+ * The block is sized at first use: when a frame needs more than it holds,
+ * overflow blocks are chained on, and the next reset replaces them all with
+ * a single block as large as the most any frame has used. From then on,
+ * frames of the same size allocate nothing from the heap.
+ */
+typedef struct workspace_block {
+    struct workspace_block* next;
+    size_t size, used;
+} workspace_block_t;
+
+typedef struct {
+    workspace_block_t* block; // the block allocations come from
+    workspace_block_t* overflow; // blocks filled up this frame
+    size_t frame_used; // bytes handed out since the last reset
+    size_t high_water; // the most any frame has used
+} workspace_t;
+
+/**
+ * Creates a workspace whose first block holds 'size' bytes; 0 defers
+ * sizing to the first frame. It is the caller's responsibility to call
+ * workspace_destroy() on the returned workspace.
+ */
+workspace_t* workspace_create(size_t size);
+
+void workspace_destroy(workspace_t* ws);
+
+/**
+ * Returns 'size' uninitialized bytes, aligned to 64 bytes, that stay valid
+ * until the next workspace_reset().
+ */
+void* workspace_alloc(workspace_t* ws, size_t size);
+
+/**
+ * Like workspace_alloc(), with the bytes zeroed.
+ */
+void* workspace_calloc(workspace_t* ws, size_t size);
+
+/**
+ * Releases everything allocated since the last reset. Call it between
+ * frames.
+ */
+void workspace_reset(workspace_t* ws);
+
+/**
+ * Test hook: the number of heap allocations made so far. Built with
+ * -DWORKSPACE_COUNT_ALLOCS this counts every malloc(), calloc(), realloc()
+ * and aligned allocation of the process; otherwise only those made by
+ * workspaces. Compare it before and after a frame to check that the steady
+ * state does not allocate.
+ */
+uint64_t workspace_heap_allocs(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif